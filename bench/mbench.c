@@ -0,0 +1,746 @@
+/*
+ * Copyright (c) 2022  Joachim Wiberg <troglobit@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Benchmark and packet replay of the libmdnsd hot paths
+ *
+ * Drives mdnsd_input() and mdnsd_out() directly, without
+ * any sockets, with synthetic traffic or packets from a pcap file.  The
+ * library is linked statically with gettimeofday() and the allocators
+ * wrapped: time is virtual, advanced per packet, so the same input gets
+ * the same output every run and allocations per packet can be counted.
+ * Only the ns/pkt and pkts/s columns depend on the machine.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "libmdnsd/mdnsd.h"
+#include "pcap.h"
+
+#define NUM_PKTS   20000		/* Measured per scenario, -n NUM */
+#define MAX_GAP    1000000		/* Max usec between pcap packets */
+#define FRAME      1400
+
+struct pkt {
+	unsigned char  *data;
+	size_t          len;
+	struct in_addr  src;
+	unsigned short  port;
+	long            gap;		/* usec since previous packet */
+};
+
+struct bench {
+	mdns_daemon_t  *d;
+	struct pkt     *pkts;
+	size_t          num, max;
+	const char     *file;		/* pcap, for replay */
+};
+
+struct result {
+	char            name[16];
+	double          pkts;
+	double          pps, ns, in_ns, out_ns;
+	double          allocs, out, bytes;
+	double          rss;
+};
+
+struct scenario {
+	const char     *name;
+	int           (*setup)(struct bench *b);
+	const char     *desc;
+};
+
+/*
+ * Virtual clock and allocation counters, see -Wl,--wrap in Makefile.am
+ */
+static struct timeval vclock = { 1600000000, 0 };
+static int counting;
+static unsigned long long allocs;
+
+/* For building packets, and the output drained by settle() and run() */
+static unsigned char pkt[MAX_PACKET_LEN];
+static struct message msg;
+
+int   __wrap_gettimeofday(struct timeval *tv, void *tz);
+void *__wrap_malloc(size_t len);
+void *__wrap_calloc(size_t num, size_t len);
+void *__wrap_realloc(void *ptr, size_t len);
+char *__wrap_strdup(const char *s);
+void *__real_malloc(size_t len);
+void *__real_calloc(size_t num, size_t len);
+void *__real_realloc(void *ptr, size_t len);
+
+int __wrap_gettimeofday(struct timeval *tv, void *tz)
+{
+	(void)tz;
+	*tv = vclock;
+	return 0;
+}
+
+void *__wrap_malloc(size_t len)
+{
+	allocs += counting;
+	return __real_malloc(len);
+}
+
+void *__wrap_calloc(size_t num, size_t len)
+{
+	allocs += counting;
+	return __real_calloc(num, len);
+}
+
+void *__wrap_realloc(void *ptr, size_t len)
+{
+	allocs += counting;
+	return __real_realloc(ptr, len);
+}
+
+char *__wrap_strdup(const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *ptr;
+
+	ptr = __wrap_malloc(len);
+	if (ptr)
+		memcpy(ptr, s, len);
+
+	return ptr;
+}
+
+static void advance(long usec)
+{
+	vclock.tv_usec += usec;
+	vclock.tv_sec  += vclock.tv_usec / 1000000;
+	vclock.tv_usec %= 1000000;
+}
+
+static double nsec(struct timespec *a, struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1e9 + (b->tv_nsec - a->tv_nsec);
+}
+
+static struct in_addr host(int n)
+{
+	struct in_addr ip;
+
+	ip.s_addr = htonl(0x0a000000 | (n + 2));	/* 10.0.0.2 ... */
+	return ip;
+}
+
+/* Append the packet in m, with given source and gap to previous one */
+static int add(struct bench *b, struct message *m, struct in_addr src, unsigned short port, long gap)
+{
+	struct pkt *p;
+	int len;
+
+	if (b->num == b->max) {
+		size_t max = b->max ? b->max * 2 : 256;
+
+		p = realloc(b->pkts, max * sizeof(*p));
+		if (!p)
+			return -1;
+		b->pkts = p;
+		b->max = max;
+	}
+
+	len = message_packet_len(m);
+	p = &b->pkts[b->num];
+	p->data = malloc(len);
+	if (!p->data)
+		return -1;
+	memcpy(p->data, message_packet(m), len);
+	p->len  = len;
+	p->src  = src;
+	p->port = port;
+	p->gap  = gap;
+	b->num++;
+
+	return 0;
+}
+
+static void conflict(char *name, int type, void *arg)
+{
+	(void)arg;
+	fprintf(stderr, "mbench: unexpected conflict for %s type %d\n", name, type);
+}
+
+static int answer(mdns_answer_t *a, void *arg)
+{
+	(void)a;
+	(void)arg;
+	return 0;
+}
+
+static void type_name(char *buf, size_t len, int t)
+{
+	snprintf(buf, len, "_svc%02d._tcp.local.", t);
+}
+
+static void inst_name(char *buf, size_t len, int t, int i)
+{
+	snprintf(buf, len, "inst%04d._svc%02d._tcp.local.", i, t);
+}
+
+/* Responder with instances of each type, like mdnsd does for .service files */
+static mdns_daemon_t *responder(int types, int instances)
+{
+	struct in_addr ip = { .s_addr = htonl(0xc0000201) };	/* 192.0.2.1 */
+	mdns_daemon_t *d;
+	mdns_record_t *r;
+	char type[64], name[64];
+
+	d = mdnsd_new(QCLASS_IN, FRAME);
+	if (!d)
+		return NULL;
+	mdnsd_set_address(d, ip);
+
+	r = mdnsd_unique(d, "bench.local.", QTYPE_A, 120, conflict, NULL);
+	mdnsd_set_ip(d, r, ip);
+
+	for (int t = 0; t < types; t++) {
+		type_name(type, sizeof(type), t);
+		r = mdnsd_shared(d, DISCO_NAME, QTYPE_PTR, 4500);
+		mdnsd_set_host(d, r, type);
+
+		for (int i = 0; i < instances; i++) {
+			inst_name(name, sizeof(name), t, i);
+			r = mdnsd_shared(d, type, QTYPE_PTR, 4500);
+			mdnsd_set_host(d, r, name);
+			r = mdnsd_unique(d, name, QTYPE_SRV, 120, conflict, NULL);
+			mdnsd_set_srv(d, r, 0, 0, 8000 + i, "bench.local.");
+			r = mdnsd_unique(d, name, QTYPE_TXT, 4500, conflict, NULL);
+			mdnsd_set_raw(d, r, "\011path=/foo\007version", 18);
+		}
+	}
+
+	return d;
+}
+
+/* 64 hosts browsing for one of 16 types each, 500 queries/sec */
+static int browse(struct bench *b)
+{
+	struct message *m = &msg;
+	char type[64];
+
+	b->d = responder(16, 8);
+	if (!b->d)
+		return -1;
+
+	for (int h = 0; h < 256; h++) {
+		message_init(m, pkt, sizeof(pkt));
+		type_name(type, sizeof(type), h % 16);
+		message_qd(m, type, QTYPE_PTR, QCLASS_IN);
+		if (add(b, m, host(h % 64), 5353, 2000))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* 32 hosts browsing for 200 instances, knowing 150 of them */
+static int known(struct bench *b)
+{
+	struct message *m = &msg;
+	char type[64], name[64];
+
+	b->d = responder(1, 200);
+	if (!b->d)
+		return -1;
+
+	type_name(type, sizeof(type), 0);
+	for (int h = 0; h < 32; h++) {
+		message_init(m, pkt, sizeof(pkt));
+		message_qd(m, type, QTYPE_PTR, QCLASS_IN);
+		for (int i = 0; i < 150; i++) {
+			inst_name(name, sizeof(name), 0, (h + i * 4 / 3) % 200);
+			message_an(m, type, QTYPE_PTR, QCLASS_IN, 4000);
+			message_rdata_name(m, name);
+		}
+		if (add(b, m, host(h), 5353, 10000))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Browser caching 2000 hosts announcing one service each, 8000 records */
+static int cache(struct bench *b)
+{
+	struct in_addr ip = { .s_addr = htonl(0xc0000201) };
+	struct message *m = &msg;
+	char type[64], name[64], target[64];
+
+	b->d = mdnsd_new(QCLASS_IN, FRAME);
+	if (!b->d)
+		return -1;
+	mdnsd_set_address(b->d, ip);
+
+	type_name(type, sizeof(type), 0);
+	mdnsd_query(b->d, type, QTYPE_PTR, answer, NULL);
+
+	for (int h = 0; h < 2000; h++) {
+		message_init(m, pkt, sizeof(pkt));
+		m->header.qr = 1;
+		m->header.aa = 1;
+
+		inst_name(name, sizeof(name), 0, h);
+		snprintf(target, sizeof(target), "host%04d.local.", h);
+		message_an(m, type, QTYPE_PTR, QCLASS_IN, 4500);
+		message_rdata_name(m, name);
+		message_an(m, name, QTYPE_SRV, QCLASS_IN + 32768, 120);
+		message_rdata_srv(m, 0, 0, 80, target);
+		message_an(m, name, QTYPE_TXT, QCLASS_IN + 32768, 4500);
+		message_rdata_raw(m, (unsigned char *)"\011path=/foo", 10);
+		message_an(m, target, QTYPE_A, QCLASS_IN + 32768, 120);
+		message_rdata_long(m, host(h));
+
+		if (add(b, m, host(h), 5353, 1000))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* 64 hosts enumerating 48 service types */
+static int disco(struct bench *b)
+{
+	struct message *m = &msg;
+
+	b->d = responder(48, 2);
+	if (!b->d)
+		return -1;
+
+	for (int h = 0; h < 64; h++) {
+		message_init(m, pkt, sizeof(pkt));
+		message_qd(m, DISCO_NAME, QTYPE_PTR, QCLASS_IN);
+		if (add(b, m, host(h), 5353, 5000))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Responder browsing one type, on a busy segment of other services */
+static int foreign(struct bench *b)
+{
+	struct message *m = &msg;
+	char type[64], name[96], target[64];
+
+	b->d = responder(16, 8);
+	if (!b->d)
+		return -1;
+	type_name(type, sizeof(type), 0);
+	mdnsd_query(b->d, type, QTYPE_PTR, answer, NULL);
+
+	for (int h = 0; h < 256; h++) {
+		message_init(m, pkt, sizeof(pkt));
+		snprintf(type, sizeof(type), "_other%02d._tcp.local.", h % 32);
+		if (h % 2) {
+			message_qd(m, type, QTYPE_PTR, QCLASS_IN);
+		} else {
+			m->header.qr = 1;
+			m->header.aa = 1;
+
+			snprintf(name, sizeof(name), "inst%04d.%s", h, type);
+			snprintf(target, sizeof(target), "other%04d.local.", h);
+			message_an(m, type, QTYPE_PTR, QCLASS_IN, 4500);
+			message_rdata_name(m, name);
+			message_an(m, name, QTYPE_SRV, QCLASS_IN + 32768, 120);
+			message_rdata_srv(m, 0, 0, 80, target);
+			message_an(m, target, QTYPE_A, QCLASS_IN + 32768, 120);
+			message_rdata_long(m, host(h));
+		}
+		if (add(b, m, host(h), 5353, 1000))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int replay_pkt(struct pcap_pkt *pp, void *arg)
+{
+	static struct timeval last;
+	struct bench *b = (struct bench *)arg;
+	struct pkt *p;
+	long gap = 0;
+
+	if (b->num) {
+		gap = (pp->ts.tv_sec - last.tv_sec) * 1000000L + (pp->ts.tv_usec - last.tv_usec);
+		if (gap < 0)
+			gap = 0;
+		if (gap > MAX_GAP)
+			gap = MAX_GAP;
+	}
+	last = pp->ts;
+
+	if (pp->len > MAX_PACKET_LEN)
+		return 0;
+
+	if (b->num == b->max) {
+		size_t max = b->max ? b->max * 2 : 256;
+
+		p = realloc(b->pkts, max * sizeof(*p));
+		if (!p)
+			return -1;
+		b->pkts = p;
+		b->max = max;
+	}
+
+	p = &b->pkts[b->num];
+	p->data = malloc(pp->len ? pp->len : 1);
+	if (!p->data)
+		return -1;
+	memcpy(p->data, pp->data, pp->len);
+	p->len  = pp->len;
+	p->src  = pp->src;
+	p->port = pp->sport;
+	p->gap  = gap;
+	b->num++;
+
+	return 0;
+}
+
+/* Packets from a capture, to a responder also browsing everything */
+static int pcap(struct bench *b)
+{
+	b->d = responder(16, 8);
+	if (!b->d)
+		return -1;
+	mdnsd_query(b->d, DISCO_NAME, QTYPE_PTR, answer, NULL);
+
+	if (pcap_read(b->file, replay_pkt, b) < 0) {
+		fprintf(stderr, "mbench: failed reading %s: %s\n", b->file, strerror(errno));
+		return -1;
+	}
+	if (!b->num) {
+		fprintf(stderr, "mbench: no mDNS packets in %s\n", b->file);
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct scenario scenarios[] = {
+	{ "browse", browse, "browse storm, 64 hosts x 16 types" },
+	{ "known",  known,  "150 known answers per query" },
+	{ "cache",  cache,  "8000 cached records, refreshed" },
+	{ "disco",  disco,  "service type enumeration, 48 types" },
+	{ "foreign", foreign, "traffic for other names only" },
+	{ "pcap",   pcap,   "replay of -r FILE" },
+};
+
+/* Drain output, with time advanced, until there is nothing more to send */
+static void settle(mdns_daemon_t *d, long usec)
+{
+	static struct message m;
+	unsigned short port;
+	struct in_addr ip;
+
+	message_init(&m, pkt, sizeof(pkt));
+	for (long t = 0; t < usec; t += 10000) {
+		advance(10000);
+		while (mdnsd_out(d, &m, &ip, &port))
+			;
+	}
+}
+
+static void run(struct bench *b, size_t num, struct result *res)
+{
+	static struct message m;
+	struct timespec t0, t1, t2;
+	double in_ns = 0, out_ns = 0;
+	unsigned long long outs = 0, bytes = 0;
+	unsigned short port;
+	struct in_addr ip;
+	struct rusage ru;
+
+	/* Probe and announce, then one round to warm up and fill the cache */
+	message_init(&m, pkt, sizeof(pkt));
+	settle(b->d, 5000000);
+	for (size_t i = 0; i < b->num; i++) {
+		struct pkt *p = &b->pkts[i];
+
+		advance(p->gap);
+		mdnsd_input(b->d, p->data, p->len, p->src, p->port);
+		while (mdnsd_out(b->d, &m, &ip, &port))
+			;
+	}
+
+	allocs = 0;
+	for (size_t i = 0; i < num; i++) {
+		struct pkt *p = &b->pkts[i % b->num];
+
+		advance(p->gap);
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		counting = 1;
+		mdnsd_input(b->d, p->data, p->len, p->src, p->port);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		while (mdnsd_out(b->d, &m, &ip, &port)) {
+			outs++;
+			bytes += message_packet_len(&m);
+		}
+		counting = 0;
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+
+		in_ns  += nsec(&t0, &t1);
+		out_ns += nsec(&t1, &t2);
+	}
+
+	getrusage(RUSAGE_SELF, &ru);
+	res->pkts   = num;
+	res->in_ns  = in_ns / num;
+	res->out_ns = out_ns / num;
+	res->ns     = res->in_ns + res->out_ns;
+	res->pps    = 1e9 / res->ns;
+	res->allocs = (double)allocs / num;
+	res->out    = (double)outs / num;
+	res->bytes  = (double)bytes / num;
+	res->rss    = ru.ru_maxrss;
+}
+
+static void bench_free(struct bench *b)
+{
+	for (size_t i = 0; i < b->num; i++)
+		free(b->pkts[i].data);
+	free(b->pkts);
+	mdnsd_free(b->d);
+	memset(b, 0, sizeof(*b));
+}
+
+/* Input packets of scenario to capture file, for inspection */
+static int dump(FILE *fp, struct bench *b)
+{
+	struct timeval ts = vclock;
+
+	for (size_t i = 0; i < b->num; i++) {
+		struct pcap_pkt pp = {
+			.src   = b->pkts[i].src,
+			.sport = b->pkts[i].port,
+			.data  = b->pkts[i].data,
+			.len   = b->pkts[i].len,
+		};
+
+		ts.tv_usec += b->pkts[i].gap;
+		ts.tv_sec  += ts.tv_usec / 1000000;
+		ts.tv_usec %= 1000000;
+		pp.ts = ts;
+		if (pcap_write(fp, &pp))
+			return -1;
+	}
+
+	return 0;
+}
+
+#define FMT_HDR "%-8s %8s %10s %8s %8s %8s %8s %6s %8s %8s\n"
+#define FMT_RES "%-8s %8.0f %10.0f %8.1f %8.1f %8.1f %8.3f %6.3f %8.1f %8.0f\n"
+
+static void print(struct result *r)
+{
+	printf(FMT_RES, r->name, r->pkts, r->pps, r->ns, r->in_ns, r->out_ns,
+	       r->allocs, r->out, r->bytes, r->rss);
+}
+
+static int parse(char *line, struct result *r)
+{
+	return sscanf(line, "%15s %lf %lf %lf %lf %lf %lf %lf %lf %lf", r->name, &r->pkts,
+		      &r->pps, &r->ns, &r->in_ns, &r->out_ns, &r->allocs, &r->out,
+		      &r->bytes, &r->rss) == 10 ? 0 : -1;
+}
+
+static double pct(double now, double then)
+{
+	return then > 0 ? (now - then) * 100 / then : 0;
+}
+
+/* Same value, as printed with prec decimals */
+static int same(double now, double then, int prec)
+{
+	char a[32], b[32];
+
+	snprintf(a, sizeof(a), "%.*f", prec, now);
+	snprintf(b, sizeof(b), "%.*f", prec, then);
+
+	return !strcmp(a, b);
+}
+
+/* Compare with an earlier run, the deterministic columns must match */
+static void compare(const char *file, struct result *res, size_t num)
+{
+	char line[256];
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		fprintf(stderr, "mbench: cannot open %s: %s\n", file, strerror(errno));
+		return;
+	}
+
+	printf("\nCompared to %s:\n", file);
+	while (fgets(line, sizeof(line), fp)) {
+		struct result base;
+
+		if (line[0] == '#' || parse(line, &base))
+			continue;
+
+		for (size_t i = 0; i < num; i++) {
+			struct result *r = &res[i];
+
+			if (strcmp(r->name, base.name))
+				continue;
+
+			printf("%-8s ns/pkt %+6.1f%%  allocs/pkt %+.3f  out/pkt %+.3f  bytes/pkt %+.1f  rss %+.0f kB%s\n",
+			       r->name, pct(r->ns, base.ns), r->allocs - base.allocs, r->out - base.out,
+			       r->bytes - base.bytes, r->rss - base.rss,
+			       r->pkts == base.pkts && (!same(r->allocs, base.allocs, 3) || !same(r->out, base.out, 3) ||
+							!same(r->bytes, base.bytes, 1)) ? "  (behavior changed)" : "");
+		}
+	}
+	fclose(fp);
+}
+
+static int usage(int code)
+{
+	printf("usage: mbench [-hT] [-c FILE] [-n NUM] [-r PCAP] [-s NAME] [-w PCAP]\n"
+	       "\n"
+	       "  -c FILE   Compare with earlier output, e.g. baseline.txt\n"
+	       "  -h        This help text\n"
+	       "  -n NUM    Packets per scenario, default: %d\n"
+	       "  -r PCAP   Also replay mDNS packets from capture file\n"
+	       "  -s NAME   Only run scenario NAME\n"
+	       "  -T        Trace events to a ring, as mdnsd does\n"
+	       "  -w PCAP   Save input of all scenarios run to capture file\n"
+	       "\n"
+	       "Scenarios:\n", NUM_PKTS);
+	for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+		printf("  %-8s  %s\n", scenarios[i].name, scenarios[i].desc);
+
+	return code;
+}
+
+int main(int argc, char *argv[])
+{
+	struct result res[sizeof(scenarios) / sizeof(scenarios[0])];
+	char *base = NULL, *only = NULL, *save = NULL;
+	struct bench b = { 0 };
+	size_t num = NUM_PKTS;
+	size_t i, n = 0;
+	FILE *fp = NULL;
+	int c;
+
+	while ((c = getopt(argc, argv, "c:hn:r:s:Tw:")) != EOF) {
+		switch (c) {
+		case 'c':
+			base = optarg;
+			break;
+
+		case 'h':
+			return usage(0);
+
+		case 'n':
+			num = strtoul(optarg, NULL, 0);
+			if (!num)
+				return usage(1);
+			break;
+
+		case 'r':
+			b.file = optarg;
+			break;
+
+		case 's':
+			only = optarg;
+			break;
+
+		case 'T':
+			if (mdnsd_trace_init(4096)) {
+				fprintf(stderr, "mbench: cannot create trace ring: %s\n", strerror(errno));
+				return 1;
+			}
+			break;
+
+		case 'w':
+			save = optarg;
+			break;
+
+		default:
+			return usage(1);
+		}
+	}
+
+	if (save) {
+		fp = pcap_create(save);
+		if (!fp) {
+			fprintf(stderr, "mbench: cannot create %s: %s\n", save, strerror(errno));
+			return 1;
+		}
+	}
+
+	printf("# " FMT_HDR, "scenario", "pkts", "pkts/s", "ns/pkt", "in_ns", "out_ns",
+	       "allocs", "out", "bytes", "rss_kb");
+	for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+		struct scenario *s = &scenarios[i];
+		const char *file = b.file;
+
+		if (only && strcmp(only, s->name))
+			continue;
+		if (s->setup == pcap && !file)
+			continue;
+
+		if (s->setup(&b)) {
+			fprintf(stderr, "mbench: failed setting up %s\n", s->name);
+			bench_free(&b);
+			return 1;
+		}
+		if (fp && dump(fp, &b)) {
+			fprintf(stderr, "mbench: failed writing %s: %s\n", save, strerror(errno));
+			return 1;
+		}
+
+		memset(&res[n], 0, sizeof(res[n]));
+		strncpy(res[n].name, s->name, sizeof(res[n].name) - 1);
+		run(&b, num, &res[n]);
+		print(&res[n++]);
+		fflush(stdout);
+
+		bench_free(&b);
+		b.file = file;
+	}
+
+	if (fp)
+		fclose(fp);
+	if (base)
+		compare(base, res, n);
+
+	return 0;
+}
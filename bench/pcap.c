@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2022  Joachim Wiberg <troglobit@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "pcap.h"
+
+#define PCAP_MAGIC     0xa1b2c3d4	/* usec timestamps */
+#define PCAP_MAGIC_NS  0xa1b23c4d	/* nsec timestamps */
+
+#define LINKTYPE_NULL  0		/* BSD loopback, family in host order */
+#define LINKTYPE_ETH   1
+#define LINKTYPE_RAW   101
+#define LINKTYPE_SLL   113		/* Linux cooked */
+#define LINKTYPE_IPV4  228
+#define LINKTYPE_IPV6  229
+#define LINKTYPE_SLL2  276
+
+#define MDNS_PORT      5353
+
+struct pcap_hdr {
+	uint32_t magic;
+	uint16_t major, minor;
+	int32_t  zone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_rec {
+	uint32_t sec, frac;
+	uint32_t caplen, len;
+};
+
+static uint32_t swap32(uint32_t v, int swap)
+{
+	return swap ? __builtin_bswap32(v) : v;
+}
+
+static unsigned short get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+/* UDP header and payload, at p, to or from mDNS */
+static int udp(struct pcap_pkt *pkt, const unsigned char *p, size_t len)
+{
+	size_t ulen;
+
+	if (len < 8)
+		return 0;
+	if (get16(p) != MDNS_PORT && get16(p + 2) != MDNS_PORT)
+		return 0;
+
+	ulen = get16(p + 4);
+	if (ulen < 8 || ulen > len)
+		return 0;
+
+	pkt->sport = get16(p);
+	pkt->data  = p + 8;
+	pkt->len   = ulen - 8;
+
+	return 1;
+}
+
+static int ipv4(struct pcap_pkt *pkt, const unsigned char *p, size_t len)
+{
+	size_t hlen, tlen;
+
+	if (len < 20 || (p[0] >> 4) != 4)
+		return 0;
+
+	hlen = (p[0] & 0x0f) * 4;
+	tlen = get16(p + 2);
+	if (hlen < 20 || tlen < hlen || tlen > len)
+		return 0;
+
+	/* Fragments, or not UDP */
+	if ((get16(p + 6) & 0x3fff) || p[9] != IPPROTO_UDP)
+		return 0;
+
+	memcpy(&pkt->src, p + 12, 4);
+	return udp(pkt, p + hlen, tlen - hlen);
+}
+
+static int ipv6(struct pcap_pkt *pkt, const unsigned char *p, size_t len)
+{
+	size_t off = 40, plen;
+	unsigned char next;
+
+	if (len < 40 || (p[0] >> 4) != 6)
+		return 0;
+
+	plen = get16(p + 4);
+	if (plen + 40 > len)
+		return 0;
+	len  = plen + 40;
+	next = p[6];
+
+	/* Skip hop-by-hop, routing and destination options */
+	while (next == 0 || next == 43 || next == 60) {
+		if (off + 8 > len)
+			return 0;
+		next = p[off];
+		off += (p[off + 1] + 1) * 8;
+	}
+	if (next != IPPROTO_UDP || off > len)
+		return 0;
+
+	memcpy(&pkt->src, p + 8 + 12, 4);
+	return udp(pkt, p + off, len - off);
+}
+
+/* IP packet of given ethertype */
+static int ip(struct pcap_pkt *pkt, unsigned short type, const unsigned char *p, size_t len)
+{
+	if (type == 0x0800)
+		return ipv4(pkt, p, len);
+	if (type == 0x86dd)
+		return ipv6(pkt, p, len);
+
+	return 0;
+}
+
+static int frame(struct pcap_pkt *pkt, uint32_t linktype, int swap, const unsigned char *p, size_t len)
+{
+	unsigned short type;
+	uint32_t family;
+
+	switch (linktype) {
+	case LINKTYPE_ETH:
+		if (len < 14)
+			return 0;
+		type = get16(p + 12);
+		p += 14;
+		len -= 14;
+
+		/* VLAN tags, 802.1Q and 802.1ad */
+		while ((type == 0x8100 || type == 0x88a8) && len >= 4) {
+			type = get16(p + 2);
+			p += 4;
+			len -= 4;
+		}
+		return ip(pkt, type, p, len);
+
+	case LINKTYPE_SLL:
+		if (len < 16)
+			return 0;
+		return ip(pkt, get16(p + 14), p + 16, len - 16);
+
+	case LINKTYPE_SLL2:
+		if (len < 20)
+			return 0;
+		return ip(pkt, get16(p), p + 20, len - 20);
+
+	case LINKTYPE_NULL:
+		if (len < 4)
+			return 0;
+		memcpy(&family, p, 4);
+		family = swap32(family, swap);
+		if (family == 2)
+			return ipv4(pkt, p + 4, len - 4);
+		if (family == 24 || family == 28 || family == 30)
+			return ipv6(pkt, p + 4, len - 4);
+		return 0;
+
+	case LINKTYPE_RAW:
+	case LINKTYPE_IPV4:
+	case LINKTYPE_IPV6:
+		if (len && (p[0] >> 4) == 4)
+			return ipv4(pkt, p, len);
+		return ipv6(pkt, p, len);
+	}
+
+	return 0;
+}
+
+int pcap_read(const char *file, pcap_fn fn, void *arg)
+{
+	unsigned char *buf = NULL;
+	struct pcap_hdr hdr;
+	size_t len, off;
+	int swap, nsec;
+	int num = 0;
+	long size;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp)
+		return -1;
+
+	if (fseek(fp, 0, SEEK_END) || (size = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET))
+		goto error;
+	len = size;
+
+	buf = malloc(len ? len : 1);
+	if (!buf || fread(buf, 1, len, fp) != len)
+		goto error;
+	fclose(fp);
+	fp = NULL;
+
+	if (len < sizeof(hdr))
+		goto invalid;
+	memcpy(&hdr, buf, sizeof(hdr));
+
+	swap = hdr.magic != PCAP_MAGIC && hdr.magic != PCAP_MAGIC_NS;
+	hdr.magic = swap32(hdr.magic, swap);
+	if (hdr.magic != PCAP_MAGIC && hdr.magic != PCAP_MAGIC_NS)
+		goto invalid;
+	nsec = hdr.magic == PCAP_MAGIC_NS;
+	hdr.linktype = swap32(hdr.linktype, swap) & 0xffff;
+
+	for (off = sizeof(hdr); off + sizeof(struct pcap_rec) <= len; ) {
+		struct pcap_pkt pkt;
+		struct pcap_rec rec;
+
+		memcpy(&rec, buf + off, sizeof(rec));
+		off += sizeof(rec);
+
+		rec.caplen = swap32(rec.caplen, swap);
+		if (rec.caplen > len - off)
+			break;		/* Truncated file */
+
+		memset(&pkt, 0, sizeof(pkt));
+		pkt.ts.tv_sec  = swap32(rec.sec, swap);
+		pkt.ts.tv_usec = swap32(rec.frac, swap) / (nsec ? 1000 : 1);
+
+		if (frame(&pkt, hdr.linktype, swap, buf + off, rec.caplen)) {
+			num++;
+			if (fn(&pkt, arg))
+				break;
+		}
+		off += rec.caplen;
+	}
+
+	free(buf);
+	return num;
+invalid:
+	errno = EINVAL;
+error:
+	if (fp)
+		fclose(fp);
+	free(buf);
+	return -1;
+}
+
+FILE *pcap_create(const char *file)
+{
+	struct pcap_hdr hdr = {
+		.magic    = PCAP_MAGIC,
+		.major    = 2,
+		.minor    = 4,
+		.snaplen  = 65535,
+		.linktype = LINKTYPE_RAW,
+	};
+	FILE *fp;
+
+	fp = fopen(file, "w");
+	if (!fp)
+		return NULL;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+		fclose(fp);
+		return NULL;
+	}
+
+	return fp;
+}
+
+int pcap_write(FILE *fp, struct pcap_pkt *pkt)
+{
+	unsigned char hdr[28] = { 0x45 };
+	struct pcap_rec rec;
+	uint32_t sum = 0;
+	size_t tlen, i;
+
+	tlen = pkt->len + sizeof(hdr);
+	if (tlen > 65535) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	/* IPv4, TTL 255, to 224.0.0.251, no UDP checksum */
+	hdr[2] = tlen >> 8;
+	hdr[3] = tlen & 0xff;
+	hdr[8] = 255;
+	hdr[9] = IPPROTO_UDP;
+	memcpy(&hdr[12], &pkt->src, 4);
+	hdr[16] = 224;
+	hdr[19] = 251;
+	for (i = 0; i < 20; i += 2)
+		sum += get16(&hdr[i]);
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	hdr[10] = ~sum >> 8;
+	hdr[11] = ~sum & 0xff;
+
+	hdr[20] = pkt->sport >> 8;
+	hdr[21] = pkt->sport & 0xff;
+	hdr[22] = MDNS_PORT >> 8;
+	hdr[23] = MDNS_PORT & 0xff;
+	hdr[24] = (pkt->len + 8) >> 8;
+	hdr[25] = (pkt->len + 8) & 0xff;
+
+	rec.sec    = pkt->ts.tv_sec;
+	rec.frac   = pkt->ts.tv_usec;
+	rec.caplen = rec.len = tlen;
+
+	if (fwrite(&rec, sizeof(rec), 1, fp) != 1 ||
+	    fwrite(hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fwrite(pkt->data, 1, pkt->len, fp) != pkt->len)
+		return -1;
+
+	return 0;
+}
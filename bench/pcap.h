@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2022  Joachim Wiberg <troglobit@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Minimal reader and writer of classic libpcap capture files, only for
+ * the UDP payload of mDNS packets.  No dependency on libpcap, and no
+ * pcapng, convert those with: editcap -F pcap in.pcapng out.pcap
+ */
+#ifndef MBENCH_PCAP_H_
+#define MBENCH_PCAP_H_
+
+#include <stdio.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+struct pcap_pkt {
+	struct timeval       ts;		/* Capture time */
+	struct in_addr       src;		/* Last 32 bits of IPv6 */
+	unsigned short       sport;		/* Host byte order */
+	const unsigned char *data;		/* UDP payload */
+	size_t               len;
+};
+
+typedef int (*pcap_fn)(struct pcap_pkt *pkt, void *arg);
+
+/**
+ * Call fn for every IPv4 or IPv6 UDP datagram to or from port 5353 in
+ * file, stops at the first fn returning non-zero.  Ethernet, Linux
+ * cooked (v1 and v2), BSD loopback and raw IP captures are supported.
+ * Returns number of datagrams, or -1 with errno on error.
+ */
+int pcap_read(const char *file, pcap_fn fn, void *arg);
+
+/**
+ * Create file with raw IPv4 packets, and write pkt to it sent from
+ * pkt->src:sport to 224.0.0.251:5353.  Close with fclose().
+ */
+FILE *pcap_create(const char *file);
+int   pcap_write(FILE *fp, struct pcap_pkt *pkt);
+
+#endif /* MBENCH_PCAP_H_ */
@@ -30,6 +30,7 @@
 
 #include "1035.h"
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 
 unsigned short int net2short(unsigned char **bufp)
@@ -93,74 +94,216 @@ static unsigned short int _ldecomp(const char *ptr)
 	return i;
 }
 
-static int _label(struct message *m, unsigned char **bufp, char **namep)
+/*
+ * Walk a possibly compressed name at off in the received packet.  Only
+ * backwards pointers are allowed, so this always terminates.  If out is
+ * set the name is decompressed into it, must be at least 256 bytes.
+ * Returns length of decompressed name, or -1 on bad data.
+ */
+static int _wname(const unsigned char *packet, int len, int off, char *out, int *next)
 {
-	int x;
-	char *label, *name;
+	int pos = off, end = -1, n = 0;
+
+	while (pos >= 0 && pos < len) {
+		unsigned char c = packet[pos];
+
+		if ((c & 0xc0) == 0xc0) {
+			int ptr;
+
+			if (pos + 1 >= len)
+				return -1;
+			ptr = ((c & 0x3f) << 8) | packet[pos + 1];
+			if (ptr >= pos)
+				return -1;
+			if (end < 0)
+				end = pos + 2;
+			pos = ptr;
+			continue;
+		}
 
+		/* 0x40 and 0x80 are reserved label types */
+		if (c & 0xc0)
+			return -1;
+
+		if (c == 0) {
+			if (end < 0)
+				end = pos + 1;
+			if (next)
+				*next = end;
+			if (out)
+				out[n] = 0;
+			return n;
+		}
 
-	/* Sanity check */
-	if (m->_len > (int)sizeof(m->_packet))
-		return 1;
+		if (pos + 1 + c > len || n + c + 1 > 255)
+			return -1;
+		if (out) {
+			memcpy(&out[n], &packet[pos + 1], c);
+			out[n + c] = '.';
+		}
+		n   += c + 1;
+		pos += c + 1;
+	}
 
-	/* Set namep to the end of the block */
-	*namep = name = (char *)m->_packet + m->_len;
+	return -1;
+}
 
-	/* Loop storing label in the block */
-	for (label = (char *)*bufp; *label != 0; name += *label + 1, label += *label + 1) {
-		/* Skip past any compression pointers, kick out if end encountered (bad data prolly) */
-		int prevOffset = -1;
-		while (*label & 0xc0) {
-			unsigned short int offset = _ldecomp(label);
-			if (offset <= prevOffset || offset > m->_len)
-				return 1;
-			if (*(label = (char *)m->_buf + offset) == 0)
-				break;
-			prevOffset = offset;
+/* Same walk as _wname(), but compare against a dotted name instead, DNS
+ * names are case-insensitive, RFC 4343 */
+static int _wcmp(const unsigned char *packet, int len, int off, const char *name)
+{
+	int pos = off;
+
+	while (pos >= 0 && pos < len) {
+		unsigned char c = packet[pos];
+
+		if ((c & 0xc0) == 0xc0) {
+			int ptr;
+
+			if (pos + 1 >= len)
+				return -1;
+			ptr = ((c & 0x3f) << 8) | packet[pos + 1];
+			if (ptr >= pos)
+				return -1;
+			pos = ptr;
+			continue;
 		}
 
-		/* Make sure we're not over the limits */
-		if ((name + *label) - *namep > 255 || m->_len + ((name + *label) - *namep) >= MAX_PACKET_LEN)
+		if (c & 0xc0)
+			return -1;
+		if (c == 0)
+			return *name != 0;
+
+		if (pos + 1 + c > len)
+			return -1;
+		if (strncasecmp(name, (const char *)&packet[pos + 1], c) || name[c] != '.')
 			return 1;
 
-		/* Copy chars for this label */
-		memcpy(name, label + 1, (size_t)*label);
-		name[(size_t)*label] = '.';
+		name += c + 1;
+		pos  += c + 1;
 	}
 
-	/* Advance buffer */
-	for (label = (char *)*bufp; *label != 0 && !(*label & 0xc0 && label++); label += *label + 1)
-		;
-	*bufp = (unsigned char *)(label + 1);
+	return -1;
+}
 
-	/* Terminate name and check for cache or cache it */
-	*name = '\0';
-	for (x = 0; x < MAX_NUM_LABELS && m->_labels[x]; x++) {
-		if (strcmp(*namep, m->_labels[x]))
+/* Same walk again, FNV-1a hash of the name as _wname() would write it,
+ * in lower case */
+static int _whash(const unsigned char *packet, int len, int off, unsigned int *hash)
+{
+	unsigned int h = 2166136261U;
+	int pos = off, n = 0;
+
+	while (pos >= 0 && pos < len) {
+		unsigned char c = packet[pos];
+		int i;
+
+		if ((c & 0xc0) == 0xc0) {
+			int ptr;
+
+			if (pos + 1 >= len)
+				return -1;
+			ptr = ((c & 0x3f) << 8) | packet[pos + 1];
+			if (ptr >= pos)
+				return -1;
+			pos = ptr;
 			continue;
+		}
 
-		*namep = m->_labels[x];
-		return 0;
+		if (c & 0xc0)
+			return -1;
+		if (c == 0) {
+			*hash = h;
+			return n;
+		}
+
+		if (pos + 1 + c > len || n + c + 1 > 255)
+			return -1;
+		for (i = 1; i <= c; i++) {
+			unsigned char ch = packet[pos + i];
+
+			h ^= ch >= 'A' && ch <= 'Z' ? ch + ('a' - 'A') : ch;
+			h *= 16777619U;
+		}
+		h ^= '.';
+		h *= 16777619U;
+
+		n   += c + 1;
+		pos += c + 1;
 	}
 
-	/* No cache, so cache it if room */
-	if (x < MAX_NUM_LABELS && m->_labels[x] == 0)
-		m->_labels[x] = *namep;
-	m->_len += (int)(name - *namep) + 1;
+	return -1;
+}
+
+/* Offset in packet a parsed name was found at, stored just before it */
+static int _loff(const char *name)
+{
+	const unsigned char *p = (const unsigned char *)name;
+
+	return (p[-2] << 8) | p[-1];
+}
+
+/*
+ * Names are decompressed into the _packet arena, the wire offset of
+ * each is stored in the two bytes before it.  Since the parser only
+ * moves forward, m->_labels[] is sorted by offset, letting us reuse
+ * the string when a name is just a pointer to one we already have.
+ */
+static int _label(struct message *m, int len, unsigned char **bufp, char **namep)
+{
+	int off = (int)(*bufp - m->_buf), next, n;
+	char *name;
+
+	if (off + 1 < len && (**bufp & 0xc0) == 0xc0) {
+		int ptr = ((**bufp & 0x3f) << 8) | (*bufp)[1];
+		int lo = 0, hi = m->_label - 1;
+
+		while (lo <= hi) {
+			int mid = (lo + hi) / 2;
+			int cur = _loff(m->_labels[mid]);
+
+			if (cur == ptr) {
+				*namep = m->_labels[mid];
+				*bufp += 2;
+				return 0;
+			}
+
+			if (cur < ptr)
+				lo = mid + 1;
+			else
+				hi = mid - 1;
+		}
+	}
+
+	if (m->_len + 2 + 256 > m->_size)
+		return 1;
+
+	name = (char *)m->_packet + m->_len + 2;
+	n = _wname(m->_buf, len, off, name, &next);
+	if (n < 0)
+		return 1;
+
+	name[-2] = (char)(off >> 8);
+	name[-1] = (char)off;
+	m->_len += n + 3;
+	if (m->_label < MAX_NUM_LABELS)
+		m->_labels[m->_label++] = name;
+
+	*namep = name;
+	*bufp  = m->_buf + next;
 
 	return 0;
 }
 
-/* Internal label matching */
+/* Internal label matching, pointers are relative the packet being built */
 static int _lmatch(const struct message *m, const char *l1, const char *l2)
 {
 	int len;
 
 	/* Always ensure we get called w/o a pointer */
 	if (*l1 & 0xc0)
-		return _lmatch(m, (char *)m->_buf + _ldecomp(l1), l2);
+		return _lmatch(m, (char *)m->_packet + _ldecomp(l1), l2);
 	if (*l2 & 0xc0)
-		return _lmatch(m, l1, (char *)m->_buf + _ldecomp(l2));
+		return _lmatch(m, l1, (char *)m->_packet + _ldecomp(l2));
 
 	/* Same already? */
 	if (l1 == l2)
@@ -186,11 +329,80 @@ static int _lmatch(const struct message *m, const char *l1, const char *l2)
 	return _lmatch(m, l1, l2);
 }
 
+/* FNV-1a of one label, seeded with the hash of the labels after it */
+static unsigned int _lhash(const char *label, unsigned int next)
+{
+	unsigned int h = 2166136261U ^ next;
+	int i;
+
+	for (i = 0; i <= *label; i++) {
+		h ^= (unsigned char)label[i];
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+/*
+ * Put name, in wire format with n labels at pos[] and suffix hashes in
+ * hash[], at bufp.  Compressed to the longest suffix already in the
+ * packet, and all new suffixes are remembered for later names.
+ */
+static int _hput(struct message *m, unsigned char **bufp, const char *label, int len,
+		 const unsigned char *pos, const unsigned int *hash, int n)
+{
+	unsigned char *l, *ptr;
+	int i, x, y;
+
+	/*
+	 * Longest suffix already in the packet wins.  Bucket heads and
+	 * chains are index + 1, so a zeroed message has empty buckets
+	 */
+	for (i = 0; i < n; i++) {
+		for (y = m->_lbucket[hash[i] % LABEL_BUCKETS]; y > 0 && y <= m->_label; y = m->_lnext[y - 1]) {
+			if (m->_lhash[y - 1] == hash[i] && _lmatch(m, label + pos[i], m->_labels[y - 1]))
+				break;
+		}
+		if (y > 0 && y <= m->_label)
+			break;
+	}
+
+	/* Copy into buffer, with pointer to matching suffix */
+	l = *bufp;
+	if (i < n) {
+		memcpy(l, label, pos[i]);
+		ptr = l + pos[i];
+		short2net((unsigned char *)m->_labels[y - 1] - m->_packet, &ptr);
+		*(l + pos[i]) |= 0xc0;
+		len = pos[i] + 2;
+	} else {
+		memcpy(l, label, len);
+	}
+	*bufp += len;
+
+	/* For each new label, store it's location for future compression */
+	for (x = 0; x < i && m->_label < MAX_NUM_LABELS; x++) {
+		int b = hash[x] % LABEL_BUCKETS;
+
+		y = m->_label++;
+		m->_labels[y] = (char *)l + pos[x];
+		m->_lhash[y]  = hash[x];
+		/* Head may be a label dropped with its record, see _rdata() */
+		m->_lnext[y]  = m->_lbucket[b] <= y ? m->_lbucket[b] : 0;
+		m->_lbucket[b] = (short)(y + 1);
+	}
+
+	return len;
+}
+
 /* Nasty, convert host into label using compression */
 static int _host(struct message *m, unsigned char **bufp, const char *name)
 {
-	char label[256], *l;
+	char label[256];
 	int len = 0, x = 1, y = 0, last = 0;
+	unsigned int hash[128], h;
+	unsigned char pos[128];
+	int i, n;
 
 	if (name == 0)
 		return 0;
@@ -218,54 +430,37 @@ static int _host(struct message *m, unsigned char **bufp, const char *name)
 	len = x + 1;
 	label[x] = 0;		/* Always terminate w/ a 0 */
 
-	/* Double-loop checking each label against all m->_labels for match */
-	for (x = 0; label[x]; x += label[x] + 1) {
-		for (y = 0; y < MAX_NUM_LABELS && m->_labels[y]; y++) {
-			if (_lmatch(m, label + x, m->_labels[y])) {
-				/* Matching label, set up pointer */
-				l = label + x;
-				short2net((unsigned char *)m->_labels[y] - m->_packet, (unsigned char **)&l);
-				label[x] |= '\xc0';
-				len = x + 2;
-				break;
-			}
-		}
-	
-		if (label[x] & 0xc0)
-			break;
-	}
-
-	/* Copy into buffer, point there now */
-	memcpy(*bufp, label, len);
-	l = (char *)*bufp;
-	*bufp += len;
-
-	/* For each new label, store it's location for future compression */
-	for (x = 0; l[x] && m->_label < MAX_NUM_LABELS; x += l[x] + 1) {
-		if (l[x] & 0xc0)
-			break;
-
-		m->_labels[m->_label++] = l + x;
-	}
+	/* Hash each suffix of the name, right to left */
+	for (n = 0, x = 0; label[x]; x += label[x] + 1)
+		pos[n++] = x;
+	for (h = 0, i = n; i-- > 0;)
+		hash[i] = h = _lhash(label + pos[i], h);
 
-	return len;
+	return _hput(m, bufp, label, len, pos, hash, n);
 }
 
-static int _rrparse(struct message *m, struct resource *rr, int count, unsigned char **bufp)
+static int _rrparse(struct message *m, int len, struct resource *rr, int count, unsigned char **bufp)
 {
 	int i;
 
 	for (i = 0; i < count; i++) {
-		if (_label(m, bufp, &(rr[i].name)))
+		unsigned char *end;
+
+		if (_label(m, len, bufp, &(rr[i].name)))
+			return 1;
+		if (*bufp + 10 > m->_buf + len)
 			return 1;
+
 		rr[i].type     = net2short(bufp);
 		rr[i].class    = net2short(bufp);
 		rr[i].ttl      = net2long(bufp);
 		rr[i].rdlength = net2short(bufp);
+		rr[i].rdata    = NULL;
 //		fprintf(stderr, "Record type %d class 0x%2x ttl %lu len %d\n", rr[i].type, rr[i].class, rr[i].ttl, rr[i].rdlength);
 
 		/* If not going to overflow, make copy of source rdata */
-		if (rr[i].rdlength + (*bufp - m->_buf) > MAX_PACKET_LEN || m->_len + rr[i].rdlength > MAX_PACKET_LEN) {
+		end = *bufp + rr[i].rdlength;
+		if (end > m->_buf + len || m->_len + rr[i].rdlength > m->_size) {
 			rr[i].rdlength = 0;
 			return 1;
 		}
@@ -285,41 +480,50 @@ static int _rrparse(struct message *m, struct resource *rr, int count, unsigned
 		/* Parse commonly known ones */
 		switch (rr[i].type) {
 		case QTYPE_A:
-			if (m->_len + 16 > MAX_PACKET_LEN)
+			if (m->_len + 16 > m->_size || end - *bufp < 4)
 				return 1;
 			rr[i].known.a.name = (char *)m->_packet + m->_len;
 			m->_len += 16;
 			sprintf(rr[i].known.a.name, "%d.%d.%d.%d", (*bufp)[0], (*bufp)[1], (*bufp)[2], (*bufp)[3]);
-			rr[i].known.a.ip.s_addr = net2long(bufp);
+			/* Keep network byte order, like the rest of struct in_addr */
+			memcpy(&rr[i].known.a.ip, *bufp, 4);
+			*bufp += 4;
 			break;
 
 		case QTYPE_NS:
-			if (_label(m, bufp, &(rr[i].known.ns.name)))
+			if (_label(m, len, bufp, &(rr[i].known.ns.name)))
 				return 1;
 			break;
 
 		case QTYPE_CNAME:
-			if (_label(m, bufp, &(rr[i].known.cname.name)))
+			if (_label(m, len, bufp, &(rr[i].known.cname.name)))
 				return 1;
 			break;
 
 		case QTYPE_PTR:
-			if (_label(m, bufp, &(rr[i].known.ptr.name)))
+			if (_label(m, len, bufp, &(rr[i].known.ptr.name)))
 				return 1;
 			break;
 
 		case QTYPE_SRV:
+			if (end - *bufp < 6)
+				return 1;
 			rr[i].known.srv.priority = net2short(bufp);
 			rr[i].known.srv.weight = net2short(bufp);
 			rr[i].known.srv.port = net2short(bufp);
-			if (_label(m, bufp, &(rr[i].known.srv.name)))
+			if (_label(m, len, bufp, &(rr[i].known.srv.name)))
 				return 1;
 			break;
 
 		case QTYPE_TXT:
 		default:
-			*bufp += rr[i].rdlength;
+			break;
 		}
+
+		/* Names in rdata must not run past rdlength */
+		if (*bufp > end)
+			return 1;
+		*bufp = end;
 	}
 
 	return 0;
@@ -333,6 +537,11 @@ static int _rrparse(struct message *m, struct resource *rr, int count, unsigned
 	m->_len += (y);
 
 int message_parse(struct message *m, unsigned char *packet)
+{
+	return message_parse_len(m, packet, MAX_PACKET_LEN);
+}
+
+int message_parse_len(struct message *m, unsigned char *packet, size_t len)
 {
 	int i;
 	unsigned char *buf;
@@ -340,6 +549,12 @@ int message_parse(struct message *m, unsigned char *packet)
 	if (packet == 0 || m == 0)
 		return 1;
 
+	message_init(m, m->_packet, m->_size);
+	if (len < 12)
+		return 1;
+	if (len > MAX_PACKET_LEN)
+		len = MAX_PACKET_LEN;
+
 	/* Header stuff bit crap */
 	m->_buf = buf = packet;
 	m->id = net2short(&buf);
@@ -359,25 +574,25 @@ int message_parse(struct message *m, unsigned char *packet)
 	buf += 2;
 
 	m->qdcount = net2short(&buf);
-	if (m->_len + (sizeof(struct question) * m->qdcount) > MAX_PACKET_LEN - 8) {
+	if (m->_len + (sizeof(struct question) * m->qdcount) > (size_t)(m->_size - 8)) {
 		m->qdcount = 0;
 		return 1;
 	}
 
 	m->ancount = net2short(&buf);
-	if (m->_len + (sizeof(struct resource) * m->ancount) > MAX_PACKET_LEN - 8) {
+	if (m->_len + (sizeof(struct resource) * m->ancount) > (size_t)(m->_size - 8)) {
 		m->ancount = 0;
 		return 1;
 	}
 
 	m->nscount = net2short(&buf);
-	if (m->_len + (sizeof(struct resource) * m->nscount) > MAX_PACKET_LEN - 8) {
+	if (m->_len + (sizeof(struct resource) * m->nscount) > (size_t)(m->_size - 8)) {
 		m->nscount = 0;
 		return 1;
 	}
 
 	m->arcount = net2short(&buf);
-	if (m->_len + (sizeof(struct resource) * m->arcount) > MAX_PACKET_LEN - 8) {
+	if (m->_len + (sizeof(struct resource) * m->arcount) > (size_t)(m->_size - 8)) {
 		m->arcount = 0;
 		return 1;
 	}
@@ -385,7 +600,9 @@ int message_parse(struct message *m, unsigned char *packet)
 	/* Process questions */
 	my(m->qd, sizeof(struct question) * m->qdcount);
 	for (i = 0; i < m->qdcount; i++) {
-		if (_label(m, &buf, &(m->qd[i].name)))
+		if (_label(m, (int)len, &buf, &(m->qd[i].name)))
+			return 1;
+		if (buf + 4 > packet + len)
 			return 1;
 		m->qd[i].type  = net2short(&buf);
 		m->qd[i].class = net2short(&buf);
@@ -395,30 +612,160 @@ int message_parse(struct message *m, unsigned char *packet)
 	my(m->an, sizeof(struct resource) * m->ancount);
 	my(m->ns, sizeof(struct resource) * m->nscount);
 	my(m->ar, sizeof(struct resource) * m->arcount);
-	if (_rrparse(m, m->an, m->ancount, &buf))
+	if (_rrparse(m, (int)len, m->an, m->ancount, &buf))
 		return 1;
-	if (_rrparse(m, m->ns, m->nscount, &buf))
+	if (_rrparse(m, (int)len, m->ns, m->nscount, &buf))
 		return 1;
-	if (_rrparse(m, m->ar, m->arcount, &buf))
+	if (_rrparse(m, (int)len, m->ar, m->arcount, &buf))
 		return 1;
 
 	return 0;
 }
 
-void message_qd(struct message *m, char *name, unsigned short int type, unsigned short int class)
+int message_walk(const unsigned char *packet, size_t len, message_walker_t cb, void *arg)
+{
+	unsigned short count[4];
+	const unsigned char *buf;
+	int i, pos, rc;
+
+	if (packet == 0 || len < 12)
+		return -1;
+	if (len > MAX_PACKET_LEN)
+		len = MAX_PACKET_LEN;
+
+	buf = packet + 4;
+	for (i = 0; i < 4; i++)
+		count[i] = net2short((unsigned char **)&buf);
+
+	pos = 12;
+	for (i = 0; i < 4; i++) {
+		int j;
+
+		for (j = 0; j < count[i]; j++) {
+			struct wire_rr rr = { .section = i, .name = (unsigned short)pos };
+
+			if (_wname(packet, (int)len, pos, NULL, &pos) < 0)
+				return -1;
+
+			buf = packet + pos;
+			if (i == MESSAGE_QD) {
+				if (pos + 4 > (int)len)
+					return -1;
+				rr.type  = net2short((unsigned char **)&buf);
+				rr.class = net2short((unsigned char **)&buf);
+				pos += 4;
+			} else {
+				if (pos + 10 > (int)len)
+					return -1;
+				rr.type     = net2short((unsigned char **)&buf);
+				rr.class    = net2short((unsigned char **)&buf);
+				rr.ttl      = net2long((unsigned char **)&buf);
+				rr.rdlength = net2short((unsigned char **)&buf);
+				rr.rdata    = (unsigned short)(pos + 10);
+				pos += 10 + rr.rdlength;
+				if (pos > (int)len)
+					return -1;
+			}
+
+			rc = cb(packet, len, &rr, arg);
+			if (rc)
+				return rc;
+		}
+	}
+
+	return 0;
+}
+
+int message_name(const unsigned char *packet, size_t len, unsigned short off, char *name)
+{
+	return _wname(packet, (int)len, off, name, NULL);
+}
+
+int message_name_cmp(const unsigned char *packet, size_t len, unsigned short off, const char *name)
+{
+	return _wcmp(packet, (int)len, off, name);
+}
+
+int message_name_hash(const unsigned char *packet, size_t len, unsigned short off, unsigned int *hash)
+{
+	return _whash(packet, (int)len, off, hash);
+}
+
+void message_init(struct message *m, unsigned char *buf, int size)
+{
+	m->_packet = buf;
+	m->_size = size;
+
+	m->id = 0;
+	memset(&m->header, 0, sizeof(m->header));
+	m->qdcount = m->ancount = m->nscount = m->arcount = 0;
+	m->qd = NULL;
+	m->an = m->ns = m->ar = NULL;
+
+	/* Only labels [0, _label) are ever looked at when building */
+	m->_buf = NULL;
+	m->_rr = NULL;
+	m->_len = m->_label = 0;
+	memset(m->_lbucket, 0, sizeof(m->_lbucket));
+}
+
+/* Longest a name can be in the packet, uncompressed */
+static int _nlen(const char *name)
+{
+	return name ? (int)strlen(name) + 2 : 0;
+}
+
+/*
+ * Start a question or record, counted in count, if there is room for
+ * len bytes of it in the buffer.  One that does not fit is dropped
+ * whole, along with any rdata appended to it later, see _rdata()
+ */
+static int _begin(struct message *m, unsigned short int *count, int len)
 {
-	m->qdcount++;
 	if (m->_buf == 0)
 		m->_buf = m->_packet + 12;
+
+	m->_rr = NULL;
+	if (m->_buf + len > m->_packet + m->_size)
+		return 0;
+
+	m->_rr = m->_buf;
+	m->_rrcount = count;
+	m->_rrlabel = m->_label;
+	(*count)++;
+
+	return 1;
+}
+
+/* Room for len bytes of rdata, else the record is taken back out */
+static int _rdata(struct message *m, int len)
+{
+	if (!m->_rr)
+		return 0;
+	if (m->_buf + len <= m->_packet + m->_size)
+		return 1;
+
+	m->_buf = m->_rr;
+	m->_label = m->_rrlabel;
+	(*m->_rrcount)--;
+	m->_rr = NULL;
+
+	return 0;
+}
+
+void message_qd(struct message *m, char *name, unsigned short int type, unsigned short int class)
+{
+	if (!_begin(m, &m->qdcount, _nlen(name) + 4))
+		return;
 	_host(m, &(m->_buf), name);
 	short2net(type, &(m->_buf));
 	short2net(class, &(m->_buf));
 }
 
-static void _rrappend(struct message *m, char *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
+static void _rrappend(struct message *m, unsigned short int *count, char *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
 {
-	if (m->_buf == 0)
-		m->_buf = m->_packet + 12;
+	if (!_begin(m, count, _nlen(name) + 10))
+		return;
 	_host(m, &(m->_buf), name);
 	short2net(type, &(m->_buf));
 	short2net(class, &(m->_buf));
@@ -427,32 +774,34 @@ static void _rrappend(struct message *m, char *name, unsigned short int type, un
 
 void message_an(struct message *m, char *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
 {
-	m->ancount++;
-	_rrappend(m, name, type, class, ttl);
+	_rrappend(m, &m->ancount, name, type, class, ttl);
 }
 
 void message_ns(struct message *m, char *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
 {
-	m->nscount++;
-	_rrappend(m, name, type, class, ttl);
+	_rrappend(m, &m->nscount, name, type, class, ttl);
 }
 
 void message_ar(struct message *m, char *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
 {
-	m->arcount++;
-	_rrappend(m, name, type, class, ttl);
+	_rrappend(m, &m->arcount, name, type, class, ttl);
 }
 
 void message_rdata_long(struct message *m, struct in_addr l)
 {
+	if (!_rdata(m, 6))
+		return;
 	short2net(4, &(m->_buf));
-	long2net(l.s_addr, &(m->_buf));
+	memcpy(m->_buf, &l.s_addr, 4);
+	m->_buf += 4;
 }
 
 void message_rdata_name(struct message *m, char *name)
 {
 	unsigned char *mybuf = m->_buf;
 
+	if (!_rdata(m, _nlen(name) + 2))
+		return;
 	m->_buf += 2;
 	short2net(_host(m, &(m->_buf), name), &mybuf);
 }
@@ -461,6 +810,8 @@ void message_rdata_srv(struct message *m, unsigned short int priority, unsigned
 {
 	unsigned char *mybuf = m->_buf;
 
+	if (!_rdata(m, _nlen(name) + 8))
+		return;
 	m->_buf += 2;
 	short2net(priority, &(m->_buf));
 	short2net(weight, &(m->_buf));
@@ -470,13 +821,122 @@ void message_rdata_srv(struct message *m, unsigned short int priority, unsigned
 
 void message_rdata_raw(struct message *m, unsigned char *rdata, unsigned short int rdlength)
 {
-	if ((m->_buf - m->_packet) + rdlength > 4096)
-		rdlength = 0;
+	if (!_rdata(m, rdlength + 2))
+		return;
 	short2net(rdlength, &(m->_buf));
 	memcpy(m->_buf, rdata, rdlength);
 	m->_buf += rdlength;
 }
 
+size_t message_name_size(const char *name)
+{
+	size_t len, num = 0;
+	const char *p;
+
+	if (!name)
+		return 0;
+
+	len = strlen(name);
+	if (len && name[len - 1] == '.')
+		len--;
+	if (len > 253)
+		return 0;
+
+	for (p = name; p < name + len; p++) {
+		if (*p == '.')
+			num++;
+	}
+	if (len)
+		num++;
+	if (num > WIRE_NAME_LABELS)
+		return 0;
+
+	/* Rounded up, so several can be laid out back to back */
+	len = sizeof(struct wire_name) + len + 2;
+	return (len + __alignof__(struct wire_name) - 1) & ~(__alignof__(struct wire_name) - 1);
+}
+
+void message_name_prep(struct wire_name *wn, const char *name)
+{
+	unsigned int h = 0;
+	int x = 1, y = 0, last = 0, i;
+	char *label = (char *)wn->wire;
+
+	/* Same as _host(), but the result is kept */
+	while (name[y]) {
+		if (name[y] == '.') {
+			if (!name[y + 1])
+				break;
+			label[last] = (char)(x - (last + 1));
+			last = x;
+		} else {
+			label[x] = name[y];
+		}
+		x++;
+		y++;
+	}
+
+	label[last] = (char)(x - (last + 1));
+	if (x == 1)
+		x--;
+	label[x] = 0;
+	wn->len = x + 1;
+
+	for (wn->num = 0, x = 0; label[x]; x += label[x] + 1)
+		wn->pos[wn->num++] = x;
+	for (i = wn->num; i-- > 0;)
+		wn->hash[i] = h = _lhash(label + wn->pos[i], h);
+}
+
+void message_qd_prep(struct message *m, const struct wire_name *name, unsigned short int type, unsigned short int class)
+{
+	if (!_begin(m, &m->qdcount, name->len + 4))
+		return;
+	_hput(m, &(m->_buf), (const char *)name->wire, name->len, name->pos, name->hash, name->num);
+	short2net(type, &(m->_buf));
+	short2net(class, &(m->_buf));
+}
+
+static void _rrappend_prep(struct message *m, unsigned short int *count, const struct wire_name *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
+{
+	if (!_begin(m, count, name->len + 10))
+		return;
+	_hput(m, &(m->_buf), (const char *)name->wire, name->len, name->pos, name->hash, name->num);
+	short2net(type, &(m->_buf));
+	short2net(class, &(m->_buf));
+	long2net(ttl, &(m->_buf));
+}
+
+void message_an_prep(struct message *m, const struct wire_name *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
+{
+	_rrappend_prep(m, &m->ancount, name, type, class, ttl);
+}
+
+void message_ns_prep(struct message *m, const struct wire_name *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
+{
+	_rrappend_prep(m, &m->nscount, name, type, class, ttl);
+}
+
+void message_ar_prep(struct message *m, const struct wire_name *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
+{
+	_rrappend_prep(m, &m->arcount, name, type, class, ttl);
+}
+
+void message_rdata_prep(struct message *m, const unsigned char *data, unsigned short int len, const struct wire_name *name)
+{
+	unsigned char *mybuf = m->_buf;
+	int rdlen = len;
+
+	if (!_rdata(m, len + 2 + (name ? name->len : 0)))
+		return;
+	m->_buf += 2;
+	memcpy(m->_buf, data, len);
+	m->_buf += len;
+	if (name)
+		rdlen += _hput(m, &(m->_buf), (const char *)name->wire, name->len, name->pos, name->hash, name->num);
+	short2net(rdlen, &mybuf);
+}
+
 unsigned char *message_packet(struct message *m)
 {
 	unsigned char c, *buf = m->_buf;
@@ -484,6 +944,8 @@ unsigned char *message_packet(struct message *m)
 	m->_buf = m->_packet;
 	short2net(m->id, &(m->_buf));
 
+	/* Packet is not zeroed, see message_init() */
+	m->_buf[0] = m->_buf[1] = 0;
 	if (m->header.qr)
 		m->_buf[0] |= 0x80;
 	if ((c = m->header.opcode))
@@ -38,10 +38,13 @@
 #define MDNS_1035_H_
 
 #include <arpa/inet.h>
+#include <stddef.h>
 
 /* Should be reasonably large, for UDP */
 #define MAX_PACKET_LEN 65535
 #define MAX_NUM_LABELS 512
+#define LABEL_BUCKETS  256
+#define WIRE_NAME_LABELS 16
 
 struct question {
 	char *name;
@@ -83,6 +86,12 @@ struct resource {
 	} known;
 };
 
+/*
+ * Both a parsed packet and the builder of one to send.  Neither keeps
+ * the packet itself, it lives in the buffer given to message_init():
+ * the frame a packet is built in, or the arena a received one has its
+ * names and sections parsed into.
+ */
 struct message {
 	/* External data */
 	unsigned short int id;
@@ -95,11 +104,24 @@ struct message {
 
 	/* Internal variables */
 	unsigned char *_buf;
+	unsigned char *_packet;		/* Buffer from message_init() */
+	int _size;			/* Of _packet */
+
+	/* Last question or record appended, dropped if it does not fit */
+	unsigned char *_rr;
+	unsigned short int *_rrcount;
+	int _rrlabel;
+
 	char *_labels[MAX_NUM_LABELS];
 	int _len, _label;
 
-	/* Packet acts as padding, easier mem management */
-	unsigned char _packet[MAX_PACKET_LEN];
+	/*
+	 * Compression table, suffix hash of each label in _labels[].
+	 * Chains are index + 1 into _labels[], 0 ends a chain
+	 */
+	unsigned int _lhash[MAX_NUM_LABELS];
+	short _lnext[MAX_NUM_LABELS];
+	short _lbucket[LABEL_BUCKETS];
 };
 
 /**
@@ -115,17 +137,92 @@ void short2net(unsigned short int i, unsigned char **buf);
 void long2net (unsigned long int  l, unsigned char **buf);
 
 /**
- * parse packet into message, packet must be at least MAX_PACKET_LEN and
- * message must be zero'd for safety
+ * parse packet into message, packet must be at least MAX_PACKET_LEN.
+ * Names and sections go in the buffer from message_init(), which should
+ * be MAX_PACKET_LEN too, for any packet to fit
  * @returns 0 if OK, else parser error.
  */
 int message_parse(struct message *m, unsigned char *packet);
 
+/**
+ * parse len bytes of packet into message, never reads past len
+ * @returns 0 if OK, else parser error.
+ */
+int message_parse_len(struct message *m, unsigned char *packet, size_t len);
+
+/**
+ * Zero-copy view of a question or resource record in a received packet,
+ * name and rdata are offsets into the packet.  Questions have no ttl or
+ * rdata.
+ */
+#define MESSAGE_QD 0
+#define MESSAGE_AN 1
+#define MESSAGE_NS 2
+#define MESSAGE_AR 3
+
+struct wire_rr {
+	int section;
+	unsigned short int name;
+	unsigned short int type, class;
+	unsigned long int ttl;
+	unsigned short int rdlength, rdata;
+};
+
+typedef int (*message_walker_t)(const unsigned char *packet, size_t len, const struct wire_rr *rr, void *arg);
+
+/**
+ * Walk all questions and records in packet without copying anything,
+ * stops at the first callback returning non-zero.
+ * @returns 0 when done, -1 on bad packet, or callback return value.
+ */
+int message_walk(const unsigned char *packet, size_t len, message_walker_t cb, void *arg);
+
+/**
+ * Decompress name at offset off in packet, name must be 256 bytes
+ * @returns length of name, or -1 on bad data.
+ */
+int message_name(const unsigned char *packet, size_t len, unsigned short off, char *name);
+
+/**
+ * Compare name at offset off in packet with name, without decompressing,
+ * ignoring case
+ * @returns 0 on match, 1 on mismatch, or -1 on bad data.
+ */
+int message_name_cmp(const unsigned char *packet, size_t len, unsigned short off, const char *name);
+
+/**
+ * FNV-1a hash of the name at offset off in packet, in lower case, the
+ * same as hashing the string from message_name(), without decompressing
+ * @returns length of name, or -1 on bad data.
+ */
+int message_name_hash(const unsigned char *packet, size_t len, unsigned short off, unsigned int *hash);
+
+/**
+ * Name prepared once for sending many times, in uncompressed wire
+ * format with the compression hash of each suffix.  Sending it only
+ * costs a lookup per suffix and a memcpy()
+ */
+struct wire_name {
+	unsigned char  len;			/* Of wire[], with final 0 */
+	unsigned char  num;			/* Labels, and suffixes */
+	unsigned char  pos[WIRE_NAME_LABELS];	/* Offset of each label */
+	unsigned int   hash[WIRE_NAME_LABELS];	/* Hash of each suffix */
+	unsigned char  wire[];
+};
+
 /**
  * create a message for sending out on the wire
  */
 struct message *message_wire(void);
 
+/**
+ * Reset message before building a new packet to send in buf, of size
+ * bytes, or parsing one.  Only the header, counters and build state is
+ * cleared, not the buffer.  Questions and records that do not fit are
+ * dropped whole, so size is a hard limit
+ */
+void message_init(struct message *m, unsigned char *buf, int size);
+
 /**
  * append a question to the wire message
  */
@@ -147,6 +244,30 @@ void message_rdata_srv  (struct message *m, unsigned short int priority, unsigne
 			 unsigned short int port, char *name);
 void message_rdata_raw  (struct message *m, unsigned char *rdata, unsigned short int rdlength);
 
+/**
+ * Size of struct wire_name for name, 0 if too long or too many labels.
+ * Always a multiple of its alignment
+ */
+size_t message_name_size(const char *name);
+
+/**
+ * Prepare name, wn must be message_name_size() bytes
+ */
+void message_name_prep(struct wire_name *wn, const char *name);
+
+/**
+ * Same as message_qd() and message_an() et al, with prepared names
+ */
+void message_qd_prep(struct message *m, const struct wire_name *name, unsigned short int type, unsigned short int class);
+void message_an_prep(struct message *m, const struct wire_name *name, unsigned short int type, unsigned short int class, unsigned long int ttl);
+void message_ns_prep(struct message *m, const struct wire_name *name, unsigned short int type, unsigned short int class, unsigned long int ttl);
+void message_ar_prep(struct message *m, const struct wire_name *name, unsigned short int type, unsigned short int class, unsigned long int ttl);
+
+/**
+ * Append rdata of len bytes of data, followed by name if not NULL
+ */
+void message_rdata_prep (struct message *m, const unsigned char *data, unsigned short int len, const struct wire_name *name);
+
 /**
  * Return the wire format (and length) of the message, just free message
  * when done
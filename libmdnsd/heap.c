@@ -0,0 +1,135 @@
+/* Simple intrusive binary min-heap, for deadline ordered lists
+ *
+ * Copyright (c) 2016-2022  Joachim Wiberg <troglobit@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "heap.h"
+#include <stdlib.h>
+
+static void _heap_put(struct heap *h, size_t i, struct heap_node *n)
+{
+	h->v[i] = n;
+	n->pos = i + 1;
+}
+
+static void _heap_up(struct heap *h, size_t i)
+{
+	struct heap_node *n = h->v[i];
+
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+
+		if (h->v[parent]->key <= n->key)
+			break;
+
+		_heap_put(h, i, h->v[parent]);
+		i = parent;
+	}
+	_heap_put(h, i, n);
+}
+
+static void _heap_down(struct heap *h, size_t i)
+{
+	struct heap_node *n = h->v[i];
+
+	while (1) {
+		size_t child = i * 2 + 1;
+
+		if (child >= h->len)
+			break;
+		if (child + 1 < h->len && h->v[child + 1]->key < h->v[child]->key)
+			child++;
+		if (n->key <= h->v[child]->key)
+			break;
+
+		_heap_put(h, i, h->v[child]);
+		i = child;
+	}
+	_heap_put(h, i, n);
+}
+
+int heap_set(struct heap *h, struct heap_node *n, unsigned long key)
+{
+	unsigned long old = n->key;
+	size_t i;
+
+	n->key = key;
+	if (n->pos) {
+		i = n->pos - 1;
+		if (key < old)
+			_heap_up(h, i);
+		else
+			_heap_down(h, i);
+		return 0;
+	}
+
+	if (h->len == h->max) {
+		struct heap_node **v;
+		size_t max = h->max ? h->max * 2 : 64;
+
+		v = realloc(h->v, max * sizeof(*v));
+		if (!v)
+			return 1;
+		h->v = v;
+		h->max = max;
+	}
+
+	i = h->len++;
+	h->v[i] = n;
+	_heap_up(h, i);
+
+	return 0;
+}
+
+void heap_del(struct heap *h, struct heap_node *n)
+{
+	struct heap_node *last;
+	size_t i;
+
+	if (!n->pos)
+		return;
+
+	i = n->pos - 1;
+	n->pos = 0;
+
+	last = h->v[--h->len];
+	if (last == n)
+		return;
+
+	h->v[i] = last;
+	if (i > 0 && h->v[(i - 1) / 2]->key > last->key)
+		_heap_up(h, i);
+	else
+		_heap_down(h, i);
+}
+
+void heap_free(struct heap *h)
+{
+	free(h->v);
+	h->v = NULL;
+	h->len = h->max = 0;
+}
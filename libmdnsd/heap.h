@@ -0,0 +1,77 @@
+/* Simple intrusive binary min-heap, for deadline ordered lists
+ *
+ * Copyright (c) 2016-2022  Joachim Wiberg <troglobit@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MDNS_HEAP_H_
+#define MDNS_HEAP_H_
+
+#include <stddef.h>
+
+/* Embed in the structure to be queued, key is owned by the heap */
+struct heap_node {
+	unsigned long key;
+	size_t pos;		/* 1-based position in heap, 0: not queued */
+};
+
+struct heap {
+	struct heap_node **v;
+	size_t len, max;
+};
+
+#define heap_entry(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+/**
+ * Insert node, or move an already queued node, to the given key
+ */
+int heap_set(struct heap *h, struct heap_node *n, unsigned long key);
+
+/**
+ * Unlink node from heap, safe to call also for non-queued nodes
+ */
+void heap_del(struct heap *h, struct heap_node *n);
+
+/**
+ * Free heap storage, nodes are owned by caller
+ */
+void heap_free(struct heap *h);
+
+/**
+ * Returns node with the lowest key, or NULL if heap is empty
+ */
+static inline struct heap_node *heap_peek(struct heap *h)
+{
+	return h->len ? h->v[0] : NULL;
+}
+
+static inline int heap_queued(struct heap_node *n)
+{
+	return n->pos != 0;
+}
+
+#endif	/* MDNS_HEAP_H_ */
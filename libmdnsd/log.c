@@ -28,6 +28,7 @@
 
 #define SYSLOG_NAMES
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -37,13 +38,33 @@
 #include <unistd.h>
 #include <sys/time.h>
 
+#include "mdnsd.h"
+
 #ifndef MAX
 #define MAX(x,y) ((x) > (y) ? (x) : (y))
 #endif
 
+#define TRACE_MAGIC   0x5254444d	/* "MDTR" on little endian */
+#define TRACE_VERSION 1
+#define TRACE_CHUNK   16		/* Slots claimed at a time per thread */
+
+/* Start of a file from mdnsd_trace_save(), followed by count events */
+struct trace_hdr {
+	unsigned int   magic;
+	unsigned short version;
+	unsigned short size;		/* Of struct mdnsd_trace */
+	unsigned int   count;
+	unsigned int   reserved;
+};
+
 static int do_syslog = 0;
 static int loglevel  = LOG_NOTICE;
 
+static struct mdnsd_trace *trace_ring;
+static unsigned int trace_mask;
+static unsigned int trace_head;		/* Next seq, of all threads */
+static __thread unsigned int trace_seq, trace_end;	/* Claimed by thread */
+
 int mdnsd_log_level(char *level)
 {
 	int lvl = -1;
@@ -155,3 +176,193 @@ void mdnsd_log_time(struct timeval *tv, char *buf, size_t len)
 	strftime(tmp, sizeof(tmp), "%H:%M:%S", tm);
 	mdnsd_log(LOG_DEBUG, "@%s", tmp);
 }
+
+int mdnsd_trace_init(size_t num)
+{
+	size_t size = 1;
+
+	free(trace_ring);
+	trace_ring = NULL;
+	trace_mask = 0;
+	if (!num)
+		return 0;
+
+	while (size < num || size < 4 * TRACE_CHUNK)
+		size <<= 1;
+	if (size > 0x80000000)
+		return -1;
+
+	trace_ring = calloc(size, sizeof(*trace_ring));
+	if (!trace_ring)
+		return -1;
+	trace_mask = size - 1;
+
+	return 0;
+}
+
+/*
+ * Each thread claims TRACE_CHUNK slots at a time with an atomic add,
+ * the seq of a slot is 0 while it is written, so mdnsd_trace_save() can
+ * skip slots being written, overwritten, or not yet used, while it reads
+ * them.  Events of one thread are in order, with several threads the
+ * order is only by chunk.  A quiet thread drops what is left of its
+ * chunk once the others are about to wrap around to it, or it would
+ * write its old seq numbers over their newer events.
+ */
+void mdnsd_trace(int event, struct in_addr addr, struct timeval *tv, const char *name, int type, unsigned int a, unsigned int b)
+{
+	struct mdnsd_trace *ev;
+	struct timeval now;
+	unsigned int head, seq;
+	size_t len;
+
+	if (!trace_ring)
+		return;
+
+	if (!tv) {
+		gettimeofday(&now, NULL);
+		tv = &now;
+	}
+	head = __atomic_load_n(&trace_head, __ATOMIC_RELAXED);
+	if (trace_seq == trace_end || head - trace_seq > trace_mask + 1 - TRACE_CHUNK) {
+		trace_seq = __atomic_fetch_add(&trace_head, TRACE_CHUNK, __ATOMIC_RELAXED);
+		trace_end = trace_seq + TRACE_CHUNK;
+	}
+	seq = trace_seq++;
+	ev = &trace_ring[seq & trace_mask];
+
+	__atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	ev->usec   = (unsigned long long)tv->tv_sec * 1000000 + tv->tv_usec;
+	ev->event  = event;
+	ev->type   = type;
+	ev->addr   = addr;
+	ev->arg[0] = a;
+	ev->arg[1] = b;
+	len = name ? strnlen(name, sizeof(ev->name)) : 0;
+	if (len)
+		memcpy(ev->name, name, len);
+	if (len < sizeof(ev->name))
+		ev->name[len] = 0;
+
+	__atomic_store_n(&ev->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+int mdnsd_trace_save(FILE *fp)
+{
+	struct trace_hdr hdr = { TRACE_MAGIC, TRACE_VERSION, sizeof(struct mdnsd_trace), 0, 0 };
+	unsigned int head, seq, num;
+	long pos;
+
+	if (!trace_ring) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* Count is patched in when done, slots being written are skipped */
+	pos = ftell(fp);
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		return -1;
+
+	head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+	num  = head > trace_mask ? trace_mask + 1 : head;
+	for (seq = head - num; seq != head; seq++) {
+		struct mdnsd_trace *ev = &trace_ring[seq & trace_mask];
+		struct mdnsd_trace copy;
+
+		if (__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) != seq + 1)
+			continue;
+		memcpy(&copy, ev, sizeof(copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&ev->seq, __ATOMIC_RELAXED) != seq + 1)
+			continue;
+
+		if (fwrite(&copy, sizeof(copy), 1, fp) != 1)
+			return -1;
+		hdr.count++;
+	}
+
+	if (pos < 0 || fseek(fp, pos, SEEK_SET) || fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		return -1;
+
+	return fseek(fp, 0, SEEK_END);
+}
+
+static const char *trace_names[] = {
+	[MDNSD_TR_PKT_IN]      = "pkt_in",
+	[MDNSD_TR_PKT_DROP]    = "pkt_drop",
+	[MDNSD_TR_PKT_OUT]     = "pkt_out",
+	[MDNSD_TR_QUERY]       = "query",
+	[MDNSD_TR_ANSWER]      = "answer",
+	[MDNSD_TR_SEND]        = "send",
+	[MDNSD_TR_KNOWN]       = "known",
+	[MDNSD_TR_LIMIT]       = "limit",
+	[MDNSD_TR_DUPE]        = "dupe",
+	[MDNSD_TR_PROBE]       = "probe",
+	[MDNSD_TR_CONFLICT]    = "conflict",
+	[MDNSD_TR_CACHE_ADD]   = "cache_add",
+	[MDNSD_TR_CACHE_DEL]   = "cache_del",
+	[MDNSD_TR_CACHE_EVICT] = "cache_evict",
+};
+
+int mdnsd_trace_print(FILE *out, FILE *in)
+{
+	struct mdnsd_trace ev;
+	struct trace_hdr hdr;
+	unsigned long long first = 0;
+	unsigned int i;
+
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != TRACE_MAGIC ||
+	    hdr.version != TRACE_VERSION || hdr.size != sizeof(ev))
+		return -1;
+
+	for (i = 0; i < hdr.count; i++) {
+		char addr[INET_ADDRSTRLEN], ip[INET_ADDRSTRLEN];
+		const char *event = NULL;
+		unsigned long long usec;
+
+		if (fread(&ev, sizeof(ev), 1, in) != 1)
+			return -1;
+
+		if (!first)
+			first = ev.usec;
+		usec = ev.usec - first;
+		if (ev.event < sizeof(trace_names) / sizeof(trace_names[0]))
+			event = trace_names[ev.event];
+
+		inet_ntop(AF_INET, &ev.addr, addr, sizeof(addr));
+		fprintf(out, "%llu.%06llu %u %s %s", usec / 1000000, usec % 1000000,
+			ev.seq, addr, event ? event : "unknown");
+
+		switch (ev.event) {
+		case MDNSD_TR_PKT_IN:
+		case MDNSD_TR_PKT_DROP:
+		case MDNSD_TR_PKT_OUT:
+			inet_ntop(AF_INET, &ev.arg[0], ip, sizeof(ip));
+			fprintf(out, " %s %u\n", ip, ev.arg[1]);
+			break;
+
+		case MDNSD_TR_QUERY:
+		case MDNSD_TR_ANSWER:
+			inet_ntop(AF_INET, &ev.arg[0], ip, sizeof(ip));
+			fprintf(out, " %d %.*s %s", ev.type, (int)sizeof(ev.name), ev.name, ip);
+			if (ev.event == MDNSD_TR_ANSWER)
+				fprintf(out, " %u", ev.arg[1]);
+			fprintf(out, "\n");
+			break;
+
+		case MDNSD_TR_SEND:
+		case MDNSD_TR_PROBE:
+		case MDNSD_TR_CACHE_ADD:
+			fprintf(out, " %d %.*s %u\n", ev.type, (int)sizeof(ev.name), ev.name, ev.arg[0]);
+			break;
+
+		default:
+			fprintf(out, " %d %.*s\n", ev.type, (int)sizeof(ev.name), ev.name);
+			break;
+		}
+	}
+
+	return 0;
+}
@@ -27,18 +27,53 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include "mdnsd.h"
+#include "heap.h"
+#include "pool.h"
+#include "store.h"
+#include <limits.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
 #define SPRIME 108		/* Size of query/publish hashes */
-#define LPRIME 1009		/* Size of cache hash */
+#define CACHE_MIN 64		/* Initial size of cache index, power of 2 */
+#define NAMES_MIN 64		/* Initial size of name table, power of 2 */
+#define FILTER_SIZE 4096	/* Counters in name filter, 12 bits per index */
 
-#define GC 86400                /* Brute force garbage cleanup
-				 * frequency, rarely needed (daily
-				 * default) */
+#define SLEEP_MAX 86400		/* Max sleep when there is nothing to do */
+#define QUERY_MAX 3600		/* Max interval of repeated queries, RFC 6762 */
+
+#define SUB_BATCH 16		/* Initial room for batched records */
+#define SUB_BATCH_MAX 1024	/* Delivered early when this many */
+
+#define UNICAST_SRCS  64	/* Rate limits of unicast replies, by source */
+#define UNICAST_RATE  100	/* msec per reply to a source, after a ... */
+#define UNICAST_BURST 20	/* ... burst of this many, see _u_allow() */
+
+#define HELD_MAX 16		/* Sources with a query held, see _h_hold() */
+#define HELD_RR  1024		/* Known answers merged per held query */
+
+/* Event in the trace ring, at the time of the packet, see mdnsd_trace() */
+#define TRACE(d, ev, name, type, a, b) \
+	mdnsd_trace(MDNSD_TR_##ev, (d)->addr, &(d)->now, name, type, a, b)
+
+#define MMSG_BATCH 16		/* Datagrams per recvmmsg()/sendmmsg() */
+#define MMSG_LEN   9000		/* Max mDNS packet size, RFC 6762 sec. 17 */
+#define UNSENT_MAX  64		/* Datagrams kept while the socket is full */
+#define UNSENT_WAIT 10000	/* usec, before trying those again */
 
 /**
  * Messy, but it's the best/simplest balance I can find at the moment
@@ -55,17 +90,43 @@
 struct query {
 	char *name;
 	int type;
-	unsigned long int nexttry;
-	int tries;
+	unsigned long int sent;		/* Last asked, 0: never */
+	unsigned long int interval;	/* Doubled every time asked */
+	struct heap_node sched;		/* Keyed on when to ask next */
 	int (*answer)(mdns_answer_t *, void *);
 	void *arg;
-	struct query *next, *list;
+	struct query *next, *list, *due;
+	struct query *known;		/* Known answers still to send */
+};
+
+/*
+ * Query with the TC bit set, held until the rest of its known answers
+ * have arrived from the same source, RFC 6762 sec. 7.2.  Questions and
+ * answers are copies, see _rr_dup()
+ */
+struct held {
+	struct in_addr ip;
+	struct timeval until;		/* Answered by then, the latest */
+	struct question *qd;
+	struct resource *an;
+	int qdcount, qdsize;
+	int ancount, ansize;
+	struct held *next;
+};
+
+/* Datagram built, but not taken by a full socket, see flush_out() */
+struct unsent {
+	struct sockaddr_in to;
+	size_t len;
+	struct unsent *next;
+	unsigned char data[];
 };
 
 struct unicast {
 	int id;
 	struct in_addr to;
 	unsigned short port;
+	unsigned short type;	/* Of question, r is the first match */
 	mdns_record_t *r;
 	struct unicast *next;
 };
@@ -73,91 +134,519 @@ struct unicast {
 struct cached {
 	struct mdns_answer rr;
 	struct query *q;
-	struct cached *next;
+	struct heap_node expire;	/* Keyed on rr.ttl */
+	struct heap_node evict;		/* Same, only while there is no q */
+	unsigned int size;		/* Of entry, with name and data */
+	unsigned long int born;		/* When rr.ttl was set by an answer */
+	unsigned short jitter;		/* Of refresh times, 1/1000 of TTL */
+	unsigned char step;		/* Next refresh, see _c_refresh() */
+	unsigned int kmark;		/* Sent as known answer, see kserial */
+	struct cached *next;	/* Next entry with the same name */
+};
+
+/*
+ * Interned name, one per distinct name regardless of case, RFC 4343,
+ * shared by all records, queries and cache entries with that name, or
+ * rdname.  The hash is of the name in lower case, so a name is looked
+ * up once and then compared by pointer.  The first spelling seen is
+ * the one kept.  See _n_get()
+ */
+struct iname {
+	struct iname *next;	/* In the same bucket */
+	unsigned int hash;
+	unsigned int refs;
+	char name[];
+};
+
+/*
+ * Subscription to received records, see mdnsd_subscribe().  A batched
+ * one keeps a copy of each match, with name and rdata in one block from
+ * the pool, until mdnsd_deliver()
+ */
+struct mdns_sub {
+	char *name;			/* Interned, or NULL for any */
+	int type;
+	mdnsd_record_received_callback cb;
+	mdnsd_batch_callback batch;
+	void *data;
+	struct resource *rr;		/* Batch, copies */
+	int num, size;
+	struct mdns_sub *next;
+};
+
+/*
+ * Open addressing (linear probing) index of the cache, one slot per
+ * name.  The name hash is kept in the slot so probing only has to
+ * compare the interned name on a hash match, all entries for a name
+ * are then found on the slot's list.
+ */
+struct cslot {
+	unsigned int hash;
+	struct cached *head;
+};
+
+/*
+ * Cache snapshot, see mdnsd_cache_save().  Host byte order, it is only
+ * for reading back on the same machine.  A header, then each entry as
+ * a snap_rr followed by name, rdata and rdname, padded so every entry
+ * is aligned for reading in place from an mmap()ed file.
+ */
+#define SNAP_MAGIC   0x534e444d	/* "MDNS" on little endian */
+#define SNAP_VERSION 1
+#define SNAP_ALIGN   8
+
+struct snap_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t class;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+struct snap_rr {
+	int64_t  expire;		/* Absolute, seconds since the epoch */
+	uint32_t ip;			/* Network byte order */
+	uint16_t type, rdlen;
+	uint16_t nlen, rlen;		/* Incl. NUL, 0 if no rdname */
+	uint16_t priority, weight;
+	uint16_t port, pad[3];
+};
+
+static inline size_t _snap_len(size_t len)
+{
+	return (len + SNAP_ALIGN - 1) & ~(size_t)(SNAP_ALIGN - 1);
+}
+
+/* Per-packet index of known answers or probed records, see _k_init() */
+#define KSET_STACK 128		/* Slots on stack, room for 64 records */
+
+struct kslot {
+	unsigned int hash;
+	int idx;		/* Record in section, -1 if free */
+};
+
+struct kset {
+	struct resource *rr;
+	unsigned int mask;
+	struct kslot *slot;
+	struct kslot local[KSET_STACK];
+};
+
+/*
+ * Published record prepared for sending, one block with the owner name
+ * and the rdata: fixed part (SRV header, TXT, IP) plus any name.  Only
+ * compression of the names is left to do per packet.  The block is from
+ * store_get(), starting with the name, so daemons on all interfaces
+ * share one copy of each record.  Only this header is per daemon.
+ */
+struct r_wire {
+	struct wire_name *name, *rdname;
+	unsigned short len;
+	unsigned char *data;
 };
 
 struct mdns_record {
 	struct mdns_answer rr;
 	char unique;		/* # of checks performed to ensure */
+	char stale;		/* Since mdnsd_mark(), not set again */
+	char batched;		/* On a_batch, see mdnsd_begin() */
 	int modified;		/* Ignore conflicts after update at runtime */
 	int tries;
 	void (*conflict)(char *, int, void *);
 	void *arg;
-	struct timeval last_sent;
-	struct mdns_record *next, *list;
+	struct timeval last_sent;	/* Multicast, unicast does not count */
+	struct heap_node announce;	/* Keyed on next republish time */
+	struct r_wire *wire;		/* Wire format, built when first sent */
+	unsigned int mark, xmark;	/* Packet serial, as answer/additional */
+	struct mdns_record *next, *list, *extra, *batch;
 };
 
 struct mdns_daemon {
 	char shutdown, disco;
-	unsigned long int expireall, checkqlist;
 	struct timeval now, sleep, pause, probe, publish;
 	int class, frame;
-	struct cached *cache[LPRIME];
+	struct cslot *cache;
+	size_t cache_size, cache_names, cache_count;
+	size_t cache_bytes, cache_max_bytes, cache_max;
+	struct heap expiry, evictable, republish, schedule;
 	struct mdns_record *published[SPRIME], *probing, *a_now, *a_pause, *a_publish;
+	struct mdns_record *a_extra;	/* Additional records for this packet */
+	struct mdns_record *a_batch;	/* To publish at mdnsd_commit() */
+	int batch;			/* Nesting of mdnsd_begin() */
+	unsigned int serial;		/* Of packet being built by mdnsd_out() */
 	struct unicast *uanswers;
+	unsigned long long ulimit[UNICAST_SRCS];	/* msec, see _u_allow() */
 	struct query *queries[SPRIME], *qlist;
+	struct query *kq;		/* Known answers of last questions left */
+	unsigned int kserial;		/* Of those questions, see _q_known() */
+	struct held *held;		/* Queries with TC bit, see _h_hold() */
+	int held_count;
+	struct unsent *unsent, **unsent_tail;	/* Sent first next step */
+	int unsent_count;
+	struct iname **names;
+	size_t names_size, names_count;
+	unsigned char filter[FILTER_SIZE];	/* Names published or queried */
 
 	struct in_addr addr;
+	int ifindex;		/* Egress interface on a shared socket */
+	pool_t *pool;
 
-	mdnsd_record_received_callback received_callback;
-	void *received_callback_data;
+	struct mdns_sub *subs, *legacy;	/* See mdnsd_register_receive_callback() */
+	int subs_any;			/* Without a name, see mdnsd_input() */
+
+	struct mdnsd_stats stats;
 };
 
-static int _namehash(const char *s)
+/* ASCII only, RFC 4343 */
+static inline unsigned char _lower(unsigned char c)
+{
+	return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+/* FNV-1a of name in lower case, same as message_name_hash() */
+static unsigned int _n_hash(const char *s)
 {
 	const unsigned char *name = (const unsigned char *)s;
-	unsigned long h = 0, g;
+	unsigned int h = 2166136261U;
 
-	while (*name) {		/* do some fancy bitwanking on the string */
-		h = (h << 4) + (unsigned long)(*name++);
-		if ((g = (h & 0xF0000000UL)) != 0)
-			h ^= (g >> 24);
-		h &= ~g;
+	while (*name) {
+		h ^= _lower(*name++);
+		h *= 16777619U;
 	}
 
-	return (int)h;
+	return h;
+}
+
+/* Interned name from its string, see _n_get() */
+static inline struct iname *_n(const char *name)
+{
+	return (struct iname *)(name - offsetof(struct iname, name));
+}
+
+static struct iname *_n_lookup(mdns_daemon_t *d, unsigned int hash, const char *name)
+{
+	struct iname *n;
+
+	if (!d->names_size)
+		return NULL;
+
+	for (n = d->names[hash & (d->names_size - 1)]; n; n = n->next) {
+		if (n->name == name)
+			return n;
+		if (n->hash == hash && !strcasecmp(n->name, name))
+			return n;
+	}
+
+	return NULL;
+}
+
+/* Interned name same as name, or NULL if nothing has that name */
+static const char *_n_find(mdns_daemon_t *d, const char *name)
+{
+	struct iname *n;
+
+	if (!name)
+		return NULL;
+
+	n = _n_lookup(d, _n_hash(name), name);
+	return n ? n->name : NULL;
+}
+
+/* Double the size of the name table */
+static int _n_grow(mdns_daemon_t *d)
+{
+	struct iname **old = d->names;
+	size_t oldsz = d->names_size;
+	size_t size, i;
+
+	size = oldsz ? oldsz * 2 : NAMES_MIN;
+	d->names = calloc(size, sizeof(struct iname *));
+	if (!d->names) {
+		d->names = old;
+		return 1;
+	}
+	d->names_size = size;
+
+	for (i = 0; i < oldsz; i++) {
+		struct iname *n, *next;
+
+		for (n = old[i]; n; n = next) {
+			size_t j = n->hash & (size - 1);
+
+			next = n->next;
+			n->next = d->names[j];
+			d->names[j] = n;
+		}
+	}
+	free(old);
+
+	return 0;
+}
+
+/* Reference to the interned name same as name, added if new */
+static char *_n_get(mdns_daemon_t *d, const char *name)
+{
+	unsigned int hash = _n_hash(name);
+	struct iname *n;
+	size_t len, i;
+
+	n = _n_lookup(d, hash, name);
+	if (n) {
+		n->refs++;
+		return n->name;
+	}
+
+	if (d->names_count >= d->names_size && _n_grow(d))
+		return NULL;
+
+	len = strlen(name) + 1;
+	n = pool_alloc(d->pool, sizeof(struct iname) + len);
+	if (!n)
+		return NULL;
+
+	memcpy(n->name, name, len);
+	n->hash = hash;
+	n->refs = 1;
+
+	i = hash & (d->names_size - 1);
+	n->next = d->names[i];
+	d->names[i] = n;
+	d->names_count++;
+
+	return n->name;
+}
+
+/* Drop reference to an interned name, or NULL */
+static void _n_put(mdns_daemon_t *d, const char *name)
+{
+	struct iname *n, **np;
+
+	if (!name)
+		return;
+
+	n = _n(name);
+	if (--n->refs)
+		return;
+
+	for (np = &d->names[n->hash & (d->names_size - 1)]; *np != n; np = &(*np)->next)
+		;
+	*np = n->next;
+	d->names_count--;
+	pool_free(d->pool, n);
 }
 
 /* Basic linked list and hash primitives */
 static struct query *_q_next(mdns_daemon_t *d, struct query *q, const char *host, int type)
 {
-	if (!q)
-		q = d->queries[_namehash(host) % SPRIME];
-	else
+	const char *name;
+
+	if (!q) {
+		name = _n_find(d, host);
+		if (!name)
+			return NULL;
+		q = d->queries[_n(name)->hash % SPRIME];
+	} else {
+		name = q->name;
 		q = q->next;
+	}
 
 	for (; q != 0; q = q->next) {
-		if (q->type == type && strcmp(q->name, host) == 0)
+		if (q->type == type && q->name == name)
 			return q;
 	}
 
 	return NULL;
 }
 
+/*
+ * Counting Bloom filter of all names we publish or query for, two
+ * counters per name, both taken from its hash.  Lets _wanted()
+ * drop packets for other names without decompressing or looking up
+ * any of them.  A counter that overflows stays set, a false positive
+ * only costs parsing a packet we then ignore.
+ */
+static void _f_update(mdns_daemon_t *d, const char *name, int add)
+{
+	unsigned int hash = _n(name)->hash;
+	unsigned char *n[2];
+	int i;
+
+	n[0] = &d->filter[hash & (FILTER_SIZE - 1)];
+	n[1] = &d->filter[(hash >> 12) & (FILTER_SIZE - 1)];
+	for (i = 0; i < 2; i++) {
+		if (*n[i] == UCHAR_MAX)
+			continue;
+		if (add)
+			(*n[i])++;
+		else if (*n[i])
+			(*n[i])--;
+	}
+}
+
+static int _f_match(mdns_daemon_t *d, unsigned int hash)
+{
+	return d->filter[hash & (FILTER_SIZE - 1)] && d->filter[(hash >> 12) & (FILTER_SIZE - 1)];
+}
+
+/* Slot of interned name, if cached */
+static struct cslot *_c_slot(mdns_daemon_t *d, const char *name)
+{
+	unsigned int hash = _n(name)->hash;
+	size_t mask, i;
+
+	if (!d->cache)
+		return NULL;
+
+	mask = d->cache_size - 1;
+	for (i = hash & mask; d->cache[i].head; i = (i + 1) & mask) {
+		if (d->cache[i].head->rr.name == name)
+			return &d->cache[i];
+	}
+
+	return NULL;
+}
+
+/* Same as _c_slot(), for the name at off in a received packet */
+static struct cslot *_c_wslot(mdns_daemon_t *d, unsigned int hash, const unsigned char *packet, size_t len, unsigned short off)
+{
+	size_t mask, i;
+
+	if (!d->cache)
+		return NULL;
+
+	mask = d->cache_size - 1;
+	for (i = hash & mask; d->cache[i].head; i = (i + 1) & mask) {
+		if (d->cache[i].hash == hash && !message_name_cmp(packet, len, off, d->cache[i].head->rr.name))
+			return &d->cache[i];
+	}
+
+	return NULL;
+}
+
 static struct cached *_c_next(mdns_daemon_t *d, struct cached *c,const char *host, int type)
 {
-	if (!c)
-		c = d->cache[_namehash(host) % LPRIME];
-	else
+	if (!c) {
+		struct cslot *s;
+
+		host = _n_find(d, host);
+		if (!host || !(s = _c_slot(d, host)))
+			return NULL;
+		c = s->head;
+	} else
 		c = c->next;
 
 	for (; c != 0; c = c->next) {
-		if ((type == c->rr.type || type == QTYPE_ANY) && strcmp(c->rr.name, host) == 0)
+		if (type == c->rr.type || type == QTYPE_ANY)
 			return c;
 	}
 
 	return NULL;
 }
 
+/* Double the size of the cache index, rehashing all slots */
+static int _c_grow(mdns_daemon_t *d)
+{
+	struct cslot *old = d->cache;
+	size_t oldsz = d->cache_size;
+	size_t size, mask, i, j;
+
+	size = oldsz ? oldsz * 2 : CACHE_MIN;
+	d->cache = calloc(size, sizeof(struct cslot));
+	if (!d->cache) {
+		d->cache = old;
+		return 1;
+	}
+	d->cache_size = size;
+
+	mask = size - 1;
+	for (i = 0; i < oldsz; i++) {
+		if (!old[i].head)
+			continue;
+
+		for (j = old[i].hash & mask; d->cache[j].head; j = (j + 1) & mask)
+			;
+		d->cache[j] = old[i];
+	}
+	free(old);
+
+	return 0;
+}
+
+/* Link in a new entry, first one of its name claims a new slot */
+static int _c_insert(mdns_daemon_t *d, struct cached *c)
+{
+	unsigned int hash = _n(c->rr.name)->hash;
+	struct cslot *s;
+	size_t mask, i;
+
+	s = _c_slot(d, c->rr.name);
+	if (s) {
+		c->next = s->head;
+		s->head = c;
+		d->cache_count++;
+		return 0;
+	}
+
+	/* Keep load factor below 3/4 */
+	if ((d->cache_names + 1) * 4 > d->cache_size * 3 && _c_grow(d))
+		return 1;
+
+	mask = d->cache_size - 1;
+	for (i = hash & mask; d->cache[i].head; i = (i + 1) & mask)
+		;
+	c->next = NULL;
+	d->cache[i].hash = hash;
+	d->cache[i].head = c;
+	d->cache_names++;
+	d->cache_count++;
+
+	return 0;
+}
+
+/* Release an empty slot, shift back any entries displaced by it */
+static void _c_release(mdns_daemon_t *d, struct cslot *s)
+{
+	size_t mask = d->cache_size - 1;
+	size_t i = (size_t)(s - d->cache);
+	size_t j = i;
+
+	while (1) {
+		size_t home;
+
+		j = (j + 1) & mask;
+		if (!d->cache[j].head)
+			break;
+
+		/* Entry at j may only move back if i is between its home and j */
+		home = d->cache[j].hash & mask;
+		if (((j - home) & mask) < ((j - i) & mask))
+			continue;
+
+		d->cache[i] = d->cache[j];
+		i = j;
+	}
+
+	d->cache[i].head = NULL;
+	d->cache[i].hash = 0;
+	d->cache_names--;
+}
+
 static mdns_record_t *_r_next(mdns_daemon_t *d, mdns_record_t *r, const char *host, int type)
 {
-	if (!r)
-		r = d->published[_namehash(host) % SPRIME];
-	else
+	const char *name;
+
+	if (!r) {
+		name = _n_find(d, host);
+		if (!name)
+			return NULL;
+		r = d->published[_n(name)->hash % SPRIME];
+	} else {
+		name = r->rr.name;
 		r = r->next;
+	}
 
 	for (; r != NULL; r = r->next) {
-		if ((type == r->rr.type || type == QTYPE_ANY) && strcmp(r->rr.name, host) == 0)
+		if ((type == r->rr.type || type == QTYPE_ANY) && r->rr.name == name)
 			return r;
 	}
 
@@ -183,27 +672,206 @@ static size_t _rr_len(mdns_answer_t *rr)
 /* Compares new rdata with known a, painfully */
 static int _a_match(struct resource *r, mdns_answer_t *a)
 {
-	if (!a->name)
+	if (!a->name || !r->name)
 		return 0;
-	if (strcmp(r->name, a->name) || r->type != a->type)
+	if (r->type != a->type || strcasecmp(r->name, a->name))
 		return 0;
 
-	if (r->type == QTYPE_SRV &&
-	    r->known.srv.name && a->rdname && !strcmp(r->known.srv.name, a->rdname) &&
-	    a->srv.port == r->known.srv.port &&
-	    a->srv.weight == r->known.srv.weight &&
-	    a->srv.priority == r->known.srv.priority)
-		return 1;
+	switch (r->type) {
+	case QTYPE_SRV:
+		return r->known.srv.name && a->rdname && !strcasecmp(r->known.srv.name, a->rdname) &&
+			a->srv.port == r->known.srv.port &&
+			a->srv.weight == r->known.srv.weight &&
+			a->srv.priority == r->known.srv.priority;
 
-	if ((r->type == QTYPE_PTR || r->type == QTYPE_NS || r->type == QTYPE_CNAME) &&
-	    !strcmp(a->rdname, r->known.ns.name))
-		return 1;
+	case QTYPE_PTR:
+	case QTYPE_NS:
+	case QTYPE_CNAME:
+		return r->known.ns.name && a->rdname && !strcasecmp(a->rdname, r->known.ns.name);
 
-	if (r->type == QTYPE_A || !memcmp(&r->known.a.ip, &a->ip, 4))
-		return 1;
+	case QTYPE_A:
+		return !memcmp(&r->known.a.ip, &a->ip, 4);
+	}
+
+	return r->rdlength == a->rdlen && !memcmp(r->rdata, a->rdata, r->rdlength);
+}
+
+static unsigned int _fnv(unsigned int h, const void *p, size_t len)
+{
+	const unsigned char *buf = (const unsigned char *)p;
+
+	while (len--) {
+		h ^= *buf++;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+/* Hash of name and type, and of the parts of rdata _a_match() compares */
+static unsigned int _k_hash(const char *name, unsigned short type, const char *rdname,
+			    const unsigned short srv[3], struct in_addr ip,
+			    const unsigned char *rdata, size_t len)
+{
+	unsigned int h;
+
+	h = _fnv(_n_hash(name), &type, sizeof(type));
+	if (srv == NULL)
+		return h;
+
+	switch (type) {
+	case QTYPE_SRV:
+		h = _fnv(h, srv, 3 * sizeof(srv[0]));
+		/* fallthrough */
+	case QTYPE_PTR:
+	case QTYPE_NS:
+	case QTYPE_CNAME:
+		if (rdname) {
+			unsigned int rh = _n_hash(rdname);
+
+			h = _fnv(h, &rh, sizeof(rh));
+		}
+		return h;
+
+	case QTYPE_A:
+		return _fnv(h, &ip, sizeof(ip));
+	}
+
+	return rdata ? _fnv(h, rdata, len) : h;
+}
+
+/* Only the known part for the type is set by the parser */
+static unsigned int _k_rr(struct resource *r, int rdata)
+{
+	unsigned short srv[3] = { 0 };
+	struct in_addr ip = { 0 };
+	char *rdname = NULL;
+
+	switch (r->type) {
+	case QTYPE_SRV:
+		srv[0] = r->known.srv.priority;
+		srv[1] = r->known.srv.weight;
+		srv[2] = r->known.srv.port;
+		rdname = r->known.srv.name;
+		break;
+
+	case QTYPE_PTR:
+	case QTYPE_NS:
+	case QTYPE_CNAME:
+		rdname = r->known.ns.name;
+		break;
+
+	case QTYPE_A:
+		ip = r->known.a.ip;
+		break;
+	}
+
+	return _k_hash(r->name, r->type, rdname, rdata ? srv : NULL, ip, r->rdata, r->rdlength);
+}
+
+static unsigned int _k_answer(mdns_answer_t *a, int rdata)
+{
+	unsigned short srv[3] = { a->srv.priority, a->srv.weight, a->srv.port };
+
+	return _k_hash(a->name, a->type, a->rdname, rdata ? srv : NULL, a->ip, a->rdata, a->rdlen);
+}
+
+/*
+ * Index of one section of a received message, built once per packet.
+ * Open addressing on a hash of name and type, with or without rdata,
+ * so checking one of our records against all known answers, or all
+ * records proposed in a probe, is O(1) instead of O(section).
+ */
+static void _k_init(struct kset *k, struct resource *rr, int num, int rdata)
+{
+	unsigned int size = 16;
+	int i;
+
+	while (size < 2 * (unsigned int)num)
+		size <<= 1;
+
+	k->rr = rr;
+	k->mask = size - 1;
+	if (size <= KSET_STACK)
+		k->slot = k->local;
+	else
+		k->slot = malloc(size * sizeof(struct kslot));
+	if (!k->slot)
+		return;		/* Nothing is known, we answer all */
+
+	for (i = 0; i < (int)size; i++)
+		k->slot[i].idx = -1;
+
+	for (i = 0; rr && i < num; i++) {
+		unsigned int h, j;
+
+		if (!rr[i].name)
+			continue;
+
+		h = _k_rr(&rr[i], rdata);
+		for (j = h & k->mask; k->slot[j].idx >= 0; j = (j + 1) & k->mask)
+			;
+		k->slot[j].hash = h;
+		k->slot[j].idx  = i;
+	}
+}
+
+static void _k_free(struct kset *k)
+{
+	if (k->slot != k->local)
+		free(k->slot);
+}
+
+/* Next record in k with the same hash, *pos is -1 to start over */
+static struct resource *_k_next(struct kset *k, unsigned int hash, int *pos)
+{
+	unsigned int j;
+
+	if (!k->slot)
+		return NULL;
+
+	j = *pos < 0 ? hash & k->mask : ((unsigned int)*pos + 1) & k->mask;
+	for (; k->slot[j].idx >= 0; j = (j + 1) & k->mask) {
+		if (k->slot[j].hash != hash)
+			continue;
+
+		*pos = j;
+		return &k->rr[k->slot[j].idx];
+	}
+
+	return NULL;
+}
+
+/* Do they already have this answer, with at least half our TTL left? */
+static int _k_known(struct kset *k, mdns_answer_t *a)
+{
+	struct resource *r;
+	unsigned int h;
+	int pos = -1;
+
+	h = _k_answer(a, 1);
+	while ((r = _k_next(k, h, &pos))) {
+		if (_a_match(r, a) && r->ttl >= a->ttl / 2)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Does someone probe for our name and type, with other data? */
+static int _k_conflict(struct kset *k, mdns_answer_t *a)
+{
+	struct resource *r;
+	unsigned int h;
+	int pos = -1;
 
-	if (r->rdlength == a->rdlen && !memcmp(r->rdata, a->rdata, r->rdlength))
-		return 1;
+	h = _k_answer(a, 0);
+	while ((r = _k_next(k, h, &pos))) {
+		if (r->type != a->type || strcasecmp(r->name, a->name))
+			continue;
+		if (!_a_match(r, a))
+			return 1;
+	}
 
 	return 0;
 }
@@ -219,6 +887,27 @@ static long _tvdiff(struct timeval old, struct timeval new)
 	return (new.tv_usec - old.tv_usec) + udiff;
 }
 
+/* Count v in histogram h, see MDNSD_HIST */
+static void _hist(unsigned long long *h, unsigned long v)
+{
+	int i = 0;
+
+	while (v && i < MDNSD_HIST - 1) {
+		v >>= 1;
+		i++;
+	}
+	h[i]++;
+}
+
+/* Microseconds since t, a CLOCK_MONOTONIC timestamp */
+static unsigned long _usec(struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1000000 + (now.tv_nsec - t->tv_nsec) / 1000;
+}
+
 static void _r_remove_list(mdns_record_t **list, mdns_record_t *r)
 {
 	mdns_record_t *tmp;
@@ -269,18 +958,54 @@ static void _r_push(mdns_record_t **list, mdns_record_t *r)
 	*list = r;
 }
 
+/* Schedule republish of r, 2 seconds before its TTL expires at peers */
+static void _r_sched(mdns_daemon_t *d, mdns_record_t *r)
+{
+	unsigned long ttl = r->rr.ttl;
+
+	if (!ttl) {
+		heap_del(&d->republish, &r->announce);
+		return;
+	}
+
+	if (ttl > 2)
+		ttl -= 2;
+	heap_set(&d->republish, &r->announce, (unsigned long)r->last_sent.tv_sec + ttl);
+}
+
+/* Record sent out, update timestamp and republish time */
+static void _r_sent(mdns_daemon_t *d, mdns_record_t *r)
+{
+	r->last_sent = d->now;
+	_r_sched(d, r);
+}
+
 /* Force any r out right away, if valid */
 static void _r_publish(mdns_daemon_t *d, mdns_record_t *r)
 {
-	r->modified = 1;
+	/* Rescheduled when sent */
+	heap_del(&d->republish, &r->announce);
 
+	/* Probing already, data set before it is announced is no update */
 	if (r->unique && r->unique < 5)
-		return;		/* Probing already */
+		return;
+
+	r->modified = 1;
 
 	r->tries = 0;
 	d->publish.tv_sec = d->now.tv_sec;
 	d->publish.tv_usec = d->now.tv_usec;
 
+	/* Moved to a_publish by mdnsd_commit(), with all the others */
+	if (d->batch) {
+		if (!r->batched) {
+			r->batched = 1;
+			r->batch = d->a_batch;
+			d->a_batch = r;
+		}
+		return;
+	}
+
 	/* check if r already in other lists. If yes, remove it from there */
 	_r_remove_lists(d, r, &d->a_publish);
 	_r_push(&d->a_publish, r);
@@ -289,6 +1014,10 @@ static void _r_publish(mdns_daemon_t *d, mdns_record_t *r)
 /* send r out asap */
 static void _r_send(mdns_daemon_t *d, mdns_record_t *r)
 {
+	/* Goodbye, no more republish */
+	if (!r->rr.ttl)
+		heap_del(&d->republish, &r->announce);
+
 	/* Being published, make sure that happens soon */
 	if (r->tries < 4) {
 		d->publish.tv_sec = d->now.tv_sec;
@@ -304,25 +1033,115 @@ static void _r_send(mdns_daemon_t *d, mdns_record_t *r)
 		return;
 	}
 
-	/* Set d->pause.tv_usec to random 20-120 msec */
-	d->pause.tv_sec = d->now.tv_sec;
-	d->pause.tv_usec = d->now.tv_usec + (d->now.tv_usec % 100) + 20;
+	/*
+	 * Random 20-120 msec from the first answer, everything asked for
+	 * until then goes out in the same packet(s).  Not moved by later
+	 * queries, or a storm of them could hold back all answers.
+	 */
+	if (!d->a_pause) {
+		d->pause.tv_sec = d->now.tv_sec;
+		d->pause.tv_usec = d->now.tv_usec + ((d->now.tv_usec % 101) + 20) * 1000;
+		if (d->pause.tv_usec >= 1000000) {
+			d->pause.tv_sec++;
+			d->pause.tv_usec -= 1000000;
+		}
+	}
 
 	/* check if r already in other lists. If yes, remove it from there */
 	_r_remove_lists(d, r, &d->a_pause);
 	_r_push(&d->a_pause, r);
 }
 
+/* Multicast less than a second ago, RFC 6762 sec. 6 */
+static int _r_recent(mdns_daemon_t *d, mdns_record_t *r)
+{
+	if (!r->last_sent.tv_sec)
+		return 0;
+
+	return _tvdiff(r->last_sent, d->now) < 1000000;
+}
+
+/*
+ * Probe or announcement of r due again, usec after the last one.  If
+ * not, next is moved up to when it is, unless something is due sooner
+ */
+static int _r_due(mdns_daemon_t *d, mdns_record_t *r, long usec, struct timeval *next)
+{
+	struct timeval due;
+
+	due.tv_sec  = r->last_sent.tv_sec + usec / 1000000;
+	due.tv_usec = r->last_sent.tv_usec + usec % 1000000;
+	if (due.tv_usec >= 1000000) {
+		due.tv_sec++;
+		due.tv_usec -= 1000000;
+	}
+
+	if (_tvdiff(d->now, due) <= 0)
+		return 1;
+
+	if (!next->tv_sec || _tvdiff(due, *next) > 0)
+		*next = due;
+
+	return 0;
+}
+
+static int _r_listed(mdns_record_t *list, mdns_record_t *r)
+{
+	for (; list; list = list->list) {
+		if (list == r)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Another responder multicast answer a, if we have an identical record
+ * queued as an answer, and a has no less TTL, treat ours as sent, RFC
+ * 6762 sec. 7.4
+ */
+static void _r_dupe(mdns_daemon_t *d, struct resource *a)
+{
+	mdns_record_t *r = NULL;
+
+	while ((r = _r_next(d, r, a->name, a->type))) {
+		if (r->tries < 4 || !r->rr.ttl || a->ttl < r->rr.ttl)
+			continue;
+		if (!_r_listed(d->a_pause, r) && !_r_listed(d->a_now, r))
+			continue;
+		if (!_a_match(a, &r->rr))
+			continue;
+
+		TRACE(d, DUPE, r->rr.name, r->rr.type, 0, 0);
+		_r_remove_lists(d, r, NULL);
+		_r_sent(d, r);
+		d->stats.suppressed++;
+	}
+}
+
+/* Same querier and query, answered in the same packet */
+static int _u_same(struct unicast *a, struct unicast *b)
+{
+	return a->id == b->id && a->port == b->port && a->to.s_addr == b->to.s_addr;
+}
+
 /* Create generic unicast response struct */
-static void _u_push(mdns_daemon_t *d, mdns_record_t *r, int id, struct in_addr to, unsigned short port)
+static void _u_push(mdns_daemon_t *d, mdns_record_t *r, int type, int id, struct in_addr to, unsigned short port)
 {
 	struct unicast *u;
 
-	u = calloc(1, sizeof(struct unicast));
+	/* Same question twice in one query */
+	for (u = d->uanswers; u; u = u->next) {
+		if (u->r == r && u->type == type && u->id == id && u->port == port && u->to.s_addr == to.s_addr)
+			return;
+	}
+
+	u = pool_alloc(d->pool, sizeof(struct unicast));
 	if (!u)
 		return;
 
 	u->r = r;
+	u->type = type;
 	u->id = id;
 	u->to = to;
 	u->port = port;
@@ -330,31 +1149,168 @@ static void _u_push(mdns_daemon_t *d, mdns_record_t *r, int id, struct in_addr t
 	d->uanswers = u;
 }
 
-static void _q_reset(mdns_daemon_t *d, struct query *q)
+/*
+ * Token bucket per source of legacy unicast queries, so a querier stuck
+ * in a loop cannot make us flood it.  Each bucket holds the time it is
+ * full again, sources sharing a bucket share its rate.
+ */
+static int _u_allow(mdns_daemon_t *d, struct in_addr ip)
+{
+	unsigned long long now, *full;
+
+	now  = (unsigned long long)d->now.tv_sec * 1000 + d->now.tv_usec / 1000;
+	full = &d->ulimit[_fnv(2166136261U, &ip.s_addr, sizeof(ip.s_addr)) % UNICAST_SRCS];
+	if (*full < now)
+		*full = now;
+	if (*full - now > (UNICAST_BURST - 1) * UNICAST_RATE)
+		return 0;
+
+	*full += UNICAST_RATE;
+	return 1;
+}
+
+/*
+ * Next refresh of a cached answer, at 80, 85, 90 and 95% of its TTL,
+ * RFC 6762 sec. 5.2, or 0 when all are done and it is left to expire
+ */
+static unsigned long _c_refresh(struct cached *c)
+{
+	unsigned long long ttl;
+
+	if (c->step >= 4 || c->rr.ttl <= c->born)
+		return 0;
+
+	ttl = c->rr.ttl - c->born;
+	return c->born + (unsigned long)(ttl * (800 + 50 * c->step + c->jitter) / 1000);
+}
+
+/* TTL set by an answer, restart refreshes with 0-2% jitter so hosts differ */
+static void _c_born(mdns_daemon_t *d, struct cached *c)
 {
-	struct cached *cur = 0;
+	c->born   = (unsigned long)d->now.tv_sec;
+	c->jitter = (_n(c->rr.name)->hash ^ (unsigned int)d->now.tv_usec) % 21;
+	c->step   = 0;
+}
+
+/* When to ask q next, after its backoff or at the first refresh due */
+static unsigned long _q_deadline(mdns_daemon_t *d, struct query *q)
+{
+	unsigned long when = q->sent + q->interval;
+	struct cached *c = 0;
+
+	while ((c = _c_next(d, c, q->name, q->type))) {
+		unsigned long t;
+
+		if (c->q != q)
+			continue;
+
+		t = _c_refresh(c);
+		if (t && t < when)
+			when = t;
+	}
+
+	return when;
+}
+
+/* Ask q no later than when */
+static void _q_wake(mdns_daemon_t *d, struct query *q, unsigned long when)
+{
+	if (when && when < q->sched.key)
+		heap_set(&d->schedule, &q->sched, when);
+}
+
+/*
+ * Asked q, double the interval, up to QUERY_MAX, and skip refreshes up
+ * to its deadline.  Counting from the deadline, rather than now, keeps
+ * the schedule if q was asked early to share a packet.
+ */
+static void _q_asked(mdns_daemon_t *d, struct query *q)
+{
+	unsigned long when = _q_deadline(d, q);
+	struct cached *c = 0;
+
+	if (when < (unsigned long)d->now.tv_sec)
+		when = d->now.tv_sec;
+
+	q->sent = when;
+	q->interval = q->interval ? q->interval * 2 : 1;
+	if (q->interval > QUERY_MAX)
+		q->interval = QUERY_MAX;
+
+	while ((c = _c_next(d, c, q->name, q->type))) {
+		if (c->q != q)
+			continue;
+
+		while (c->step < 4 && _c_refresh(c) <= when)
+			c->step++;
+	}
+
+	heap_set(&d->schedule, &q->sched, _q_deadline(d, q));
+}
+
+/* Due by now, or close enough to share a packet: within 1/8 of the wait */
+static int _q_due(struct query *q, unsigned long when, unsigned long now)
+{
+	return when <= now || when - now <= (when - q->sent + 4) / 8;
+}
+
+/*
+ * Collect queries in heap v[i] and below that are due, see _q_due().
+ * Keys may be early, see _q_wake(), so the caller checks each again.
+ */
+static void _q_collect(mdns_daemon_t *d, size_t i, struct query **due)
+{
+	unsigned long now = (unsigned long)d->now.tv_sec;
+	struct heap_node *n;
+	struct query *q;
+
+	if (i >= d->schedule.len)
+		return;
 
-	q->nexttry = 0;
-	q->tries = 0;
+	n = d->schedule.v[i];
+	if (n->key > now + (QUERY_MAX + 4) / 8)
+		return;
 
-	while ((cur = _c_next(d, cur, q->name, q->type))) {
-		if (q->nexttry == 0 || cur->rr.ttl - 7 < q->nexttry)
-			q->nexttry = cur->rr.ttl - 7;
+	q = heap_entry(n, struct query, sched);
+	if (_q_due(q, n->key, now)) {
+		q->due = *due;
+		*due = q;
 	}
 
-	if (q->nexttry != 0 && q->nexttry < d->checkqlist)
-		d->checkqlist = q->nexttry;
+	_q_collect(d, 2 * i + 1, due);
+	_q_collect(d, 2 * i + 2, due);
+}
+
+/* Entry answers q, or no query if NULL, only then it may be evicted */
+static void _c_own(mdns_daemon_t *d, struct cached *c, struct query *q)
+{
+	c->q = q;
+	if (q)
+		heap_del(&d->evictable, &c->evict);
+	else
+		heap_set(&d->evictable, &c->evict, c->rr.ttl);
 }
 
 /* No more queries, update all its cached entries, remove from lists */
 static void _q_done(mdns_daemon_t *d, struct query *q)
 {
 	struct cached *c = 0;
-	struct query *cur;
-	int i = _namehash(q->name) % LPRIME;
+	struct query *cur, **kp;
+	int i = _n(q->name)->hash % SPRIME;
+
+	for (kp = &d->kq; *kp; kp = &(*kp)->known) {
+		if (*kp == q) {
+			*kp = q->known;
+			break;
+		}
+	}
 
-	while ((c = _c_next(d, c, q->name, q->type)))
-		c->q = 0;
+	while ((c = _c_next(d, c, q->name, q->type))) {
+		if (c->q == q)
+			_c_own(d, c, NULL);
+	}
+	heap_del(&d->schedule, &q->sched);
+	_f_update(d, q->name, 0);
 
 	if (d->qlist == q) {
 		d->qlist = q->list;
@@ -372,48 +1328,194 @@ static void _q_done(mdns_daemon_t *d, struct query *q)
 		cur->next = q->next;
 	}
 
-	free(q->name);
+	_n_put(d, q->name);
 	free(q);
 }
 
-static void _free_cached(struct cached *c)
+/* Names are interned, rdata is allocated inline, see _c_add() */
+static void _free_cached(mdns_daemon_t *d, struct cached *c)
 {
-	if (!c)
+	_n_put(d, c->rr.rdname);
+	_n_put(d, c->rr.name);
+	pool_free(d->pool, c);
+}
+
+/* Copy the data bits only */
+static void _a_copy(struct message *m, mdns_answer_t *a)
+{
+	/* Cached rdata may hold compression pointers, use rdname */
+	if (a->rdname) {
+		if (a->type == QTYPE_SRV)
+			message_rdata_srv(m, a->srv.priority, a->srv.weight, a->srv.port, a->rdname);
+		else
+			message_rdata_name(m, a->rdname);
+		return;
+	}
+
+	if (a->rdata) {
+		message_rdata_raw(m, a->rdata, a->rdlen);
+		return;
+	}
+
+	if (a->ip.s_addr)
+		message_rdata_raw(m, (unsigned char *)&a->ip, 4);
+}
+
+/* Name is inline, rdata and rdname can change so they are not */
+/* Changed, or about to be, build again when sent next time */
+static void _r_unwire(mdns_daemon_t *d, mdns_record_t *r)
+{
+	if (!r->wire)
+		return;
+
+	store_put(r->wire->name);
+	pool_free(d->pool, r->wire);
+	r->wire = NULL;
+}
+
+static struct r_wire *_r_wire(mdns_daemon_t *d, mdns_record_t *r)
+{
+	unsigned char srv[6], *data = NULL, *block, *ptr;
+	size_t nlen, rlen = 0;
+	unsigned short len = 0;
+	struct r_wire *w;
+
+	if (r->wire)
+		return r->wire;
+
+	/* Same choice of rdata as _a_copy() */
+	if (r->rr.rdname) {
+		if (r->rr.type == QTYPE_SRV) {
+			ptr = srv;
+			short2net(r->rr.srv.priority, &ptr);
+			short2net(r->rr.srv.weight, &ptr);
+			short2net(r->rr.srv.port, &ptr);
+			data = srv;
+			len = sizeof(srv);
+		}
+		rlen = message_name_size(r->rr.rdname);
+		if (!rlen)
+			return NULL;
+	} else if (r->rr.rdata) {
+		data = r->rr.rdata;
+		len = r->rr.rdlen;
+	} else if (r->rr.ip.s_addr) {
+		data = (unsigned char *)&r->rr.ip;
+		len = 4;
+	}
+
+	nlen = message_name_size(r->rr.name);
+	if (!nlen)
+		return NULL;	/* Odd name, sent the slow way */
+
+	/* Zeroed, so padding is the same for the same record everywhere */
+	block = pool_alloc(d->pool, nlen + rlen + len);
+	if (!block)
+		return NULL;
+
+	message_name_prep((struct wire_name *)block, r->rr.name);
+	if (rlen)
+		message_name_prep((struct wire_name *)(block + nlen), r->rr.rdname);
+	if (len)
+		memcpy(block + nlen + rlen, data, len);
+
+	ptr = store_get(block, nlen + rlen + len);
+	pool_free(d->pool, block);
+	if (!ptr)
+		return NULL;
+
+	w = pool_alloc(d->pool, sizeof(*w));
+	if (!w) {
+		store_put(ptr);
+		return NULL;
+	}
+
+	w->name   = (struct wire_name *)ptr;
+	w->rdname = rlen ? (struct wire_name *)(ptr + nlen) : NULL;
+	w->data   = ptr + nlen + rlen;
+	w->len    = len;
+	r->wire   = w;
+
+	return w;
+}
+
+/* Append r to section of m, from its prepared wire format if possible */
+static void _r_append(mdns_daemon_t *d, struct message *m, mdns_record_t *r, int section, unsigned short class)
+{
+	struct r_wire *w;
+
+	TRACE(d, SEND, r->rr.name, r->rr.type, r->rr.ttl, 0);
+	w = _r_wire(d, r);
+	if (!w) {
+		if (section == MESSAGE_AR)
+			message_ar(m, r->rr.name, r->rr.type, class, r->rr.ttl);
+		else if (section == MESSAGE_NS)
+			message_ns(m, r->rr.name, r->rr.type, class, r->rr.ttl);
+		else
+			message_an(m, r->rr.name, r->rr.type, class, r->rr.ttl);
+		_a_copy(m, &r->rr);
 		return;
+	}
 
-	if (c->rr.name)
-		free(c->rr.name);
-	if (c->rr.rdata)
-		free(c->rr.rdata);
-	if (c->rr.rdname)
-		free(c->rr.rdname);
-	free(c);
+	if (section == MESSAGE_AR)
+		message_ar_prep(m, w->name, r->rr.type, class, r->rr.ttl);
+	else if (section == MESSAGE_NS)
+		message_ns_prep(m, w->name, r->rr.type, class, r->rr.ttl);
+	else
+		message_an_prep(m, w->name, r->rr.type, class, r->rr.ttl);
+	message_rdata_prep(m, w->data, w->len, w->rdname);
 }
 
-static void _free_record(mdns_record_t *r)
+static void _free_record(mdns_daemon_t *d, mdns_record_t *r)
 {
 	if (!r)
 		return;
 
-	if (r->rr.name)
-	    free(r->rr.name);
-	if (r->rr.rdata)
-		free(r->rr.rdata);
-	if (r->rr.rdname)
-		free(r->rr.rdname);
-	free(r);
+	_r_unwire(d, r);
+	store_put(r->rr.rdata);
+	_n_put(d, r->rr.rdname);
+	_n_put(d, r->rr.name);
+	pool_free(d->pool, r);
+}
+
+/* Held query, its copies are from the pool, see _h_add() */
+static void _h_free(mdns_daemon_t *d, struct held *h)
+{
+	int i;
+
+	for (i = 0; i < h->qdcount; i++)
+		pool_free(d->pool, h->qd[i].name);
+	for (i = 0; i < h->ancount; i++)
+		pool_free(d->pool, h->an[i].name);
+	free(h->qd);
+	free(h->an);
+	free(h);
 }
 
 /* buh-bye, remove from hash and free */
 static void _r_done(mdns_daemon_t *d, mdns_record_t *r)
 {
 	mdns_record_t *cur = 0;
+	struct unicast *u, **up;
 	int i;
 
 	if (!r || !r->rr.name)
 		return;
 
-	i = _namehash(r->rr.name) % SPRIME;
+	/* Pending unicast answers start at r */
+	for (up = &d->uanswers; (u = *up);) {
+		if (u->r != r) {
+			up = &u->next;
+			continue;
+		}
+
+		*up = u->next;
+		pool_free(d->pool, u);
+	}
+
+	heap_del(&d->republish, &r->announce);
+	_f_update(d, r->rr.name, 0);
+	i = _n(r->rr.name)->hash % SPRIME;
 	if (d->published[i] == r) {
 		d->published[i] = r->next;
 	} else {
@@ -423,7 +1525,7 @@ static void _r_done(mdns_daemon_t *d, mdns_record_t *r)
 			cur->next = r->next;
 	}
 
-	_free_record(r);
+	_free_record(d, r);
 }
 
 /* Call the answer function with this cached entry */
@@ -437,71 +1539,187 @@ static void _q_answer(mdns_daemon_t *d, struct cached *c)
 
 static void _conflict(mdns_daemon_t *d, mdns_record_t *r)
 {
+	d->stats.conflicts++;
+	TRACE(d, CONFLICT, r->rr.name, r->rr.type, 0, 0);
 	r->conflict(r->rr.name, r->rr.type, r->arg);
 	mdnsd_done(d, r);
 }
 
-/* Expire any old entries in this list */
-static void _c_expire(mdns_daemon_t *d, struct cached **list)
+/* Unlink entry from index and expiry heap, caller frees */
+static void _c_unlink(mdns_daemon_t *d, struct cached *c)
 {
-	struct cached *cur  = *list;
-	struct cached *last = NULL;
-	struct cached *next;
+	struct cached *cur;
+	struct cslot *s;
 
-	while (cur) {
-		next = cur->next;
+	heap_del(&d->expiry, &c->expire);
+	heap_del(&d->evictable, &c->evict);
+	d->cache_bytes -= c->size;
 
-		if ((unsigned long)d->now.tv_sec >= cur->rr.ttl) {
-			if (last)
-				last->next = next;
+	s = _c_slot(d, c->rr.name);
+	if (!s)
+		return;
 
-			/* Update list pointer if the first one expired */
-			if (*list == cur)
-				*list = next;
+	if (s->head == c) {
+		s->head = c->next;
+	} else {
+		for (cur = s->head; cur && cur->next != c; cur = cur->next)
+			;
+		if (!cur)
+			return;
+		cur->next = c->next;
+	}
+	d->cache_count--;
 
-			if (cur->q)
-				_q_answer(d, cur);
+	if (!s->head)
+		_c_release(d, s);
+}
 
-			_free_cached(cur);
-		} else {
-			last = cur;
-		}
-		cur = next;
+/* Remove entry from cache, calling any query's answer callback */
+static void _c_remove(mdns_daemon_t *d, struct cached *c)
+{
+	d->stats.cache_removals++;
+	TRACE(d, CACHE_DEL, c->rr.name, c->rr.type, 0, 0);
+	_c_unlink(d, c);
+	if (c->q)
+		_q_answer(d, c);
+	_free_cached(d, c);
+}
+
+/* Update an entry's expiry time, rr.ttl, in the heap */
+static void _c_ttl(mdns_daemon_t *d, struct cached *c, unsigned long ttl)
+{
+	c->rr.ttl = ttl;
+	heap_set(&d->expiry, &c->expire, ttl);
+	if (heap_queued(&c->evict))
+		heap_set(&d->evictable, &c->evict, ttl);
+}
+
+/* Expire all entries that are due, in deadline order */
+static void _c_expire(mdns_daemon_t *d)
+{
+	struct heap_node *n;
+
+	while ((n = heap_peek(&d->expiry)) && n->key <= (unsigned long)d->now.tv_sec)
+		_c_remove(d, heap_entry(n, struct cached, expire));
+}
+
+/*
+ * Evict entries no query needs, those expiring first, until num more
+ * entries of size bytes fit in the limits, see mdnsd_set_cache_limit().
+ * Returns 0 if they do not, when all entries left answer a query
+ */
+static int _c_room(mdns_daemon_t *d, size_t num, size_t size)
+{
+	struct heap_node *n;
+
+	while ((d->cache_max && d->cache_count + num > d->cache_max) ||
+	       (d->cache_max_bytes && d->cache_bytes + size > d->cache_max_bytes)) {
+		struct cached *c;
+
+		n = heap_peek(&d->evictable);
+		if (!n)
+			return 0;
+
+		c = heap_entry(n, struct cached, evict);
+		DBG("Cache full, evicting %s type %d", c->rr.name, c->rr.type);
+		TRACE(d, CACHE_EVICT, c->rr.name, c->rr.type, 0, 0);
+		d->stats.cache_evictions++;
+		_c_unlink(d, c);
+		_free_cached(d, c);
 	}
+
+	return 1;
 }
 
-/* Brute force expire any old cached records */
-static void _gc(mdns_daemon_t *d)
+/*
+ * New cache entry, a copy of a with rdata inline and interned names.
+ * Its size counts the names in full, even when shared with others
+ */
+static struct cached *_c_add(mdns_daemon_t *d, mdns_answer_t *a)
 {
-	int i;
+	struct query *q;
+	struct cached *c;
+	size_t size;
+
+	size = sizeof(struct cached) + strlen(a->name) + 1 + a->rdlen;
+	if (a->rdname)
+		size += strlen(a->rdname) + 1;
+	if (!_c_room(d, 1, size)) {
+		d->stats.cache_full++;
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	c = pool_alloc(d->pool, sizeof(struct cached) + a->rdlen);
+	if (!c)
+		return NULL;
+
+	c->rr = *a;
+	c->size = (unsigned int)size;
+	c->rr.rdata = NULL;
+	if (a->rdlen)
+		c->rr.rdata = memcpy(c + 1, a->rdata, a->rdlen);
+	c->rr.name = _n_get(d, a->name);
+	c->rr.rdname = a->rdname ? _n_get(d, a->rdname) : NULL;
+	if (!c->rr.name || (a->rdname && !c->rr.rdname)) {
+		_free_cached(d, c);
+		return NULL;
+	}
+
+	if (heap_set(&d->expiry, &c->expire, c->rr.ttl)) {
+		_free_cached(d, c);
+		return NULL;
+	}
+	if (_c_insert(d, c)) {
+		heap_del(&d->expiry, &c->expire);
+		_free_cached(d, c);
+		return NULL;
+	}
 
-	for (i = 0; i < LPRIME; i++) {
-		if (d->cache[i])
-			_c_expire(d, &d->cache[i]);
+	d->cache_bytes += size;
+	d->stats.cache_inserts++;
+	TRACE(d, CACHE_ADD, c->rr.name, c->rr.type, c->rr.ttl - d->now.tv_sec, 0);
+
+	/* Same as mdnsd_query() does for entries cached before the query */
+	_c_born(d, c);
+	q = _q_next(d, 0, c->rr.name, c->rr.type);
+	if (!q)
+		q = _q_next(d, 0, c->rr.name, QTYPE_ANY);
+	_c_own(d, c, q);
+	if (c->q) {
+		_q_wake(d, c->q, _c_refresh(c));
+		_q_answer(d, c);
 	}
 
-	d->expireall = (unsigned long)(d->now.tv_sec + GC);
+	return c;
 }
 
 static int _cache(mdns_daemon_t *d, struct resource *r, struct in_addr ip)
 {
 	unsigned long int ttl;
 	struct cached *c = 0;
-	int i = _namehash(r->name) % LPRIME;
+	mdns_answer_t a;
 
-	/* Cache flush for unique entries */
+	/*
+	 * Cache flush for unique entries, RFC 6762 sec. 10.2: any others not
+	 * received in the last second expire in one second, so a refresh of
+	 * the same data is not seen as a goodbye and a new answer
+	 */
 	if (r->class == 32768 + d->class) {
-		while ((c = _c_next(d, c, r->name, r->type)))
-			c->rr.ttl = 0;
-		_c_expire(d, &d->cache[i]);
+		unsigned long now = (unsigned long)d->now.tv_sec;
+
+		while ((c = _c_next(d, c, r->name, r->type))) {
+			if (_a_match(r, &c->rr) || c->born + 1 >= now || c->rr.ttl <= now + 1)
+				continue;
+			_c_ttl(d, c, now + 1);
+		}
 	}
 
 	/* Process deletes */
 	if (r->ttl == 0) {
 		while ((c = _c_next(d, c, r->name, r->type))) {
 			if (_a_match(r, &c->rr)) {
-				c->rr.ttl = 0;
-				_c_expire(d, &d->cache[i]);
+				_c_remove(d, c);
 				c = NULL;
 			}
 		}
@@ -509,99 +1727,125 @@ static int _cache(mdns_daemon_t *d, struct resource *r, struct in_addr ip)
 		return 0;
 	}
 
-	/*
-	 * XXX: The c->rr.ttl is a hack for now, BAD SPEC, start
-	 *      retrying just after half-waypoint, then expire
-	 */
-	ttl = (unsigned long)d->now.tv_sec + (r->ttl / 2) + 8;
-
+	/* Expires at full TTL, any query refreshes it before, see _c_refresh() */
+	ttl = (unsigned long)d->now.tv_sec + r->ttl;
+
 	/* If entry already exists, only udpate TTL value */
 	c = NULL;
 	while ((c = _c_next(d, c, r->name, r->type))) {
-		if (r->type == QTYPE_PTR && strcmp(c->rr.rdname, r->known.ns.name)) {
+		if (!_a_match(r, &c->rr))
 			continue;
-		}
-		c->rr.ttl = ttl;
+		_c_ttl(d, c, ttl);
+		_c_born(d, c);
+		d->stats.cache_refresh++;
+		if (c->q)
+			_q_wake(d, c->q, _c_refresh(c));
 		return 0;
 	}
 
-	/* New entry, cache it */
-	c = calloc(1, sizeof(struct cached));
-	if (!c)
-		return 1;
-
-	c->rr.name = strdup(r->name);
-	if (!c->rr.name) {
-		free(c);
-		return 1;
-	}
-	c->rr.type = r->type;
-	c->rr.ttl = ttl;
-	c->rr.rdlen = r->rdlength;
 	if (r->rdlength && !r->rdata) {
 //		ERR("rdlength is %d but rdata is NULL for domain name %s, type: %d, ttl: %ld", r->rdlength, r->name, r->type, r->ttl);
-		free(c->rr.name);
-		free(c);
 		return 1;
 	}
-	if (r->rdlength) {
-		c->rr.rdata = malloc(r->rdlength);
-		if (!c->rr.rdata) {
-			free(c->rr.name);
-			free(c);
-			return 1;
-		}
-		memcpy(c->rr.rdata, r->rdata, r->rdlength);
-	} else {
-		c->rr.rdata = NULL;
-	}
+
+	memset(&a, 0, sizeof(a));
+	a.name = r->name;
+	a.type = r->type;
+	a.ttl = ttl;
+	a.rdlen = r->rdlength;
+	a.rdata = r->rdata;
 
 	switch (r->type) {
 	case QTYPE_A:
-		c->rr.ip = r->known.a.ip;
+		a.ip = r->known.a.ip;
 		break;
 
 	case QTYPE_NS:
 	case QTYPE_CNAME:
 	case QTYPE_PTR:
-		c->rr.rdname = strdup(r->known.ns.name);
-		c->rr.ip = ip;
+		a.rdname = r->known.ns.name;
+		a.ip = ip;
 		break;
 
 	case QTYPE_SRV:
-		c->rr.rdname = strdup(r->known.srv.name);
-		c->rr.srv.port = r->known.srv.port;
-		c->rr.srv.weight = r->known.srv.weight;
-		c->rr.srv.priority = r->known.srv.priority;
+		a.rdname = r->known.srv.name;
+		a.srv.port = r->known.srv.port;
+		a.srv.weight = r->known.srv.weight;
+		a.srv.priority = r->known.srv.priority;
 		break;
 	}
 
-	c->next = d->cache[i];
-	d->cache[i] = c;
-
-	if ((c->q = _q_next(d, 0, r->name, r->type)))
-		_q_answer(d, c);
+	/* Full of entries we need is not an error */
+	if (!_c_add(d, &a))
+		return errno == ENOSPC ? 0 : 1;
 
 	return 0;
 }
 
-/* Copy the data bits only */
-static void _a_copy(struct message *m, mdns_answer_t *a)
+/* Queue additional record x, unless being probed or going away */
+static void _x_push(mdns_daemon_t *d, mdns_record_t *x)
 {
-	if (a->rdata) {
-		message_rdata_raw(m, a->rdata, a->rdlen);
+	if (!x->rr.ttl || (x->unique && x->unique < 5))
+		return;
+	if (x->xmark == d->serial)
+		return;
+
+	x->xmark = d->serial;
+	x->extra = d->a_extra;
+	d->a_extra = x;
+}
+
+/*
+ * What the querier would ask for next after getting answer r: the SRV
+ * and TXT of a service instance, and the address of the SRV target,
+ * see RFC 6763 sec. 12.
+ */
+static void _r_extra(mdns_daemon_t *d, mdns_record_t *r)
+{
+	mdns_record_t *x = NULL;
+
+	if (!r->rr.rdname)
 		return;
+
+	switch (r->rr.type) {
+	case QTYPE_PTR:
+		while ((x = _r_next(d, x, r->rr.rdname, QTYPE_ANY))) {
+			if (x->rr.type != QTYPE_SRV && x->rr.type != QTYPE_TXT)
+				continue;
+
+			_x_push(d, x);
+			if (x->rr.type == QTYPE_SRV && x->xmark == d->serial)
+				_r_extra(d, x);
+		}
+		break;
+
+	case QTYPE_SRV:
+		while ((x = _r_next(d, x, r->rr.rdname, QTYPE_A)))
+			_x_push(d, x);
+		break;
 	}
+}
 
-	if (a->ip.s_addr)
-		message_rdata_raw(m, (unsigned char *)&a->ip, 4);
-	if (a->type == QTYPE_SRV)
-		message_rdata_srv(m, a->srv.priority, a->srv.weight, a->srv.port, a->rdname);
-	else if (a->rdname)
-		message_rdata_name(m, a->rdname);
+/* Append queued additional records not already answered, if room */
+static void _r_additional(mdns_daemon_t *d, struct message *m)
+{
+	mdns_record_t *r, *next;
+
+	for (r = d->a_extra; r; r = next) {
+		next = r->extra;
+		r->extra = NULL;
+
+		if (r->mark == d->serial)
+			continue;
+		if (message_packet_len(m) + (int)_rr_len(&r->rr) >= d->frame)
+			continue;
+
+		_r_append(d, m, r, MESSAGE_AR, r->unique ? d->class + 32768 : d->class);
+	}
+
+	d->a_extra = NULL;
 }
 
-/* Copy a published record into an outgoing message */
 static int _r_out(mdns_daemon_t *d, struct message *m, mdns_record_t **list)
 {
 	mdns_record_t *r;
@@ -618,20 +1862,18 @@ static int _r_out(mdns_daemon_t *d, struct message *m, mdns_record_t **list)
 			if (r->rr.type != QTYPE_PTR)
 				continue;
 
-			if (strcmp(r->rr.name, DISCO_NAME))
+			if (strcasecmp(r->rr.name, DISCO_NAME))
 				continue;
 		}
 
-		INFO("Appending name: %s, type %d to outbound message ...", r->rr.name, r->rr.type);
 		ret++;
 
-		if (r->unique)
-			message_an(m, r->rr.name, r->rr.type, d->class + 32768, r->rr.ttl);
-		else
-			message_an(m, r->rr.name, r->rr.type, d->class, r->rr.ttl);
-		r->last_sent = d->now;
+		_r_append(d, m, r, MESSAGE_AN, r->unique ? d->class + 32768 : d->class);
+		_r_sent(d, r);
 
-		_a_copy(m, &r->rr);
+		r->mark = d->serial;
+		if (!d->disco)
+			_r_extra(d, r);
 
 		r->modified = 0; /* If updated we've now sent the update. */
 		if (r->rr.ttl == 0) {
@@ -656,11 +1898,15 @@ mdns_daemon_t *mdnsd_new(int class, int frame)
 	if (!d)
 		return NULL;
 
+	d->pool = pool_new();
+	if (!d->pool) {
+		free(d);
+		return NULL;
+	}
+
 	gettimeofday(&d->now, 0);
-	d->expireall = (unsigned long)d->now.tv_sec + GC;
 	d->class = class;
 	d->frame = frame;
-	d->received_callback = NULL;
 
 	return d;
 }
@@ -694,6 +1940,18 @@ struct in_addr mdnsd_get_address(mdns_daemon_t *d)
 	return d->addr;
 }
 
+void mdnsd_set_cache_limit(mdns_daemon_t *d, size_t max_bytes, size_t max)
+{
+	d->cache_max_bytes = max_bytes;
+	d->cache_max = max;
+	_c_room(d, 0, 0);
+}
+
+void mdnsd_set_ifindex(mdns_daemon_t *d, int ifindex)
+{
+	d->ifindex = ifindex;
+}
+
 /* Shutting down, zero out ttl and push out all records */
 void mdnsd_shutdown(mdns_daemon_t *d)
 {
@@ -720,7 +1978,7 @@ void mdnsd_shutdown(mdns_daemon_t *d)
 void mdnsd_flush(mdns_daemon_t *d)
 {
 	(void)d;
-	/* - Set all querys to 0 tries
+	/* - Restart all query intervals
 	 * - Free whole cache
 	 * - Set all mdns_record_t *to probing
 	 * - Reset all answer lists
@@ -734,60 +1992,536 @@ void mdnsd_free(mdns_daemon_t *d)
 	if (!d)
 		return;
 
-	for (size_t i = 0; i< LPRIME; i++) {
-		struct cached *cur = d->cache[i];
+	for (size_t i = 0; i < d->cache_size; i++) {
+		struct cached *cur = d->cache[i].head;
+
+		while (cur) {
+			struct cached *next = cur->next;
+
+			_free_cached(d, cur);
+			cur = next;
+		}
+	}
+	free(d->cache);
+	heap_free(&d->expiry);
+	heap_free(&d->evictable);
+	heap_free(&d->republish);
+	heap_free(&d->schedule);
+
+	for (size_t i = 0; i< SPRIME; i++) {
+		struct mdns_record *cur = d->published[i];
+		struct query *curq;
+
+		while (cur) {
+			struct mdns_record *next = cur->next;
+
+			_free_record(d, cur);
+			cur = next;
+		}
+
+		curq = d->queries[i];
+		while (curq) {
+			struct query *next = curq->next;
+
+			_n_put(d, curq->name);
+			free(curq);
+			curq = next;
+		}
+	}
+
+	u = d->uanswers;
+	while (u) {
+		struct unicast *next = u->next;
+
+		pool_free(d->pool, u);
+		u = next;
+	}
+
+	while (d->held) {
+		struct held *next = d->held->next;
+
+		_h_free(d, d->held);
+		d->held = next;
+	}
+
+	while (d->unsent) {
+		struct unsent *next = d->unsent->next;
+
+		free(d->unsent);
+		d->unsent = next;
+	}
+
+	while (d->subs)
+		mdnsd_unsubscribe(d, d->subs);
+
+	free(d->names);
+	pool_destroy(d->pool);
+	free(d);
+}
+
+
+/* Name in the known part of rr, if its type has one */
+static char **_s_rdname(struct resource *rr)
+{
+	switch (rr->type) {
+	case QTYPE_A:
+		return &rr->known.a.name;
+
+	case QTYPE_NS:
+		return &rr->known.ns.name;
+
+	case QTYPE_CNAME:
+		return &rr->known.cname.name;
+
+	case QTYPE_PTR:
+		return &rr->known.ptr.name;
+
+	case QTYPE_SRV:
+		return &rr->known.srv.name;
+	}
+
+	return NULL;
+}
+
+/*
+ * Copy rr, which points into the packet, with name, rdata and rdname in
+ * one block from the pool, freed with copy->name
+ */
+static int _rr_dup(mdns_daemon_t *d, struct resource *copy, const struct resource *rr)
+{
+	size_t nlen, klen = 0;
+	char **src, **dst;
+	char *p;
+
+	*copy = *rr;
+
+	src = _s_rdname((struct resource *)rr);
+	if (src && *src)
+		klen = strlen(*src) + 1;
+	nlen = strlen(rr->name) + 1;
+
+	p = pool_alloc(d->pool, nlen + rr->rdlength + klen);
+	if (!p)
+		return -1;
+
+	copy->name = memcpy(p, rr->name, nlen);
+	p += nlen;
+	copy->rdata = NULL;
+	if (rr->rdlength)
+		copy->rdata = memcpy(p, rr->rdata, rr->rdlength);
+	p += rr->rdlength;
+	dst = _s_rdname(copy);
+	if (dst && klen)
+		*dst = memcpy(p, *src, klen);
+
+	return 0;
+}
+
+/* Copy rr to the batch of s, it points into the packet */
+static int _s_queue(mdns_daemon_t *d, struct mdns_sub *s, const struct resource *rr)
+{
+	struct resource *copy;
+
+	if (s->num == s->size) {
+		int size = s->size ? s->size * 2 : SUB_BATCH;
+
+		copy = realloc(s->rr, size * sizeof(*copy));
+		if (!copy)
+			return -1;
+		s->rr = copy;
+		s->size = size;
+	}
+
+	if (_rr_dup(d, &s->rr[s->num], rr))
+		return -1;
+	s->num++;
+
+	return 0;
+}
+
+static void _s_deliver(mdns_daemon_t *d, struct mdns_sub *s)
+{
+	int i;
+
+	if (!s->num)
+		return;
+
+	s->batch(s->rr, s->num, s->data);
+	for (i = 0; i < s->num; i++)
+		pool_free(d->pool, s->rr[i].name);
+	s->num = 0;
+}
+
+/* Hand rr to all subscriptions matching it, or queue it for a batch */
+static void _s_received(mdns_daemon_t *d, struct resource *rr)
+{
+	unsigned int hash = 0;
+	struct mdns_sub *s;
+
+	for (s = d->subs; s; s = s->next) {
+		if (s->type != QTYPE_ANY && s->type != rr->type)
+			continue;
+
+		if (s->name) {
+			if (!hash)
+				hash = _n_hash(rr->name);
+			if (_n(s->name)->hash != hash || strcasecmp(s->name, rr->name))
+				continue;
+		}
+
+		if (!s->batch) {
+			s->cb(rr, s->data);
+			continue;
+		}
+
+		/* Never more than this queued, even if nobody steps */
+		if (s->num == SUB_BATCH_MAX)
+			_s_deliver(d, s);
+		if (_s_queue(d, s, rr))
+			ERR("Failed queuing %s for subscriber: %s", rr->name, strerror(errno));
+	}
+}
+
+static struct mdns_sub *_s_new(mdns_daemon_t *d, const char *name, int type, void *data)
+{
+	struct mdns_sub *s, **sp;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	if (name) {
+		s->name = _n_get(d, name);
+		if (!s->name) {
+			free(s);
+			return NULL;
+		}
+		_f_update(d, s->name, 1);
+	} else
+		d->subs_any++;
+	s->type = type;
+	s->data = data;
+
+	/* Called in the order subscribed */
+	for (sp = &d->subs; *sp; sp = &(*sp)->next)
+		;
+	*sp = s;
+
+	return s;
+}
+
+mdns_sub_t *mdnsd_subscribe(mdns_daemon_t *d, const char *name, int type, mdnsd_record_received_callback cb, void *data)
+{
+	mdns_sub_t *s;
+
+	s = _s_new(d, name, type, data);
+	if (s)
+		s->cb = cb;
+
+	return s;
+}
+
+mdns_sub_t *mdnsd_subscribe_batch(mdns_daemon_t *d, const char *name, int type, mdnsd_batch_callback cb, void *data)
+{
+	mdns_sub_t *s;
+
+	s = _s_new(d, name, type, data);
+	if (s)
+		s->batch = cb;
+
+	return s;
+}
+
+void mdnsd_unsubscribe(mdns_daemon_t *d, mdns_sub_t *s)
+{
+	struct mdns_sub **sp;
+	int i;
+
+	if (!s)
+		return;
+
+	for (sp = &d->subs; *sp; sp = &(*sp)->next) {
+		if (*sp == s) {
+			*sp = s->next;
+			break;
+		}
+	}
+
+	if (s->name) {
+		_f_update(d, s->name, 0);
+		_n_put(d, s->name);
+	} else
+		d->subs_any--;
+
+	for (i = 0; i < s->num; i++)
+		pool_free(d->pool, s->rr[i].name);
+	free(s->rr);
+	free(s);
+}
+
+void mdnsd_deliver(mdns_daemon_t *d)
+{
+	struct mdns_sub *s;
+
+	for (s = d->subs; s; s = s->next) {
+		if (s->batch)
+			_s_deliver(d, s);
+	}
+}
+
+void mdnsd_register_receive_callback(mdns_daemon_t *d, mdnsd_record_received_callback cb, void* data)
+{
+	mdnsd_unsubscribe(d, d->legacy);
+	d->legacy = NULL;
+	if (cb)
+		d->legacy = mdnsd_subscribe(d, NULL, QTYPE_ANY, cb, data);
+}
+
+/* Answer questions, except those with a known answer in an */
+static void _q_in(mdns_daemon_t *d, struct question *qd, int qdcount, struct resource *an, int ancount,
+		  struct resource *ns, int nscount, unsigned short id, struct in_addr ip, unsigned short port)
+{
+	mdns_record_t *r = NULL;
+	struct kset known, probe;
+	int i, unicast;
+
+	_k_init(&known, an, ancount, 1);
+	_k_init(&probe, ns, nscount, 0);
+
+	/* Process each query */
+	unicast = -1;
+	for (i = 0; i < qdcount; i++) {
+		mdns_record_t *r_start, *r_next;
+		bool has_conflict = false;
+
+		if (!qd || qd[i].class != d->class)
+			continue;
+
+		TRACE(d, QUERY, qd[i].name, qd[i].type, ip.s_addr, 0);
+		r = _r_next(d, NULL, qd[i].name, qd[i].type);
+		if (!r)
+			continue;
+
+		/* Service enumeratio/discovery prepeare to send all matching records */
+		if (!strcasecmp(qd[i].name, DISCO_NAME)) {
+			d->disco = 1;
+			while (r) {
+				if (!strcasecmp(r->rr.name, DISCO_NAME)) {
+					if (_r_recent(d, r)) {
+						TRACE(d, LIMIT, r->rr.name, r->rr.type, 0, 0);
+						d->stats.rate_limited++;
+					} else
+						_r_send(d, r);
+				}
+				r = _r_next(d, r, qd[i].name, qd[i].type);
+			}
+
+			continue;
+		}
+
+		/* Check all of our potential answers */
+		for (r_start = r; r != NULL; r = r_next) {
+			/* Fetch next here, because _conflict() might delete r, invalidating next */
+			r_next = _r_next(d, r, qd[i].name, qd[i].type);
+
+			/* probing state, check for conflicts */
+			if (r->unique && r->unique < 5 && !r->modified) {
+				/* Check all to-be answers against our own */
+				if (_k_conflict(&probe, &r->rr)) {
+					_conflict(d, r);
+					has_conflict = true;
+				}
+				continue;
+			}
+
+			/* Check the known answers for this question */
+			if (_k_known(&known, &r->rr)) {
+				TRACE(d, KNOWN, r->rr.name, r->rr.type, 0, 0);
+				continue;
+			}
+
+			/* At most once a second, unless defending against a probe */
+			if (!nscount && _r_recent(d, r)) {
+				TRACE(d, LIMIT, r->rr.name, r->rr.type, 0, 0);
+				d->stats.rate_limited++;
+				continue;
+			}
+
+			_r_send(d, r);
+		}
+
+		/* Send the matching unicast reply */
+		if (!has_conflict && port != 5353) {
+			if (unicast < 0)
+				unicast = _u_allow(d, ip);
+			if (unicast)
+				_u_push(d, r_start, qd[i].type, id, ip, port);
+			else {
+				TRACE(d, LIMIT, qd[i].name, qd[i].type, ip.s_addr, 0);
+				d->stats.rate_limited++;
+			}
+		}
+	}
+
+	_k_free(&known);
+	_k_free(&probe);
+}
+
+/* Answer held query h, with all known answers merged, and drop it */
+static void _h_answer(mdns_daemon_t *d, struct held *h)
+{
+	struct held **hp;
+
+	for (hp = &d->held; *hp; hp = &(*hp)->next) {
+		if (*hp == h) {
+			*hp = h->next;
+			d->held_count--;
+			break;
+		}
+	}
+
+	_q_in(d, h->qd, h->qdcount, h->an, h->ancount, NULL, 0, 0, h->ip, 5353);
+	_h_free(d, h);
+}
+
+/* Add questions and known answers of m to h */
+static int _h_add(mdns_daemon_t *d, struct held *h, struct message *m)
+{
+	int i;
+
+	if (h->ancount + m->ancount > HELD_RR)
+		return -1;
+
+	if (h->qdcount + m->qdcount > h->qdsize) {
+		int size = h->qdcount + m->qdcount;
+		struct question *qd;
+
+		qd = realloc(h->qd, size * sizeof(*qd));
+		if (!qd)
+			return -1;
+		h->qd = qd;
+		h->qdsize = size;
+	}
+	for (i = 0; m->qd && i < m->qdcount; i++) {
+		struct question *q = &h->qd[h->qdcount];
+		size_t len = strlen(m->qd[i].name) + 1;
+
+		*q = m->qd[i];
+		q->name = pool_alloc(d->pool, len);
+		if (!q->name)
+			return -1;
+		memcpy(q->name, m->qd[i].name, len);
+		h->qdcount++;
+	}
+
+	if (h->ancount + m->ancount > h->ansize) {
+		int size = h->ansize ? h->ansize : 16;
+		struct resource *an;
+
+		while (size < h->ancount + m->ancount)
+			size *= 2;
+		an = realloc(h->an, size * sizeof(*an));
+		if (!an)
+			return -1;
+		h->an = an;
+		h->ansize = size;
+	}
+	for (i = 0; m->an && i < m->ancount; i++) {
+		if (!m->an[i].name)
+			continue;
+		if (_rr_dup(d, &h->an[h->ancount], &m->an[i]))
+			return -1;
+		h->ancount++;
+	}
+
+	return 0;
+}
+
+/*
+ * Query m from ip has the TC bit set, or continues one that had.  Its
+ * known answers are merged, and it is answered when the last part, the
+ * one without TC, has arrived, or after 400-500 msec, RFC 6762 sec. 7.2.
+ * Returns 0 if m is held or answered, -1 if it should be answered on
+ * its own
+ */
+static int _h_hold(mdns_daemon_t *d, struct message *m, struct in_addr ip)
+{
+	struct held *h;
+	long usec;
+
+	for (h = d->held; h; h = h->next) {
+		if (h->ip.s_addr == ip.s_addr)
+			break;
+	}
 
-		while (cur) {
-			struct cached *next = cur->next;
+	if (!h) {
+		if (!m->header.tc || !m->qdcount || d->held_count >= HELD_MAX)
+			return -1;
+
+		h = calloc(1, sizeof(*h));
+		if (!h)
+			return -1;
+		h->ip = ip;
+		h->next = d->held;
+		d->held = h;
+		d->held_count++;
+		d->stats.held++;
+	}
 
-			_free_cached(cur);
-			cur = next;
-		}
+	if (_h_add(d, h, m)) {
+		/* Out of room, answer what we have, and m on its own */
+		_h_answer(d, h);
+		return -1;
 	}
 
-	for (size_t i = 0; i< SPRIME; i++) {
-		struct mdns_record *cur = d->published[i];
-		struct query *curq;
+	if (!m->header.tc) {
+		_h_answer(d, h);
+		return 0;
+	}
 
-		while (cur) {
-			struct mdns_record *next = cur->next;
+	/* More to come, give it another 400-500 msec */
+	usec = d->now.tv_usec + ((d->now.tv_usec % 101) + 400) * 1000;
+	h->until.tv_sec  = d->now.tv_sec + usec / 1000000;
+	h->until.tv_usec = usec % 1000000;
 
-			_free_record(cur);
-			cur = next;
-		}
+	return 0;
+}
 
-		curq = d->queries[i];
-		while (curq) {
-			struct query *next = curq->next;
+/* Answer held queries whose known answers did not all arrive in time */
+static void _h_expire(mdns_daemon_t *d)
+{
+	struct held *h, *next;
 
-			free(curq->name);
-			free(curq);
-			curq = next;
-		}
+	for (h = d->held; h; h = next) {
+		next = h->next;
+		if (_tvdiff(d->now, h->until) <= 0)
+			_h_answer(d, h);
 	}
+}
 
-	u = d->uanswers;
-	while (u) {
-		struct unicast *next = u->next;
-
-		free(u);
-		u = next;
-	}
+/* Wake up in time to answer held queries */
+static void _h_sleep(mdns_daemon_t *d)
+{
+	long long max = (long long)d->sleep.tv_sec * 1000000 + d->sleep.tv_usec;
+	struct held *h;
 
-	free(d);
-}
+	for (h = d->held; h; h = h->next) {
+		long long usec = _tvdiff(d->now, h->until);
 
+		if (usec < 0)
+			usec = 0;
+		if (usec < max)
+			max = usec;
+	}
 
-void mdnsd_register_receive_callback(mdns_daemon_t *d, mdnsd_record_received_callback cb, void* data)
-{
-	d->received_callback = cb;
-	d->received_callback_data = data;
+	d->sleep.tv_sec  = max / 1000000;
+	d->sleep.tv_usec = max % 1000000;
 }
 
-int mdnsd_in(mdns_daemon_t *d, struct message *m, struct in_addr ip, unsigned short port)
+static int _in(mdns_daemon_t *d, struct message *m, struct in_addr ip, unsigned short port)
 {
 	mdns_record_t *r = NULL;
-	int i, j;
+	int i;
 
 	if (d->shutdown)
 		return 1;
@@ -795,79 +2529,16 @@ int mdnsd_in(mdns_daemon_t *d, struct message *m, struct in_addr ip, unsigned sh
 	gettimeofday(&d->now, 0);
 
 	if (m->header.qr == 0) {
-		/* Process each query */
-		for (i = 0; i < m->qdcount; i++) {
-			mdns_record_t *r_start, *r_next;
-			bool has_conflict = false;
-
-			if (!m->qd || m->qd[i].class != d->class)
-				continue;
-
-			INFO("Query for %s of type %d ...", m->qd[i].name, m->qd[i].type);
-			r = _r_next(d, NULL, m->qd[i].name, m->qd[i].type);
-			if (!r)
-				continue;
-
-			/* Service enumeratio/discovery prepeare to send all matching records */
-			if (!strcmp(m->qd[i].name, DISCO_NAME)) {
-				d->disco = 1;
-				while (r) {
-					if (!strcmp(r->rr.name, DISCO_NAME))
-						_r_send(d, r);
-					r = _r_next(d, r, m->qd[i].name, m->qd[i].type);
-				}
-
-				continue;
-			}
-
-			/* Check all of our potential answers */
-			for (r_start = r; r != NULL; r = r_next) {
-				INFO("Local record: %s, type: %d, rdname: %s", r->rr.name, r->rr.type, r->rr.rdname);
-
-				/* Fetch next here, because _conflict() might delete r, invalidating next */
-				r_next = _r_next(d, r, m->qd[i].name, m->qd[i].type);
-
-				/* probing state, check for conflicts */
-				if (r->unique && r->unique < 5 && !r->modified) {
-					/* Check all to-be answers against our own */
-					for (j = 0; j < m->nscount; j++) {
-						if (!m->an || m->qd[i].type != m->an[j].type || strcmp(m->qd[i].name, m->an[j].name))
-							continue;
-
-						/* This answer isn't ours, conflict! */
-						if (!_a_match(&m->an[j], &r->rr)) {
-							_conflict(d, r);
-							has_conflict = true;
-							break;
-						}
-					}
-					continue;
-				}
-
-				/* Check the known answers for this question */
-				for (j = 0; j < m->ancount; j++) {
-					if (!m->an || m->qd[i].type != m->an[j].type || strcmp(m->qd[i].name, m->an[j].name))
-						continue;
-
-					if (d->received_callback)
-						d->received_callback(&m->an[j], d->received_callback_data);
-
-					/* Do they already have this answer? */
-					if (_a_match(&m->an[j], &r->rr))
-						break;
-				}
+		if (d->subs) {
+			for (i = 0; m->an && i < m->ancount; i++)
+				_s_received(d, &m->an[i]);
+		}
 
-				INFO("Should we send answer? j: %d, m->ancount: %d", j, m->ancount);
-				if (j == m->ancount) {
-					INFO("Yes we should, enquing %s for outbound", r->rr.name);
-					_r_send(d, r);
-				}
-			}
+		/* Known answers in several packets, not for probes or legacy */
+		if (port == 5353 && !m->nscount && !_h_hold(d, m, ip))
+			return 0;
 
-			/* Send the matching unicast reply */
-			if (!has_conflict && port != 5353)
-				_u_push(d, r_start, m->id, ip, port);
-		}
+		_q_in(d, m->qd, m->qdcount, m->an, m->ancount, m->ns, m->nscount, m->id, ip, port);
 
 		return 0;
 	}
@@ -883,7 +2554,7 @@ int mdnsd_in(mdns_daemon_t *d, struct message *m, struct in_addr ip, unsigned sh
 			continue;
 		}
 
-		INFO("Got Answer: Name: %s, Type: %d", m->an[i].name, m->an[i].type);
+		TRACE(d, ANSWER, m->an[i].name, m->an[i].type, ip.s_addr, m->an[i].ttl);
 		r = _r_next(d, NULL, m->an[i].name, m->an[i].type);
 		if (r && r->unique && r->modified && _a_match(&m->an[i], &r->rr)) {
 			/* double check, is this actually from us, looped back? */
@@ -892,8 +2563,11 @@ int mdnsd_in(mdns_daemon_t *d, struct message *m, struct in_addr ip, unsigned sh
 			_conflict(d, r);
 		}
 
-		if (d->received_callback)
-			d->received_callback(&m->an[i], d->received_callback_data);
+		if (port == 5353 && ip.s_addr != d->addr.s_addr)
+			_r_dupe(d, &m->an[i]);
+
+		if (d->subs)
+			_s_received(d, &m->an[i]);
 
 		if (_cache(d, &m->an[i], ip) != 0) {
 			ERR("Failed caching answer, possibly too long packet, skipping.");
@@ -904,13 +2578,60 @@ int mdnsd_in(mdns_daemon_t *d, struct message *m, struct in_addr ip, unsigned sh
 	return 0;
 }
 
-int mdnsd_out(mdns_daemon_t *d, struct message *m, struct in_addr *ip, unsigned short *port)
+/*
+ * Add known answers of the queries on list, linked by ->known, that
+ * have more than half their TTL left and are not in an earlier packet
+ * with the same questions.  When the packet is full the TC bit is set,
+ * and the rest go in the next packet, RFC 6762 sec. 7.2.
+ * Returns number of answers added
+ */
+static int _q_known(mdns_daemon_t *d, struct message *m, struct query *list)
+{
+	unsigned long now = (unsigned long)d->now.tv_sec;
+	struct query *q;
+	int num = 0;
+
+	d->kq = NULL;
+	for (q = list; q; q = q->known) {
+		struct cached *c = 0;
+
+		while ((c = _c_next(d, c, q->name, q->type))) {
+			if (c->kmark == d->kserial)
+				continue;
+			if (c->rr.ttl <= now || c->rr.ttl - now <= (c->rr.ttl - c->born) / 2)
+				continue;
+
+			/* At least one per packet, or we never get done */
+			if ((num || m->qdcount) && message_packet_len(m) + (int)_rr_len(&c->rr) >= d->frame) {
+				m->header.tc = 1;
+				d->kq = q;
+				return num;
+			}
+
+			TRACE(d, SEND, c->rr.name, c->rr.type, c->rr.ttl - now, 0);
+			message_an(m, c->rr.name, c->rr.type, (unsigned short)d->class, c->rr.ttl - now);
+			_a_copy(m, &c->rr);
+			c->kmark = d->kserial;
+			num++;
+		}
+	}
+
+	return num;
+}
+
+static int _out(mdns_daemon_t *d, struct message *m, struct in_addr *ip, unsigned short *port)
 {
+	struct heap_node *n;
 	mdns_record_t *r;
 	int ret = 0;
 
 	gettimeofday(&d->now, 0);
-	memset(m, 0, sizeof(struct message));
+	message_init(m, m->_packet, m->_size);
+	d->serial++;
+
+	/* Drop expired cache entries, calls answer() with ttl 0 */
+	_c_expire(d);
+	_h_expire(d);
 
 	/* Defaults, multicast */
 	*port = htons(5353);
@@ -918,21 +2639,53 @@ int mdnsd_out(mdns_daemon_t *d, struct message *m, struct in_addr *ip, unsigned
 	m->header.qr = 1;
 	m->header.aa = 1;
 
-	/* Send out individual unicast answers */
+	/* Unicast answers, one packet for all questions in the same query */
 	if (d->uanswers) {
-		struct unicast *u = d->uanswers;
-
-		INFO("Send Unicast Answer: Name: %s, Type: %d", u->r->rr.name, u->r->rr.type);
+		struct unicast *u = d->uanswers, *cur, **prev;
 
-		d->uanswers = u->next;
-		*port = u->port;
+		*port = htons(u->port);
 		*ip = u->to;
 		m->id = u->id;
-		message_qd(m, u->r->rr.name, u->r->rr.type, d->class);
-		message_an(m, u->r->rr.name, u->r->rr.type, d->class, u->r->rr.ttl);
-		u->r->last_sent = d->now;
-		_a_copy(m, &u->r->rr);
-		free(u);
+
+		/* Questions are repeated first, they go before all answers */
+		for (cur = u; cur; cur = cur->next) {
+			if (_u_same(cur, u))
+				message_qd(m, cur->r->rr.name, cur->type, d->class);
+		}
+
+		for (cur = u; cur; cur = cur->next) {
+			mdns_record_t *r = NULL;
+
+			if (!_u_same(cur, u))
+				continue;
+
+			while ((r = _r_next(d, r, cur->r->rr.name, cur->type))) {
+				if (r->mark == d->serial)
+					continue;
+				if (message_packet_len(m) + (int)_rr_len(&r->rr) >= d->frame) {
+					m->header.tc = 1;
+					break;
+				}
+
+				_r_append(d, m, r, MESSAGE_AN, d->class);
+				r->mark = d->serial;
+				_r_extra(d, r);
+			}
+		}
+
+		for (prev = &u->next; (cur = *prev);) {
+			if (!_u_same(cur, u)) {
+				prev = &cur->next;
+				continue;
+			}
+
+			*prev = cur->next;
+			pool_free(d->pool, cur);
+		}
+		d->uanswers = u->next;
+		pool_free(d->pool, u);
+
+		_r_additional(d, m);
 
 		return 1;
 	}
@@ -941,77 +2694,104 @@ int mdnsd_out(mdns_daemon_t *d, struct message *m, struct in_addr *ip, unsigned
 	if (d->a_now)
 		ret += _r_out(d, m, &d->a_now);
 
-	/* Check if it's time to send the publish retries (unlink if done) */
+	/*
+	 * Check if it's time to send the publish retries (unlink if done).
+	 * Records are announced 2 sec apart, those that do not fit go out
+	 * in the next packet, right away, not at the next retry.
+	 */
 	if (!d->probing && d->a_publish && _tvdiff(d->now, d->publish) <= 0) {
+		struct timeval next = { 0, 0 };
 		mdns_record_t *cur = d->a_publish;
 		mdns_record_t *last = NULL;
-		mdns_record_t *next;
-
-		while (cur && message_packet_len(m) + (int)_rr_len(&cur->rr) < d->frame) {
-			if (cur->rr.type == QTYPE_PTR) {
-				INFO("Send Publish PTR: Name: %s, rdlen: %d, rdata: %s, rdname: %s", cur->rr.name,cur->rr.rdlen, cur->rr.rdata, cur->rr.rdname);
-			} else if (cur->rr.type == QTYPE_SRV) {
-				INFO("Send Publish SRV: Name: %s, rdlen: %d, rdata: %s, rdname: %s, port: %d, prio: %d, weight: %d", cur->rr.name,cur->rr.rdlen, cur->rr.rdname, cur->rr.rdata, cur->rr.srv.port, cur->rr.srv.priority, cur->rr.srv.weight);
-			} else {
-				INFO("Send Publish: Name: %s, Type: %d, rdname: %s", cur->rr.name, cur->rr.type, cur->rr.rdname);
+		mdns_record_t *nxt;
+		int full = 0;
+
+		while (cur) {
+			nxt = cur->list;
+			if (cur->tries && !_r_due(d, cur, 2000000, &next)) {
+				last = cur;
+				cur = nxt;
+				continue;
+			}
+			if (message_packet_len(m) + (int)_rr_len(&cur->rr) >= d->frame) {
+				full = 1;
+				break;
 			}
 
-			next = cur->list;
 			ret++;
 			cur->tries++;
 
-			if (cur->unique)
-				message_an(m, cur->rr.name, cur->rr.type, d->class + 32768, cur->rr.ttl);
-			else
-				message_an(m, cur->rr.name, cur->rr.type, d->class, cur->rr.ttl);
-			_a_copy(m, &cur->rr);
-			cur->last_sent = d->now;
+			_r_append(d, m, cur, MESSAGE_AN, cur->unique ? d->class + 32768 : d->class);
+			_r_sent(d, cur);
+			cur->mark = d->serial;
 
 			if (cur->rr.ttl != 0 && cur->tries < 4) {
+				/* Just sent, not due, only moves up next */
+				_r_due(d, cur, 2000000, &next);
 				last = cur;
-				cur = next;
+				cur = nxt;
 				continue;
 			}
 
 			cur->list = NULL;
 			if (d->a_publish == cur)
-				d->a_publish = next;
+				d->a_publish = nxt;
 			if (last)
-				last->list = next;
+				last->list = nxt;
 			if (cur->rr.ttl == 0)
 				_r_done(d, cur);
-			cur = next;
+			cur = nxt;
 		}
 
-		if (d->a_publish) {
+		if (full && ret)
+			d->publish = d->now;
+		else if (next.tv_sec)
+			d->publish = next;
+		else if (d->a_publish) {
 			d->publish.tv_sec = d->now.tv_sec + 2;
 			d->publish.tv_usec = d->now.tv_usec;
 		}
 	}
 
 	/* If we're in shutdown, we're done */
-	if (d->shutdown)
+	if (d->shutdown) {
+		_r_additional(d, m);
 		return ret;
+	}
 
 	/* Check if a_pause is ready */
 	if (d->a_pause && _tvdiff(d->now, d->pause) <= 0)
 		ret += _r_out(d, m, &d->a_pause);
 
 	/* Now process questions */
-	if (ret)
+	if (ret) {
+		_r_additional(d, m);
 		return ret;
+	}
 
 	m->header.qr = 0;
 	m->header.aa = 0;
 
 	if (d->probing && _tvdiff(d->now, d->probe) <= 0) {
+		struct timeval next = { 0, 0 };
 		mdns_record_t *last = 0;
+		int len = 12, full = 0;
 
-		/* Scan probe list to ask questions and process published */
+		/*
+		 * Scan probe list to ask questions and process published.
+		 * Probes are 250 msec apart, those that do not fit go out in
+		 * the next packet, right away.
+		 */
 		for (r = d->probing; r != NULL;) {
+			if (r->unique > 1 && !_r_due(d, r, 250000, &next)) {
+				last = r;
+				r = r->list;
+				continue;
+			}
+
 			/* Done probing, publish */
 			if (r->unique == 4) {
-				mdns_record_t *next = r->list;
+				mdns_record_t *nxt = r->list;
 
 				if (d->probing == r)
 					d->probing = r->list;
@@ -1021,83 +2801,100 @@ int mdnsd_out(mdns_daemon_t *d, struct message *m, struct in_addr *ip, unsigned
 				r->list = 0;
 				r->unique = 5;
 				_r_publish(d, r);
-				r = next;
+				r = nxt;
+				continue;
+			}
+
+			/* Question, and the record in the authority section */
+			len += (int)strlen(r->rr.name) + 6 + (int)_rr_len(&r->rr);
+			if (full || (ret && len >= d->frame)) {
+				full = 1;
+				last = r;
+				r = r->list;
 				continue;
 			}
 
-			INFO("Send Probing: Name: %s, Type: %d", r->rr.name, r->rr.type);
+			TRACE(d, PROBE, r->rr.name, r->rr.type, r->unique, 0);
 
 			message_qd(m, r->rr.name, r->rr.type, (unsigned short)d->class);
 			r->last_sent = d->now;
+			r->mark = d->serial;
+			ret++;
 			last = r;
 			r = r->list;
 		}
 
 		/* Scan probe list again to append our to-be answers */
 		for (r = d->probing; r != 0; r = r->list) {
-			r->unique++;
+			if (r->mark != d->serial)
+				continue;
 
-			INFO("Send Answer in Probe: Name: %s, Type: %d", r->rr.name, r->rr.type);
-			message_ns(m, r->rr.name, r->rr.type, (unsigned short)d->class, r->rr.ttl);
-			_a_copy(m, &r->rr);
-			r->last_sent = d->now;
-			ret++;
+			r->unique++;
+			_r_append(d, m, r, MESSAGE_NS, d->class);
 		}
 
 		/* Process probes again in the future */
-		if (ret) {
+		if (full)
+			d->probe = d->now;
+		else if (next.tv_sec)
+			d->probe = next;
+		else {
 			d->probe.tv_sec = d->now.tv_sec;
 			d->probe.tv_usec = d->now.tv_usec + 250000;
-			return ret;
 		}
+		if (ret)
+			return ret;
 	}
 
-	/* Process qlist for retries or expirations */
-	if (d->checkqlist && (unsigned long)d->now.tv_sec >= d->checkqlist) {
-		struct query *q;
-		struct cached *c;
-		unsigned long int nextbest = 0;
-
-		/* Ask questions first, track nextbest time */
-		for (q = d->qlist; q != 0; q = q->list) {
-			if (q->nexttry > 0 && q->nexttry <= (unsigned long)d->now.tv_sec && q->tries < 3)
-				message_qd(m, q->name, q->type, d->class);
-			else if (q->nexttry > 0 && (nextbest == 0 || q->nexttry < nextbest))
-				nextbest = q->nexttry;
+	/* Rest of the known answers to the last questions */
+	if (d->kq && (ret = _q_known(d, m, d->kq)))
+		return ret;
+
+	/* Ask all queries that are due, and any others close to it */
+	while ((n = heap_peek(&d->schedule)) && n->key <= (unsigned long)d->now.tv_sec) {
+		struct query *q, *due = NULL, *ask = NULL;
+		unsigned long now = (unsigned long)d->now.tv_sec;
+
+		/* Keys may be early, drop entries refreshed since */
+		q = heap_entry(n, struct query, sched);
+		if (_q_deadline(d, q) > now) {
+			heap_set(&d->schedule, n, _q_deadline(d, q));
+			continue;
 		}
 
-		/* Include known answers, update questions */
-		for (q = d->qlist; q != 0; q = q->list) {
-			if (q->nexttry == 0 || q->nexttry > (unsigned long)d->now.tv_sec)
-				continue;
+		_q_collect(d, 0, &due);
+		while ((q = due)) {
+			unsigned long when = _q_deadline(d, q);
+			int len = (int)strlen(q->name) + 6;
 
-			/* Done retrying, expire and reset */
-			if (q->tries == 3) {
-				_c_expire(d, &d->cache[_namehash(q->name) % LPRIME]);
-				_q_reset(d, q);
+			due = q->due;
+			if (!_q_due(q, when, now)) {
+				heap_set(&d->schedule, &q->sched, when);
 				continue;
 			}
 
+			/* Questions go before all answers, rest in next packet */
+			if (ask && message_packet_len(m) + len > d->frame)
+				continue;
+
+			message_qd(m, q->name, q->type, d->class);
+			q->due = ask;
+			ask = q;
 			ret++;
-			q->nexttry = d->now.tv_sec + ++q->tries;
-			if (nextbest == 0 || q->nexttry < nextbest)
-				nextbest = q->nexttry;
-
-			/* If room, add all known good entries */
-			c = 0;
-			while ((c = _c_next(d, c, q->name, q->type)) != 0 && c->rr.ttl > (unsigned long)d->now.tv_sec + 8 &&
-				message_packet_len(m) + (int)_rr_len(&c->rr) < d->frame) {
-
-				INFO("Add known answer: Name: %s, Type: %d", c->rr.name, c->rr.type);
-				message_an(m, q->name, (unsigned short)q->type, (unsigned short)d->class, c->rr.ttl - (unsigned long)d->now.tv_sec);
-				_a_copy(m, &c->rr);
-			}
 		}
-		d->checkqlist = nextbest;
-	}
 
-	if ((unsigned long)d->now.tv_sec > d->expireall)
-		_gc(d);
+		/* Known answers, any that do not fit go in the next packets */
+		d->kserial++;
+		for (q = ask; q; q = q->due)
+			q->known = q->due;
+		_q_known(d, m, ask);
+
+		while ((q = ask)) {
+			ask = q->due;
+			_q_asked(d, q);
+		}
+		break;
+	}
 
 	return ret;
 }
@@ -1108,18 +2905,26 @@ int mdnsd_out(mdns_daemon_t *d, struct message *m, struct in_addr *ip, unsigned
 		d->sleep.tv_sec++;		\
 		d->sleep.tv_usec -= 1000000;	\
 	}					\
+	_h_sleep(d);				\
 	return &d->sleep;			\
 } while (0)
 
-struct timeval *mdnsd_sleep(mdns_daemon_t *d)
+static struct timeval *_sleep(mdns_daemon_t *d)
 {
-	time_t expire;
+	struct heap_node *n;
+	time_t expire, cexp;
 	long usec;
 
 	d->sleep.tv_sec = d->sleep.tv_usec = 0;
 
+	/* Socket was full, nothing else can go out before that has */
+	if (d->unsent) {
+		d->sleep.tv_usec = UNSENT_WAIT;
+		return &d->sleep;
+	}
+
 	/* First check for any immediate items to handle */
-	if (d->uanswers || d->a_now)
+	if (d->uanswers || d->a_now || d->kq)
 		return &d->sleep;
 
 	gettimeofday(&d->now, 0);
@@ -1145,49 +2950,102 @@ struct timeval *mdnsd_sleep(mdns_daemon_t *d)
 		RET;
 	}
 
-	/* Also check for queries with known answer expiration/retry */
-	if (d->checkqlist) {
-		long sec;
-		if ((sec = (long)d->checkqlist - d->now.tv_sec) > 0)
-			d->sleep.tv_sec = sec;
-		RET;
+	/* Next cache entry to expire */
+	cexp = SLEEP_MAX;
+	n = heap_peek(&d->expiry);
+	if (n) {
+		cexp = (long)n->key - d->now.tv_sec;
+		if (cexp < 0)
+			cexp = 0;
 	}
 
 	/* Resend published records before TTL expires */
-	expire = (long)d->expireall - d->now.tv_sec;
-	if (expire < 0)
-		RET;
+	expire = SLEEP_MAX;
+	while ((n = heap_peek(&d->republish))) {
+		mdns_record_t *r = heap_entry(n, mdns_record_t, announce);
 
-	for (size_t i = 0; i < SPRIME; i++) {
-		mdns_record_t *r;
-		time_t next;
+		if ((long)n->key > d->now.tv_sec) {
+			if (!d->a_pause)
+				expire = (long)n->key - d->now.tv_sec;
+			break;
+		}
 
-		r = d->published[i];
-		if (!r)
-			continue;
+		/* Retry in a while, unless rescheduled when sent */
+		INFO("Republish %s before TTL expires ...", r->rr.name);
+		heap_set(&d->republish, n, (unsigned long)d->now.tv_sec + 1);
+		_r_push(&d->a_pause, r);
+		d->pause = d->now;
+		expire = 0;
+	}
 
-		/* Publish 2 seconds before expiration */
-		next = r->last_sent.tv_sec + (long)r->rr.ttl - d->now.tv_sec;
-		if (next <= 2) {
-			INFO("Republish %s before TTL expires ...", r->rr.name);
-			_r_push(&d->a_pause, r);
-		}
+	/* Also check for queries to ask, or cache entries to refresh */
+	n = heap_peek(&d->schedule);
+	if (n) {
+		long sec = (long)n->key - d->now.tv_sec;
 
-		if (next < expire)
-			expire = next;
+		if (sec < expire)
+			expire = sec > 0 ? sec : 0;
 	}
 
-	d->sleep.tv_sec = expire > 2 ? expire - 2 : 0;
-	d->pause.tv_sec = d->now.tv_sec + d->sleep.tv_sec;
+	d->sleep.tv_sec = expire < cexp ? expire : cexp;
 
 	RET;
 }
 
+int mdnsd_in(mdns_daemon_t *d, struct message *m, struct in_addr ip, unsigned short port)
+{
+	struct timespec t;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	if (m->header.qr)
+		d->stats.answers_in++;
+	else
+		d->stats.queries_in++;
+
+	rc = _in(d, m, ip, port);
+	_hist(d->stats.in_usec, _usec(&t));
+
+	return rc;
+}
+
+int mdnsd_out(mdns_daemon_t *d, struct message *m, struct in_addr *ip, unsigned short *port)
+{
+	struct timespec t;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	rc = _out(d, m, ip, port);
+	_hist(d->stats.out_usec, _usec(&t));
+
+	if (rc) {
+		TRACE(d, PKT_OUT, NULL, 0, ip->s_addr, message_packet_len(m));
+		d->stats.pkts_out++;
+		d->stats.bytes_out += message_packet_len(m);
+		if (IN_MULTICAST(ntohl(ip->s_addr)))
+			d->stats.multicast_out++;
+		else
+			d->stats.unicast_out++;
+	}
+
+	return rc;
+}
+
+struct timeval *mdnsd_sleep(mdns_daemon_t *d)
+{
+	struct timeval *tv;
+
+	tv = _sleep(d);
+	_hist(d->stats.sleep_msec, tv->tv_sec * 1000 + tv->tv_usec / 1000);
+
+	return tv;
+}
+
 void mdnsd_query(mdns_daemon_t *d, const char *host, int type, int (*answer)(mdns_answer_t *a, void *arg), void *arg)
 {
 	struct query *q;
 	struct cached *cur = 0;
-	int i = _namehash(host) % SPRIME;
+	int i;
 
 	if (!(q = _q_next(d, 0, host, type))) {
 		if (!answer)
@@ -1196,38 +3054,258 @@ void mdnsd_query(mdns_daemon_t *d, const char *host, int type, int (*answer)(mdn
 		q = calloc(1, sizeof(struct query));
 		if (!q)
 			return;
-		q->name = strdup(host);
+		q->name = _n_get(d, host);
 		if (!q->name) {
 			free(q);
 			return;
 		}
 		q->type = type;
+
+		/* New question, immediately send out */
+		if (heap_set(&d->schedule, &q->sched, (unsigned long)d->now.tv_sec)) {
+			_n_put(d, q->name);
+			free(q);
+			return;
+		}
+		i = _n(q->name)->hash % SPRIME;
 		q->next = d->queries[i];
 		q->list = d->qlist;
 		d->qlist = d->queries[i] = q;
+		_f_update(d, q->name, 1);
+
+		/* Any cached entries should be associated */
+		while ((cur = _c_next(d, cur, q->name, q->type)))
+			_c_own(d, cur, q);
+	}
+
+	/* No answer means we don't care anymore */
+	if (!answer) {
+		_q_done(d, q);
+		return;
+	}
+
+	q->answer = answer;
+	q->arg = arg;
+}
+
+mdns_answer_t *mdnsd_list(mdns_daemon_t *d,const char *host, int type, mdns_answer_t *last)
+{
+	return (mdns_answer_t *)_c_next(d, (struct cached *)last, host, type);
+}
+
+void mdnsd_cache_stats(mdns_daemon_t *d, struct mdnsd_cache_stats *st)
+{
+	size_t mask = d->cache_size - 1;
+	size_t i, sum = 0;
+
+	memset(st, 0, sizeof(*st));
+	st->entries = d->cache_count;
+	st->bytes   = d->cache_bytes;
+	st->names   = d->cache_names;
+	st->slots   = d->cache_size;
+	if (!d->cache_size)
+		return;
+
+	for (i = 0; i < d->cache_size; i++) {
+		size_t len;
+
+		if (!d->cache[i].head)
+			continue;
+
+		len = ((i - (d->cache[i].hash & mask)) & mask) + 1;
+		if (len > st->probe_max)
+			st->probe_max = len;
+		sum += len;
+	}
+
+	st->load = (double)d->cache_names / d->cache_size;
+	if (d->cache_names)
+		st->probe_avg = (double)sum / d->cache_names;
+}
+
+void mdnsd_stats(mdns_daemon_t *d, struct mdnsd_stats *st)
+{
+	*st = d->stats;
+	st->publish_chain = st->query_chain = 0;
+
+	for (size_t i = 0; i < SPRIME; i++) {
+		struct mdns_record *r;
+		struct query *q;
+		size_t len;
+
+		for (len = 0, r = d->published[i]; r; r = r->next)
+			len++;
+		if (len > st->publish_chain)
+			st->publish_chain = len;
+
+		for (len = 0, q = d->queries[i]; q; q = q->next)
+			len++;
+		if (len > st->query_chain)
+			st->query_chain = len;
+	}
+}
+
+static int _snap_put(FILE *fp, struct cached *c)
+{
+	static const char pad[SNAP_ALIGN];
+	struct snap_rr rr = { 0 };
+	size_t len;
+
+	rr.expire   = c->rr.ttl;
+	rr.ip       = c->rr.ip.s_addr;
+	rr.type     = c->rr.type;
+	rr.rdlen    = c->rr.rdlen;
+	rr.nlen     = strlen(c->rr.name) + 1;
+	rr.rlen     = c->rr.rdname ? strlen(c->rr.rdname) + 1 : 0;
+	rr.priority = c->rr.srv.priority;
+	rr.weight   = c->rr.srv.weight;
+	rr.port     = c->rr.srv.port;
+
+	len = sizeof(rr) + rr.nlen + rr.rdlen + rr.rlen;
+	if (fwrite(&rr, sizeof(rr), 1, fp) != 1 ||
+	    fwrite(c->rr.name, rr.nlen, 1, fp) != 1 ||
+	    (rr.rdlen && fwrite(c->rr.rdata, rr.rdlen, 1, fp) != 1) ||
+	    (rr.rlen && fwrite(c->rr.rdname, rr.rlen, 1, fp) != 1))
+		return 1;
+
+	len = _snap_len(len) - len;
+	if (len && fwrite(pad, len, 1, fp) != 1)
+		return 1;
+
+	return 0;
+}
+
+int mdnsd_cache_save(mdns_daemon_t *d, const char *file)
+{
+	struct snap_hdr hdr = { SNAP_MAGIC, SNAP_VERSION, 0, 0, 0 };
+	char tmp[strlen(file) + 5];
+	struct cached *c;
+	FILE *fp;
+	size_t i;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	fp = fopen(tmp, "w");
+	if (!fp)
+		return -1;
+
+	hdr.class = d->class;
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto fail;
+
+	for (i = 0; i < d->cache_size; i++) {
+		for (c = d->cache[i].head; c; c = c->next) {
+			/* Flushed, expires on next _c_expire() */
+			if (!c->rr.ttl)
+				continue;
+
+			if (_snap_put(fp, c))
+				goto fail;
+			hdr.count++;
+		}
+	}
+
+	/* Now we know the count */
+	rewind(fp);
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto fail;
+	if (fclose(fp)) {
+		fp = NULL;
+		goto fail;
+	}
+
+	/* Readers never see a partial snapshot */
+	if (rename(tmp, file)) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+fail:
+	if (fp)
+		fclose(fp);
+	unlink(tmp);
+	return -1;
+}
+
+int mdnsd_cache_load(mdns_daemon_t *d, const char *file)
+{
+	const struct snap_hdr *hdr;
+	unsigned char *map;
+	struct stat st;
+	size_t off, i;
+	int fd, num = 0;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	hdr = (const struct snap_hdr *)map;
+	if (hdr->magic != SNAP_MAGIC || hdr->version != SNAP_VERSION || hdr->class != d->class) {
+		munmap(map, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	gettimeofday(&d->now, 0);
+	off = sizeof(*hdr);
+	for (i = 0; i < hdr->count; i++) {
+		const struct snap_rr *rr;
+		mdns_answer_t a;
+		size_t len;
+
+		if (off + sizeof(*rr) > (size_t)st.st_size)
+			break;
+		rr = (const struct snap_rr *)(map + off);
+		len = sizeof(*rr) + rr->nlen + rr->rdlen + rr->rlen;
+		if (!rr->nlen || off + len > (size_t)st.st_size)
+			break;
+		off += _snap_len(len);
 
-		/* Any cached entries should be associated */
-		while ((cur = _c_next(d, cur, q->name, q->type)))
-			cur->q = q;
-		_q_reset(d, q);
+		/* Already expired, or about to be */
+		if (rr->expire <= d->now.tv_sec)
+			continue;
 
-		/* New question, immediately send out */
-		q->nexttry = d->checkqlist = d->now.tv_sec;
-	}
+		memset(&a, 0, sizeof(a));
+		a.name = (char *)(rr + 1);
+		if (a.name[rr->nlen - 1])
+			break;
+		a.type = rr->type;
+		a.ttl = rr->expire;
+		a.ip.s_addr = rr->ip;
+		a.rdlen = rr->rdlen;
+		if (rr->rdlen)
+			a.rdata = (unsigned char *)a.name + rr->nlen;
+		if (rr->rlen) {
+			a.rdname = (char *)a.name + rr->nlen + rr->rdlen;
+			if (a.rdname[rr->rlen - 1])
+				break;
+		}
+		a.srv.priority = rr->priority;
+		a.srv.weight = rr->weight;
+		a.srv.port = rr->port;
 
-	/* No answer means we don't care anymore */
-	if (!answer) {
-		_q_done(d, q);
-		return;
+		if (!_c_add(d, &a))
+			break;
+		num++;
 	}
+	munmap(map, st.st_size);
 
-	q->answer = answer;
-	q->arg = arg;
-}
-
-mdns_answer_t *mdnsd_list(mdns_daemon_t *d,const char *host, int type, mdns_answer_t *last)
-{
-	return (mdns_answer_t *)_c_next(d, (struct cached *)last, host, type);
+	return num;
 }
 
 mdns_record_t *mdnsd_record_next(const mdns_record_t* r)
@@ -1242,23 +3320,25 @@ const mdns_answer_t *mdnsd_record_data(const mdns_record_t* r)
 
 mdns_record_t *mdnsd_shared(mdns_daemon_t *d, const char *host, unsigned short type, unsigned long ttl)
 {
-	int i = _namehash(host) % SPRIME;
 	mdns_record_t *r;
+	int i;
 
-	r = calloc(1, sizeof(struct mdns_record));
+	r = pool_alloc(d->pool, sizeof(struct mdns_record));
 	if (!r)
 		return NULL;
 
-	r->rr.name = strdup(host);
+	r->rr.name = _n_get(d, host);
 	if (!r->rr.name) {
-		free(r);
+		pool_free(d->pool, r);
 		return NULL;
 	}
 
 	r->rr.type = type;
 	r->rr.ttl = ttl;
+	i = _n(r->rr.name)->hash % SPRIME;
 	r->next = d->published[i];
 	d->published[i] = r;
+	_f_update(d, r->rr.name, 1);
 
 	return r;
 }
@@ -1276,9 +3356,15 @@ mdns_record_t *mdnsd_unique(mdns_daemon_t *d, const char *host, unsigned short t
 	r->arg = arg;
 	r->unique = 1;
 
-	/* check if r already in other lists. If yes, remove it from there */
-	_r_remove_lists(d, r, &d->probing);
-	_r_push(&d->probing, r);
+	/* New, on no list yet, no need to look */
+	if (d->batch) {
+		r->list = d->probing;
+		d->probing = r;
+	} else {
+		/* check if r already in other lists. If yes, remove it from there */
+		_r_remove_lists(d, r, &d->probing);
+		_r_push(&d->probing, r);
+	}
 
 	d->probe.tv_sec = d->now.tv_sec;
 	d->probe.tv_usec = d->now.tv_usec;
@@ -1288,36 +3374,28 @@ mdns_record_t *mdnsd_unique(mdns_daemon_t *d, const char *host, unsigned short t
 
 mdns_record_t *mdnsd_get_published(mdns_daemon_t *d, const char *host)
 {
-	return d->published[_namehash(host) % SPRIME];
+	return d->published[_n_hash(host) % SPRIME];
 }
 
 int mdnsd_has_query(mdns_daemon_t *d, const char *host)
 {
-	return d->queries[_namehash(host) % SPRIME] != NULL;
-}
-
-mdns_record_t *mdnsd_find(mdns_daemon_t *d, const char *name, unsigned short type)
-{
-	mdns_record_t *r;
-
-	r = mdnsd_get_published(d, name);
-	while (r) {
-		const mdns_answer_t *data;
+	const char *name = _n_find(d, host);
+	struct query *q;
 
-		/*
-		 * Search for a record with the same type and name.
-		 * Records with different names might be in the same
-		 * linked list when the hash functions % SPRIME assigns
-		 * them the same index (hash collision)
-		 */
-		data = mdnsd_record_data(r);
-		if (data->type == type && strcmp(data->name, name) == 0)
-			return r;
+	if (!name)
+		return 0;
 
-		r = mdnsd_record_next(r);
+	for (q = d->queries[_n(name)->hash % SPRIME]; q; q = q->next) {
+		if (q->name == name)
+			return 1;
 	}
 
-	return NULL;
+	return 0;
+}
+
+mdns_record_t *mdnsd_find(mdns_daemon_t *d, const char *name, unsigned short type)
+{
+	return _r_next(d, NULL, name, type);
 }
 
 void mdnsd_done(mdns_daemon_t *d, mdns_record_t *r)
@@ -1344,14 +3422,15 @@ void mdnsd_done(mdns_daemon_t *d, mdns_record_t *r)
 
 void mdnsd_set_raw(mdns_daemon_t *d, mdns_record_t *r, const char *data, unsigned short len)
 {
-	if (r->rr.rdata)
-		free(r->rr.rdata);
+	r->stale = 0;
+	if (r->rr.rdata && r->rr.rdlen == len && !memcmp(r->rr.rdata, data, len))
+		return;
 
-	r->rr.rdata = malloc(len);
-	if (r->rr.rdata) {
-		memcpy(r->rr.rdata, data, len);
-		r->rr.rdlen = len;
-	}
+	/* Same TXT on every interface, one copy of it */
+	_r_unwire(d, r);
+	store_put(r->rr.rdata);
+	r->rr.rdata = store_get(data, len);
+	r->rr.rdlen = r->rr.rdata ? len : 0;
 	_r_publish(d, r);
 }
 
@@ -1360,48 +3439,360 @@ void mdnsd_set_host(mdns_daemon_t *d, mdns_record_t *r, const char *name)
 	if (!r)
 		return;
 
-	if (r->rr.rdname)
-		free(r->rr.rdname);
-	r->rr.rdname = strdup(name);
+	r->stale = 0;
+	if (r->rr.rdname && r->rr.rdname == _n_find(d, name))
+		return;
+
+	_r_unwire(d, r);
+	_n_put(d, r->rr.rdname);
+	r->rr.rdname = _n_get(d, name);
 	_r_publish(d, r);
 }
 
 void mdnsd_set_ip(mdns_daemon_t *d, mdns_record_t *r, struct in_addr ip)
 {
+	r->stale = 0;
+	if (r->rr.ip.s_addr == ip.s_addr)
+		return;
+
+	_r_unwire(d, r);
 	r->rr.ip = ip;
 	_r_publish(d, r);
 }
 
 void mdnsd_set_srv(mdns_daemon_t *d, mdns_record_t *r, unsigned short priority, unsigned short weight, unsigned short port, char *name)
 {
+	if (r->rr.srv.priority == priority && r->rr.srv.weight == weight && r->rr.srv.port == port) {
+		mdnsd_set_host(d, r, name);
+		return;
+	}
+
+	_r_unwire(d, r);
 	r->rr.srv.priority = priority;
 	r->rr.srv.weight = weight;
 	r->rr.srv.port = port;
+
+	/* Force publish, even if name is the same */
+	_n_put(d, r->rr.rdname);
+	r->rr.rdname = NULL;
 	mdnsd_set_host(d, r, name);
 }
 
-static int process_in(mdns_daemon_t *d, int sd)
+int mdnsd_set_case(mdns_daemon_t *d, mdns_record_t *r, const char *name)
 {
-	static unsigned char buf[MAX_PACKET_LEN + 1];
-	struct sockaddr_in from;
-	socklen_t ssize = sizeof(struct sockaddr_in);
-	ssize_t bsize;
+	const char *old = r->rr.name;
+	struct iname *n = _n(old);
+	unsigned int refs = 0;
+	mdns_record_t *x;
+	int i;
 
-	memset(buf, 0, sizeof(buf));
+	if (strcasecmp(old, name)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!strcmp(old, name))
+		return 0;
 
-	while ((bsize = recvfrom(sd, buf, MAX_PACKET_LEN, MSG_DONTWAIT, (struct sockaddr *)&from, &ssize)) > 0) {
-		struct message m = { 0 };
-		int rc;
+	/* Only our records may see the spelling change, not the cache */
+	for (i = 0; i < SPRIME; i++) {
+		for (x = d->published[i]; x; x = x->next)
+			refs += (x->rr.name == old) + (x->rr.rdname == old);
+	}
+	if (refs != n->refs) {
+		errno = EBUSY;
+		return -1;
+	}
 
-		buf[MAX_PACKET_LEN] = 0;
-		mdnsd_log_hex("Got Data:", buf, bsize);
+	/* Same length, only the case differs, hash is of the lower case */
+	memcpy(n->name, name, strlen(name));
 
-		rc = message_parse(&m, buf);
-		if (rc)
-			continue;
-		rc = mdnsd_in(d, &m, from.sin_addr, ntohs(from.sin_port));
-		if (rc)
+	for (i = 0; i < SPRIME; i++) {
+		for (x = d->published[i]; x; x = x->next) {
+			if (x->rr.name != old && x->rr.rdname != old)
+				continue;
+
+			_r_unwire(d, x);
+			_r_publish(d, x);
+		}
+	}
+
+	return 0;
+}
+
+/* Unlink records set during the batch, they are put back on a_publish */
+static void _r_unbatch(mdns_record_t **list)
+{
+	mdns_record_t *r;
+
+	while ((r = *list)) {
+		if (r->batched) {
+			*list = r->list;
+			r->list = NULL;
 			continue;
+		}
+		list = &r->list;
+	}
+}
+
+void mdnsd_begin(mdns_daemon_t *d)
+{
+	d->batch++;
+}
+
+void mdnsd_commit(mdns_daemon_t *d)
+{
+	mdns_record_t *r;
+
+	if (!d->batch || --d->batch)
+		return;
+
+	/* One pass over each list, instead of one per record */
+	_r_unbatch(&d->probing);
+	_r_unbatch(&d->a_now);
+	_r_unbatch(&d->a_pause);
+	_r_unbatch(&d->a_publish);
+
+	while ((r = d->a_batch)) {
+		d->a_batch = r->batch;
+		r->batch = NULL;
+		r->batched = 0;
+
+		r->list = d->a_publish;
+		d->a_publish = r;
+	}
+}
+
+void mdnsd_mark(mdns_daemon_t *d)
+{
+	mdns_record_t *r;
+	int i;
+
+	for (i = 0; i < SPRIME; i++) {
+		for (r = d->published[i]; r; r = r->next)
+			r->stale = 1;
+	}
+}
+
+void mdnsd_sweep(mdns_daemon_t *d)
+{
+	int i;
+
+	for (i = 0; i < SPRIME; i++) {
+		mdns_record_t *r, *next;
+
+		r = d->published[i];
+		while (r) {
+			next = r->next;
+
+			/* Already saying goodbye, e.g. after a conflict */
+			if (r->stale && r->rr.ttl)
+				mdnsd_done(d, r);
+
+			r = next;
+		}
+	}
+}
+
+/*
+ * Called for each question (in queries) or answer (in responses) of a
+ * received packet, before it is parsed.  Returns 1 if the name may be
+ * one we publish or query for, see _f_update(), or is one we have
+ * cached, and 2 once it is clear the rest of the packet cannot be of
+ * interest to us.  Names are only hashed and compared in place.
+ */
+static int _wanted(const unsigned char *packet, size_t len, const struct wire_rr *rr, void *arg)
+{
+	mdns_daemon_t *d = (mdns_daemon_t *)arg;
+	unsigned int hash;
+	int query, section;
+
+	/* A query without questions continues one with the TC bit set */
+	query = !(packet[2] & 0x80);
+	section = query && (packet[4] || packet[5]) ? MESSAGE_QD : MESSAGE_AN;
+	if (rr->section != section)
+		return rr->section > MESSAGE_AN ? 2 : 0;
+
+	if (message_name_hash(packet, len, rr->name, &hash) < 0)
+		return 2;
+
+	if (_f_match(d, hash))
+		return 1;
+	if (!query && _c_wslot(d, hash, packet, len, rr->name))
+		return 1;
+
+	return 0;
+}
+
+int mdnsd_input(mdns_daemon_t *d, unsigned char *buf, size_t len, struct in_addr ip, unsigned short port)
+{
+	static __thread unsigned char arena[MAX_PACKET_LEN];
+	struct message m;
+
+	mdnsd_log_hex("Got Data:", buf, len);
+	d->stats.pkts_in++;
+	d->stats.bytes_in += len;
+
+	/* Drop traffic not for us, unless someone wants to see everything */
+	if (!d->subs_any && message_walk(buf, len, _wanted, d) != 1) {
+		mdnsd_trace(MDNSD_TR_PKT_DROP, d->addr, NULL, NULL, 0, ip.s_addr, len);
+		d->stats.dropped++;
+		return 1;
+	}
+	mdnsd_trace(MDNSD_TR_PKT_IN, d->addr, NULL, NULL, 0, ip.s_addr, len);
+
+	message_init(&m, arena, sizeof(arena));
+	if (message_parse_len(&m, buf, len)) {
+		d->stats.parse_err++;
+		return -1;
+	}
+
+	return mdnsd_in(d, &m, ip, port);
+}
+
+static void process_dgram(mdns_daemon_t *d, unsigned char *buf, size_t len, struct sockaddr_in *from)
+{
+	mdnsd_input(d, buf, len, from->sin_addr, ntohs(from->sin_port));
+}
+
+/* Room for one IP_PKTINFO control message */
+union pktinfo {
+	struct cmsghdr hdr;
+#ifdef IP_PKTINFO
+	char buf[CMSG_SPACE(sizeof(struct in_pktinfo))];
+#endif
+};
+
+/* Interface a datagram arrived on, or 0 if unknown */
+static int _ifindex(struct msghdr *mh)
+{
+#ifdef IP_PKTINFO
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(mh); cmsg; cmsg = CMSG_NXTHDR(mh, cmsg)) {
+		if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO)
+			return ((struct in_pktinfo *)CMSG_DATA(cmsg))->ipi_ifindex;
+	}
+#endif
+	return 0;
+}
+
+static void _msghdr(mdns_daemon_t *d, struct msghdr *mh, struct iovec *iov, struct sockaddr_in *to, union pktinfo *ctl)
+{
+	memset(mh, 0, sizeof(*mh));
+	mh->msg_iov     = iov;
+	mh->msg_iovlen  = 1;
+	mh->msg_name    = to;
+	mh->msg_namelen = sizeof(*to);
+
+#ifdef IP_PKTINFO
+	/* On a shared socket, leave on the interface d runs on */
+	if (d->ifindex) {
+		struct in_pktinfo *pi;
+		struct cmsghdr *cmsg;
+
+		memset(ctl, 0, sizeof(*ctl));
+		mh->msg_control    = ctl->buf;
+		mh->msg_controllen = sizeof(ctl->buf);
+
+		cmsg = CMSG_FIRSTHDR(mh);
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type  = IP_PKTINFO;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(*pi));
+
+		pi = (struct in_pktinfo *)CMSG_DATA(cmsg);
+		pi->ipi_ifindex = d->ifindex;
+	}
+#endif
+}
+
+/*
+ * Read all pending datagrams from sd.  Either the socket is d's own,
+ * or it is shared and each datagram goes to the daemon demux() returns
+ * for the interface it arrived on.
+ */
+#ifdef HAVE_RECVMMSG
+static int process_in(mdns_daemon_t *d, int sd, mdnsd_demux_fn demux, void *arg)
+{
+	static __thread unsigned char buf[MMSG_BATCH][MMSG_LEN];
+	struct sockaddr_in from[MMSG_BATCH];
+	union pktinfo ctl[MMSG_BATCH];
+	struct mmsghdr msg[MMSG_BATCH];
+	struct iovec iov[MMSG_BATCH];
+	int i, num;
+
+	do {
+		memset(msg, 0, sizeof(msg));
+		for (i = 0; i < MMSG_BATCH; i++) {
+			iov[i].iov_base = buf[i];
+			iov[i].iov_len  = sizeof(buf[i]);
+			msg[i].msg_hdr.msg_iov        = &iov[i];
+			msg[i].msg_hdr.msg_iovlen     = 1;
+			msg[i].msg_hdr.msg_name       = &from[i];
+			msg[i].msg_hdr.msg_namelen    = sizeof(from[i]);
+			msg[i].msg_hdr.msg_control    = &ctl[i];
+			msg[i].msg_hdr.msg_controllen = sizeof(ctl[i]);
+		}
+
+		num = recvmmsg(sd, msg, MMSG_BATCH, MSG_DONTWAIT, NULL);
+		for (i = 0; i < num; i++) {
+			mdns_daemon_t *to = d;
+
+			if (demux) {
+				to = demux(_ifindex(&msg[i].msg_hdr), arg);
+				if (!to)
+					continue;
+			}
+
+			/* Larger than any valid mDNS packet */
+			if (msg[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				to->stats.pkts_in++;
+				to->stats.parse_err++;
+				continue;
+			}
+
+			process_dgram(to, buf[i], msg[i].msg_len, &from[i]);
+		}
+	} while (num == MMSG_BATCH);
+
+	if (num < 0 && errno != EAGAIN)
+		return 1;
+
+	return 0;
+}
+#else
+static int process_in(mdns_daemon_t *d, int sd, mdnsd_demux_fn demux, void *arg)
+{
+	static __thread unsigned char buf[MAX_PACKET_LEN + 1];
+	struct sockaddr_in from;
+	union pktinfo ctl;
+	struct msghdr mh;
+	struct iovec iov;
+	ssize_t bsize;
+
+	while (1) {
+		mdns_daemon_t *to = d;
+
+		iov.iov_base = buf;
+		iov.iov_len  = MAX_PACKET_LEN;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov        = &iov;
+		mh.msg_iovlen     = 1;
+		mh.msg_name       = &from;
+		mh.msg_namelen    = sizeof(from);
+		mh.msg_control    = &ctl;
+		mh.msg_controllen = sizeof(ctl);
+
+		bsize = recvmsg(sd, &mh, MSG_DONTWAIT);
+		if (bsize <= 0)
+			break;
+
+		if (demux) {
+			to = demux(_ifindex(&mh), arg);
+			if (!to)
+				continue;
+		}
+
+		process_dgram(to, buf, bsize, &from);
 	}
 
 	if (bsize < 0 && errno != EAGAIN)
@@ -1409,16 +3800,177 @@ static int process_in(mdns_daemon_t *d, int sd)
 
 	return 0;
 }
+#endif
+
+/*
+ * After a failed send: 1 if the socket is full, try again next step,
+ * 2 if the socket is bad, else 0 to skip just that datagram
+ */
+static int _o_errno(mdns_daemon_t *d)
+{
+	switch (errno) {
+	case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+	case EWOULDBLOCK:
+#endif
+	case ENOBUFS:
+		return 1;
+
+	case EBADF:
+	case ENOTSOCK:
+		return 2;
+	}
+
+	d->stats.send_err++;
+	return 0;
+}
+
+/* Keep datagram for the next step, the socket did not take it */
+static void _o_keep(mdns_daemon_t *d, struct msghdr *mh)
+{
+	struct unsent *u;
+	size_t len = mh->msg_iov[0].iov_len;
+
+	if (d->unsent_count >= UNSENT_MAX || !(u = malloc(sizeof(*u) + len))) {
+		d->stats.send_err++;
+		return;
+	}
+
+	memcpy(&u->to, mh->msg_name, sizeof(u->to));
+	memcpy(u->data, mh->msg_iov[0].iov_base, len);
+	u->len  = len;
+	u->next = NULL;
+
+	if (!d->unsent)
+		d->unsent_tail = &d->unsent;
+	*d->unsent_tail = u;
+	d->unsent_tail = &u->next;
+	d->unsent_count++;
+}
+
+/* Send what was kept last step, in order, returns same as _o_errno() */
+static int _o_retry(mdns_daemon_t *d, int sd)
+{
+	struct unsent *u;
+
+	while ((u = d->unsent)) {
+		union pktinfo ctl;
+		struct msghdr mh;
+		struct iovec iov;
+
+		iov.iov_base = u->data;
+		iov.iov_len  = u->len;
+		_msghdr(d, &mh, &iov, &u->to, &ctl);
+
+		if (sendmsg(sd, &mh, MSG_DONTWAIT) < 0) {
+			int rc = _o_errno(d);
+
+			if (rc)
+				return rc;
+		}
+
+		d->unsent = u->next;
+		d->unsent_count--;
+		free(u);
+	}
+
+	return 0;
+}
+
+#ifdef HAVE_SENDMMSG
+/*
+ * Send num datagrams, one the socket refuses is skipped.  When it is
+ * full the rest is kept for the next step, see _o_errno() for returns
+ */
+static int flush_out(mdns_daemon_t *d, int sd, struct mmsghdr *msg, int num)
+{
+	int i = 0;
+
+	while (i < num) {
+		int rc;
+
+		rc = sendmmsg(sd, &msg[i], num - i, MSG_DONTWAIT);
+		if (rc > 0) {
+			i += rc;
+			continue;
+		}
+
+		rc = _o_errno(d);
+		if (rc == 1) {
+			for (; i < num; i++)
+				_o_keep(d, &msg[i].msg_hdr);
+		}
+		if (rc)
+			return rc;
+		i++;
+	}
+
+	return 0;
+}
+
+static int process_out(mdns_daemon_t *d, int sd)
+{
+	static __thread unsigned char buf[MMSG_BATCH][MMSG_LEN];
+	struct sockaddr_in to[MMSG_BATCH];
+	union pktinfo ctl[MMSG_BATCH];
+	struct mmsghdr msg[MMSG_BATCH];
+	struct iovec iov[MMSG_BATCH];
+	unsigned short int port;
+	struct in_addr ip;
+	struct message m;
+	int num = 0, rc;
+
+	/* Still full, the rest waits in d until this has gone out */
+	if ((rc = _o_retry(d, sd)))
+		return rc == 2 ? 2 : 0;
 
+	/* Built in place, the frame is capped by the size of a slot */
+	message_init(&m, buf[num], MMSG_LEN);
+	while (mdnsd_out(d, &m, &ip, &port)) {
+		int len = message_packet_len(&m);
+
+		mdnsd_log_hex("Send Data:", message_packet(&m), len);
+
+		memset(&to[num], 0, sizeof(to[num]));
+		to[num].sin_family = AF_INET;
+		to[num].sin_port = port;
+		to[num].sin_addr = ip;
+
+		iov[num].iov_base = buf[num];
+		iov[num].iov_len  = len;
+
+		memset(&msg[num], 0, sizeof(msg[num]));
+		_msghdr(d, &msg[num].msg_hdr, &iov[num], &to[num], &ctl[num]);
+
+		if (++num == MMSG_BATCH) {
+			if ((rc = flush_out(d, sd, msg, num)))
+				return rc == 2 ? 2 : 0;
+			num = 0;
+		}
+		message_init(&m, buf[num], MMSG_LEN);
+	}
+
+	rc = flush_out(d, sd, msg, num);
+	return rc == 2 ? 2 : 0;
+}
+#else
 static int process_out(mdns_daemon_t *d, int sd)
 {
+	unsigned char buf[MMSG_LEN];
 	unsigned short int port;
 	struct sockaddr_in to;
+	union pktinfo ctl;
 	struct in_addr ip;
 	struct message m;
+	int rc;
 
+	if ((rc = _o_retry(d, sd)))
+		return rc == 2 ? 2 : 0;
+
+	message_init(&m, buf, sizeof(buf));
 	while (mdnsd_out(d, &m, &ip, &port)) {
-		unsigned char *buf;
+		struct msghdr mh;
+		struct iovec iov;
 		ssize_t len;
 
 		memset(&to, 0, sizeof(to));
@@ -1427,22 +3979,31 @@ static int process_out(mdns_daemon_t *d, int sd)
 		to.sin_addr = ip;
 
 		len = message_packet_len(&m);
-		buf = message_packet(&m);
-		mdnsd_log_hex("Send Data:", buf, len);
-
-		if (sendto(sd, buf, len, MSG_DONTWAIT, (struct sockaddr *)&to, sizeof(struct sockaddr_in)) != len)
-			return 2;
+		iov.iov_base = message_packet(&m);
+		iov.iov_len  = len;
+		mdnsd_log_hex("Send Data:", iov.iov_base, len);
+
+		_msghdr(d, &mh, &iov, &to, &ctl);
+		if (sendmsg(sd, &mh, MSG_DONTWAIT) != len) {
+			rc = _o_errno(d);
+			if (rc == 1)
+				_o_keep(d, &mh);
+			if (rc)
+				return rc == 2 ? 2 : 0;
+		}
 	}
 
 	return 0;
 }
+#endif
 
 int mdnsd_step(mdns_daemon_t *d, int sd, bool in, bool out, struct timeval *tv)
 {
 	int rc = 0;
 
 	if (in)
-		rc = process_in(d, sd);
+		rc = process_in(d, sd, NULL, NULL);
+	mdnsd_deliver(d);
 	if (!rc && out)
 		rc = process_out(d, sd);
 
@@ -1460,6 +4021,11 @@ int mdnsd_step(mdns_daemon_t *d, int sd, bool in, bool out, struct timeval *tv)
 	return rc;
 }
 
+int mdnsd_demux(int sd, mdnsd_demux_fn demux, void *arg)
+{
+	return process_in(NULL, sd, demux, arg);
+}
+
 void records_clear(mdns_daemon_t *d)
 {
 	for (int i = 0; i < SPRIME; i++)
@@ -1469,6 +4035,7 @@ void records_clear(mdns_daemon_t *d)
 		{
 			mdns_record_t *const next = r->next;
 			_r_remove_lists(d, r, NULL);
+			heap_del(&d->republish, &r->announce);
 			r = next;
 		}
 		d->published[i] = NULL;
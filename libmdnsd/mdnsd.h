@@ -51,9 +51,18 @@ typedef struct mdns_daemon mdns_daemon_t;
 /* Record entry */
 typedef struct mdns_record mdns_record_t;
 
+/* Subscription to received records */
+typedef struct mdns_sub mdns_sub_t;
+
 /* Callback for received record. Data is passed from the register call */
 typedef void (*mdnsd_record_received_callback)(const struct resource* r, void* data);
 
+/* Callback for a batch of num received records, see mdnsd_subscribe_batch() */
+typedef void (*mdnsd_batch_callback)(const struct resource *rr, int num, void *data);
+
+/* Daemon for datagrams received on ifindex of a shared socket, or NULL */
+typedef mdns_daemon_t *(*mdnsd_demux_fn)(int ifindex, void *arg);
+
 /* Answer data */
 typedef struct mdns_answer {
 	char *name;
@@ -68,6 +77,54 @@ typedef struct mdns_answer {
 	} srv;			/* SRV */
 } mdns_answer_t;
 
+/* Cache index statistics, see mdnsd_cache_stats() */
+struct mdnsd_cache_stats {
+	size_t entries;		/* Cached records */
+	size_t bytes;		/* Of entries, with their names and rdata */
+	size_t names;		/* Distinct names, one index slot each */
+	size_t slots;		/* Current size of the index */
+	double load;		/* Load factor, names / slots */
+	double probe_avg;	/* Average probe length of a lookup */
+	size_t probe_max;	/* Longest probe length */
+};
+
+/*
+ * Histogram of powers of two: bucket 0 counts zero, bucket n counts
+ * values from 2^(n-1) up to 2^n, and the last all larger values
+ */
+#define MDNSD_HIST 24
+
+/* Counters since mdnsd_new(), see mdnsd_stats() */
+struct mdnsd_stats {
+	unsigned long long pkts_in, bytes_in;	/* Read by mdnsd_step() */
+	unsigned long long dropped;		/* Of those, not for us */
+	unsigned long long parse_err;		/* Truncated or malformed */
+	unsigned long long queries_in;		/* Handled by mdnsd_in() */
+	unsigned long long answers_in;
+	unsigned long long pkts_out, bytes_out;	/* Built by mdnsd_out() */
+	unsigned long long multicast_out;
+	unsigned long long unicast_out;		/* Replies to legacy queriers */
+	unsigned long long send_err;		/* Refused by the socket, or
+						   dropped while it was full */
+	unsigned long long conflicts;		/* Records lost to another host */
+	unsigned long long rate_limited;	/* Answers sent too recently, or
+						   to a source over its rate */
+	unsigned long long suppressed;		/* Answers another host sent */
+	unsigned long long held;		/* Queries with the TC bit, held
+						   for the rest of their known
+						   answers */
+	unsigned long long cache_inserts;
+	unsigned long long cache_refresh;	/* TTL updated by new answer */
+	unsigned long long cache_removals;	/* Expired, flushed, or goodbye */
+	unsigned long long cache_evictions;	/* Removed to make room */
+	unsigned long long cache_full;		/* Not cached, no room */
+	size_t publish_chain;			/* Longest hash chain of records */
+	size_t query_chain;			/* ... and of queries */
+	unsigned long long in_usec[MDNSD_HIST];	/* Time in mdnsd_in() */
+	unsigned long long out_usec[MDNSD_HIST];/* Time in mdnsd_out() */
+	unsigned long long sleep_msec[MDNSD_HIST]; /* From mdnsd_sleep() */
+};
+
 /**
  * Global functions
  */
@@ -97,6 +154,68 @@ void mdnsd_log_hex(char *msg, unsigned char *buffer, ssize_t len);
  */
 void mdnsd_log(int severity, const char *fmt, ...);
 
+/*
+ * Trace events, see mdnsd_trace_init(), with the meaning of their args
+ */
+#define MDNSD_TR_PKT_IN      1		/* Source ip, length */
+#define MDNSD_TR_PKT_DROP    2		/* Same, not for us, see mdnsd_input() */
+#define MDNSD_TR_PKT_OUT     3		/* Destination ip, length */
+#define MDNSD_TR_QUERY       4		/* Question from ip */
+#define MDNSD_TR_ANSWER      5		/* Answer from ip, TTL */
+#define MDNSD_TR_SEND        6		/* Record put in packet, TTL */
+#define MDNSD_TR_KNOWN       7		/* Not sent, known answer */
+#define MDNSD_TR_LIMIT       8		/* Not sent, rate limited */
+#define MDNSD_TR_DUPE        9		/* Not sent, another host did */
+#define MDNSD_TR_PROBE       10		/* Probe sent, number of tries */
+#define MDNSD_TR_CONFLICT    11		/* Record lost to another host */
+#define MDNSD_TR_CACHE_ADD   12		/* TTL */
+#define MDNSD_TR_CACHE_DEL   13		/* Expired, flushed, or goodbye */
+#define MDNSD_TR_CACHE_EVICT 14		/* Removed to make room */
+
+#define MDNSD_TRACE_NAME     36
+
+/*
+ * One trace event, fixed size binary, nothing is formatted until it is
+ * decoded by mdnsd_trace_print()
+ */
+struct mdnsd_trace {
+	unsigned long long usec;	/* Since the epoch */
+	unsigned int   seq;		/* 0 while being written */
+	unsigned short event;		/* MDNSD_TR_* */
+	unsigned short type;		/* Of record or question */
+	struct in_addr addr;		/* Of daemon, see mdnsd_set_address() */
+	unsigned int   arg[2];		/* Depends on event, see above */
+	char name[MDNSD_TRACE_NAME];	/* Truncated, NUL terminated if room */
+};
+
+/**
+ * Keep the last num events, rounded up to a power of 2, of all daemons
+ * in a ring in memory, without locks.  Cheap enough to always have on.
+ * Call before creating any daemon, num 0 turns tracing off
+ * Returns 0 on success, -1 on error
+ */
+int mdnsd_trace_init(size_t num);
+
+/**
+ * Add event to the trace ring, if enabled.  At time tv, if not NULL,
+ * events of the same packet can share one gettimeofday()
+ */
+void mdnsd_trace(int event, struct in_addr addr, struct timeval *tv, const char *name, int type, unsigned int a, unsigned int b);
+
+/**
+ * Write trace ring to fp, oldest event first, in host byte order for
+ * reading back on the same machine with mdnsd_trace_print()
+ * Returns 0 on success, -1 on error
+ */
+int mdnsd_trace_save(FILE *fp);
+
+/**
+ * Decode trace written by mdnsd_trace_save() from in, one text line per
+ * event to out
+ * Returns 0 on success, -1 on bad file
+ */
+int mdnsd_trace_print(FILE *out, FILE *in);
+
 /**
  * Create a new mdns daemon for the given class of names (usually 1) and
  * maximum frame size
@@ -113,6 +232,21 @@ void mdnsd_set_address(mdns_daemon_t *d, struct in_addr addr);
  */
 struct in_addr mdnsd_get_address(mdns_daemon_t *d);
 
+/**
+ * Limit the cache to max_bytes of entries and/or max entries, 0 for no
+ * limit, the default.  Call after mdnsd_new().  When full, entries not
+ * answering any query are evicted, those expiring first, to make room.
+ * Entries answering a query are kept, new answers are dropped if all
+ * entries left are needed.
+ */
+void mdnsd_set_cache_limit(mdns_daemon_t *d, size_t max_bytes, size_t max);
+
+/**
+ * Set interface to send on when the socket is shared by daemons on
+ * several interfaces, uses IP_PKTINFO.  Default 0, socket decides.
+ */
+void mdnsd_set_ifindex(mdns_daemon_t *d, int ifindex);
+
 /**
  * Gracefully shutdown the daemon, use mdnsd_out() to get the last
  * packets
@@ -131,10 +265,39 @@ void mdnsd_free(mdns_daemon_t *d);
 
 /**
  * Register callback which is called when a record is received. The data parameter is passed to the callback.
- * Calling this multiple times overwrites the previous register.
+ * Calling this multiple times overwrites the previous register.  Same as mdnsd_subscribe() for any name.
  */
 void mdnsd_register_receive_callback(mdns_daemon_t *d, mdnsd_record_received_callback cb, void *data);
 
+/**
+ * Subscribe to received records, answers and known answers, of name,
+ * or any name if NULL, and type, or any type if QTYPE_ANY.  The filter
+ * is checked in the library, packets with no name anyone wants are not
+ * even parsed, see mdnsd_input().  Subscribing to any name turns that
+ * off.  Each match is handed to cb while the packet is processed.
+ * Returns NULL on error
+ */
+mdns_sub_t *mdnsd_subscribe(mdns_daemon_t *d, const char *name, int type, mdnsd_record_received_callback cb, void *data);
+
+/**
+ * Same as mdnsd_subscribe(), but matches are copied and handed to cb
+ * all at once by mdnsd_deliver(), called by mdnsd_step().  The records
+ * are only valid during the callback
+ */
+mdns_sub_t *mdnsd_subscribe_batch(mdns_daemon_t *d, const char *name, int type, mdnsd_batch_callback cb, void *data);
+
+/**
+ * Hand records received so far to batched subscriptions.  Only needed
+ * when not using mdnsd_step(), e.g., with mdnsd_input()
+ */
+void mdnsd_deliver(mdns_daemon_t *d);
+
+/**
+ * Drop subscription, and any records not yet delivered.  Not from a
+ * callback of the subscription
+ */
+void mdnsd_unsubscribe(mdns_daemon_t *d, mdns_sub_t *s);
+
 /**
  * I/O functions
  */
@@ -144,9 +307,19 @@ void mdnsd_register_receive_callback(mdns_daemon_t *d, mdnsd_record_received_cal
  */
 int mdnsd_in(mdns_daemon_t *d, struct message *m, struct in_addr ip, unsigned short port);
 
+/**
+ * Same as mdnsd_in(), for a datagram of len bytes read by the caller.
+ * Packets without any name we publish, query for, or have cached are
+ * dropped before parsing, unless a receive callback is registered.
+ * Returns 1 if dropped, -1 on bad packet, else same as mdnsd_in()
+ */
+int mdnsd_input(mdns_daemon_t *d, unsigned char *buf, size_t len, struct in_addr ip, unsigned short port);
+
 /**
  * Outgoing messge to be delivered to host, returns >0 if one was
- * returned and m/ip/port set
+ * returned and m/ip/port set.  Built in the buffer m was given with
+ * message_init(), with room for the frame and one more record, since
+ * the first record always goes in.  Records past the buffer are lost
  */
 int mdnsd_out(mdns_daemon_t *d, struct message *m, struct in_addr *ip, unsigned short *port);
 
@@ -166,6 +339,9 @@ struct timeval *mdnsd_sleep(mdns_daemon_t *d);
  * (immediate or anytime after, mdns_answer_t valid until ->ttl==0)
  * either answer returns -1, or another mdnsd_query() with a %NULL answer
  * will remove/unregister this query
+ *
+ * The question is asked at once, then again after 1, 2, 4 ... seconds,
+ * up to once an hour.  Answers are refreshed at 80-95% of their TTL.
  */
 void mdnsd_query(mdns_daemon_t *d, const char *host, int type, int (*answer)(mdns_answer_t *a, void *arg), void *arg);
 
@@ -175,6 +351,25 @@ void mdnsd_query(mdns_daemon_t *d, const char *host, int type, int (*answer)(mdn
  */
 mdns_answer_t *mdnsd_list(mdns_daemon_t *d, const char *host, int type, mdns_answer_t *last);
 
+/**
+ * Fill in size, load factor and probe lengths of the cache index
+ */
+void mdnsd_cache_stats(mdns_daemon_t *d, struct mdnsd_cache_stats *st);
+
+/**
+ * Copy packet, cache and timing counters, see struct mdnsd_stats
+ */
+void mdnsd_stats(mdns_daemon_t *d, struct mdnsd_stats *st);
+
+/**
+ * Save cache to file, with the absolute expiry time of each entry, or
+ * load it back into a new daemon, dropping entries that have expired.
+ * The file is replaced atomically, so it is safe to save periodically.
+ * Returns 0 (save) or number of entries loaded, -1 on error with errno
+ */
+int mdnsd_cache_save(mdns_daemon_t *d, const char *file);
+int mdnsd_cache_load(mdns_daemon_t *d, const char *file);
+
 /**
  * Returns the next record of the given record, i.e. the value of next field.
  * @param r the base record
@@ -233,18 +428,57 @@ void mdnsd_done(mdns_daemon_t *d, mdns_record_t *r);
 
 /**
  * These all set/update the data for the given record, nothing is
- * published until they are called
+ * published until they are called.  Setting the same data again is a
+ * no-op, nothing is re-announced
  */
 void mdnsd_set_raw(mdns_daemon_t *d, mdns_record_t *r, const char *data, unsigned short len);
 void mdnsd_set_host(mdns_daemon_t *d, mdns_record_t *r, const char *name);
 void mdnsd_set_ip(mdns_daemon_t *d, mdns_record_t *r, struct in_addr ip);
 void mdnsd_set_srv(mdns_daemon_t *d, mdns_record_t *r, unsigned short priority, unsigned short weight, unsigned short port, char *name);
 
+/**
+ * Change the case of the owner name of r, RFC 4343.  Names are shared,
+ * every record with it as owner or rdata is announced again with the
+ * new spelling.  Returns 0 on success, -1 with errno EINVAL if name is
+ * not the same ignoring case, or EBUSY if it is also cached or queried
+ */
+int mdnsd_set_case(mdns_daemon_t *d, mdns_record_t *r, const char *name);
+
+/**
+ * Batch many records, e.g. at startup.  Between mdnsd_begin() and
+ * mdnsd_commit() records are created and set without looking through
+ * the lists of records waiting to be sent, at commit all of them are
+ * queued at once, to be probed and announced together, as few, full
+ * packets as possible.  May be nested, no I/O functions in between
+ */
+void mdnsd_begin(mdns_daemon_t *d);
+void mdnsd_commit(mdns_daemon_t *d);
+
+/**
+ * Mark all published records stale, before setting them again for a
+ * reload.  Records not set or created since then are retired, with a
+ * goodbye, by mdnsd_sweep()
+ */
+void mdnsd_mark(mdns_daemon_t *d);
+void mdnsd_sweep(mdns_daemon_t *d);
+
 /**
  * Process input queue and output queue. Should be called at least the time which is returned in nextSleep.
- * Returns 0 on success, 1 on read error, 2 on write error
+ * Returns 0 on success, 1 on read error, 2 if the socket is bad.  A
+ * datagram the socket refuses is skipped, see send_err, and when it is
+ * full the rest is sent next step
  */
 int mdnsd_step(mdns_daemon_t *d, int mdns_socket, bool processIn, bool processOut, struct timeval *tv);
+
+/**
+ * Read all pending datagrams from a socket shared by several daemons,
+ * each one is handed to the daemon demux() returns for the interface
+ * it arrived on, see IP_PKTINFO.  The output side of those daemons is
+ * left to mdnsd_step() with processIn false.
+ * Returns 0 on success, 1 on read error
+ */
+int mdnsd_demux(int sd, mdnsd_demux_fn demux, void *arg);
+
 /**
  * Clear all records from the list published
  * Returns none
@@ -0,0 +1,245 @@
+/* Per-daemon slab allocator for small, frequently recycled, objects
+ *
+ * Copyright (c) 2016-2022  Joachim Wiberg <troglobit@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SLAB_SIZE   16384	/* Bytes per slab, incl. slab header */
+#define NUM_CLASSES 7		/* 32, 64, ... 2048 byte blocks */
+#define MIN_SHIFT   5
+
+struct slab;
+
+/* Every block starts with a header pointing back to its slab */
+struct block {
+	union {
+		struct slab *slab;	/* In use, NULL for calloc()'ed */
+		struct block *next;	/* On slab free list */
+	} u;
+	size_t size;			/* Block size, incl. header */
+};
+
+/* Start of each SLAB_SIZE chunk, followed by its blocks */
+struct slab {
+	struct slab *prev, *next;	/* Partial slabs of this class */
+	struct slab *aprev, *anext;	/* All slabs, for pool_destroy() */
+	struct block *free;
+	int class, used, total;
+};
+
+struct pool {
+	struct slab *partial[NUM_CLASSES];
+	struct slab *slabs;
+	size_t used;
+};
+
+#define SLAB_HDR ((sizeof(struct slab) + 15) & ~(size_t)15)
+
+static int _pool_class(size_t len)
+{
+	size_t size = (size_t)1 << MIN_SHIFT;
+	int class = 0;
+
+	while (size < len) {
+		size <<= 1;
+		class++;
+	}
+
+	return class;
+}
+
+static void _slab_unlink(pool_t *p, struct slab *s)
+{
+	if (s->prev)
+		s->prev->next = s->next;
+	else if (p->partial[s->class] == s)
+		p->partial[s->class] = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	s->prev = s->next = NULL;
+}
+
+static void _slab_link(pool_t *p, struct slab *s)
+{
+	s->prev = NULL;
+	s->next = p->partial[s->class];
+	if (s->next)
+		s->next->prev = s;
+	p->partial[s->class] = s;
+}
+
+static struct slab *_slab_new(pool_t *p, int class)
+{
+	size_t size = (size_t)1 << (class + MIN_SHIFT);
+	unsigned char *ptr;
+	struct slab *s;
+	int i;
+
+	s = malloc(SLAB_SIZE);
+	if (!s)
+		return NULL;
+
+	memset(s, 0, sizeof(*s));
+	s->class = class;
+	s->total = (int)((SLAB_SIZE - SLAB_HDR) / size);
+
+	ptr = (unsigned char *)s + SLAB_HDR;
+	for (i = s->total - 1; i >= 0; i--) {
+		struct block *b = (struct block *)(ptr + (size_t)i * size);
+
+		b->size = size;
+		b->u.next = s->free;
+		s->free = b;
+	}
+
+	s->anext = p->slabs;
+	if (s->anext)
+		s->anext->aprev = s;
+	p->slabs = s;
+	_slab_link(p, s);
+
+	return s;
+}
+
+static void _slab_free(pool_t *p, struct slab *s)
+{
+	_slab_unlink(p, s);
+
+	if (s->aprev)
+		s->aprev->anext = s->anext;
+	else
+		p->slabs = s->anext;
+	if (s->anext)
+		s->anext->aprev = s->aprev;
+
+	free(s);
+}
+
+pool_t *pool_new(void)
+{
+	return calloc(1, sizeof(struct pool));
+}
+
+void *pool_alloc(pool_t *p, size_t len)
+{
+	struct block *b;
+	struct slab *s;
+	int class;
+
+	len += sizeof(struct block);
+	class = _pool_class(len);
+	if (class >= NUM_CLASSES) {
+		b = calloc(1, len);
+		if (!b)
+			return NULL;
+
+		b->u.slab = NULL;
+		b->size = len;
+		p->used += len;
+
+		return b + 1;
+	}
+
+	s = p->partial[class];
+	if (!s) {
+		s = _slab_new(p, class);
+		if (!s)
+			return NULL;
+	}
+
+	b = s->free;
+	s->free = b->u.next;
+	if (++s->used == s->total)
+		_slab_unlink(p, s);
+
+	b->u.slab = s;
+	p->used += b->size;
+	memset(b + 1, 0, b->size - sizeof(*b));
+
+	return b + 1;
+}
+
+char *pool_strdup(pool_t *p, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *ptr;
+
+	ptr = pool_alloc(p, len);
+	if (ptr)
+		memcpy(ptr, str, len);
+
+	return ptr;
+}
+
+void pool_free(pool_t *p, void *ptr)
+{
+	struct block *b;
+	struct slab *s;
+
+	if (!ptr)
+		return;
+
+	b = (struct block *)ptr - 1;
+	p->used -= b->size;
+
+	s = b->u.slab;
+	if (!s) {
+		free(b);
+		return;
+	}
+
+	b->u.next = s->free;
+	s->free = b;
+	if (s->used-- == s->total)
+		_slab_link(p, s);
+
+	/* Release empty slabs, but keep one around to avoid thrashing */
+	if (!s->used && (s->prev || s->next))
+		_slab_free(p, s);
+}
+
+size_t pool_used(pool_t *p)
+{
+	return p->used;
+}
+
+void pool_destroy(pool_t *p)
+{
+	struct slab *s, *next;
+
+	if (!p)
+		return;
+
+	for (s = p->slabs; s; s = next) {
+		next = s->anext;
+		free(s);
+	}
+	free(p);
+}
@@ -0,0 +1,70 @@
+/* Per-daemon slab allocator for small, frequently recycled, objects
+ *
+ * Copyright (c) 2016-2022  Joachim Wiberg <troglobit@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MDNS_POOL_H_
+#define MDNS_POOL_H_
+
+#include <stddef.h>
+
+typedef struct pool pool_t;
+
+/**
+ * Create a new, empty, pool
+ */
+pool_t *pool_new(void);
+
+/**
+ * Returns zeroed block of at least len bytes, or NULL
+ *
+ * Small blocks are carved from per size class slabs, anything larger
+ * than the biggest size class is passed on to calloc()
+ */
+void *pool_alloc(pool_t *p, size_t len);
+
+/**
+ * Same as strdup(), but from pool
+ */
+char *pool_strdup(pool_t *p, const char *str);
+
+/**
+ * Return block to its slab, empty slabs are released
+ */
+void pool_free(pool_t *p, void *ptr);
+
+/**
+ * Total number of bytes currently handed out, including overhead
+ */
+size_t pool_used(pool_t *p);
+
+/**
+ * Release all slabs, and the pool itself
+ */
+void pool_destroy(pool_t *p);
+
+#endif	/* MDNS_POOL_H_ */
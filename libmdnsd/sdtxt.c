@@ -31,6 +31,7 @@
 #include "sdtxt.h"
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 static size_t _sd2txt_len(const char *key, char *val)
 {
@@ -94,6 +95,8 @@ unsigned char *sd2txt(xht_t *h, int *len)
 
 xht_t *txt2sd(unsigned char *txt, int len)
 {
+	const char *key, *val;
+	int klen, vlen, pos = 0;
 	xht_t *h = 0;
 
 	if (txt == 0 || len == 0 || *txt == 0)
@@ -101,22 +104,79 @@ xht_t *txt2sd(unsigned char *txt, int len)
 
 	h = xht_new(23);
 
-	/* Loop through data breaking out each block, storing into hashtable */
-	for (; *txt <= len && len > 0; len -= *txt, txt += *txt + 1) {
-		char key[256], *val;
+	/* Store each key=val string into hashtable */
+	while (sdtxt_next(txt, len, &pos, &key, &klen, &val, &vlen)) {
+		if (!val)
+			continue;
 
-		if (*txt == 0)
-			break;
+		xht_store(h, key, klen, (char *)val, vlen);
+	}
 
-		memcpy(key, txt + 1, *txt);
-		key[*txt] = 0;
+	return h;
+}
 
-		val = strchr(key, '=');
-		if (val) {
-			*val++ = 0;
-			xht_store(h, key, (int)strlen(key), val, (int)strlen(val));
+int sdtxt_next(const unsigned char *txt, int len, int *pos,
+	       const char **key, int *klen, const char **val, int *vlen)
+{
+	while (*pos < len) {
+		const char *str = (const char *)&txt[*pos + 1];
+		const char *eq;
+		int n = txt[*pos];
+
+		if (*pos + 1 + n > len)
+			return 0;
+		*pos += 1 + n;
+
+		if (n == 0 || *str == '=')
+			continue;
+
+		eq = memchr(str, '=', n);
+		*key = str;
+		if (eq) {
+			*klen = eq - str;
+			*val  = eq + 1;
+			*vlen = n - *klen - 1;
+		} else {
+			*klen = n;
+			*val  = NULL;
+			*vlen = 0;
 		}
+
+		return 1;
 	}
 
-	return h;
+	return 0;
+}
+
+int sdtxt_find(const unsigned char *txt, int len, const char *key, const char **val, int *vlen)
+{
+	int n = strlen(key), klen, pos = 0;
+	const char *k;
+
+	while (sdtxt_next(txt, len, &pos, &k, &klen, val, vlen)) {
+		if (klen == n && !strncasecmp(k, key, n))
+			return 1;
+	}
+
+	return 0;
+}
+
+int sdtxt_add(unsigned char *buf, size_t size, int *len, const char *key, const char *val)
+{
+	size_t klen = strlen(key), vlen = val ? strlen(val) : 0;
+	size_t n = klen + (val ? 1 + vlen : 0);
+
+	if (n > 255 || *len + 1 + n > size)
+		return -1;
+
+	buf[(*len)++] = n;
+	memcpy(&buf[*len], key, klen);
+	*len += klen;
+	if (val) {
+		buf[(*len)++] = '=';
+		memcpy(&buf[*len], val, vlen);
+		*len += vlen;
+	}
+
+	return 0;
 }
@@ -30,6 +30,7 @@
 
 #ifndef MDNS_SDTXT_H_
 #define MDNS_SDTXT_H_
+#include <stddef.h>
 #include "xht.h"
 
 /**
@@ -42,4 +43,28 @@ xht_t *txt2sd(unsigned char *txt, int len);
  */
 unsigned char *sd2txt(xht_t *h, int *len);
 
+/**
+ * Iterate over the strings of SD TXT record rdata without copying, pos
+ * must be 0 on the first call.  key and val point into txt and are not
+ * NUL terminated, val is NULL for a key without '=', RFC 6763, 6.4.
+ * Empty strings, and strings missing a key, are skipped
+ * @returns 1 for each string, 0 when done or on bad rdata.
+ */
+int sdtxt_next(const unsigned char *txt, int len, int *pos,
+	       const char **key, int *klen, const char **val, int *vlen);
+
+/**
+ * Find key in SD TXT record rdata, ignoring case, the first one wins
+ * @returns 1 and sets val and vlen as sdtxt_next(), or 0 if not found.
+ */
+int sdtxt_find(const unsigned char *txt, int len, const char *key, const char **val, int *vlen);
+
+/**
+ * Append key=val to SD TXT record rdata in buf of size bytes, at *len,
+ * only key if val is NULL.  Remember that an empty record must still be
+ * sent as a single 0 byte, RFC 6763, 6.1
+ * @returns 0 if OK, or -1 if too long for a string or for buf.
+ */
+int sdtxt_add(unsigned char *buf, size_t size, int *len, const char *key, const char *val);
+
 #endif	/* MDNS_SDTXT_H_ */
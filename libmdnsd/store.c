@@ -0,0 +1,150 @@
+/* Immutable data shared by all daemons of a process, by content
+ *
+ * Copyright (c) 2016-2022  Joachim Wiberg <troglobit@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "store.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define STORE_BUCKETS 4096	/* Power of two */
+
+/*
+ * Content is looked up and reference counted under one spinlock, held
+ * only while a daemon sets or drops a record, never when sending.
+ */
+struct entry {
+	struct entry *next;	/* In the same bucket */
+	unsigned int hash;
+	unsigned int refs;
+	size_t len;
+	unsigned char data[] __attribute__((aligned(16)));
+};
+
+static struct entry *table[STORE_BUCKETS];
+static char store_lock;
+
+static void lock(void)
+{
+	while (__atomic_test_and_set(&store_lock, __ATOMIC_ACQUIRE))
+		;
+}
+
+static void unlock(void)
+{
+	__atomic_clear(&store_lock, __ATOMIC_RELEASE);
+}
+
+/* FNV-1a, same as the names */
+static unsigned int hash(const unsigned char *data, size_t len)
+{
+	unsigned int h = 2166136261U;
+
+	while (len--) {
+		h ^= *data++;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+static struct entry *entry(void *data)
+{
+	return (struct entry *)((char *)data - offsetof(struct entry, data));
+}
+
+static struct entry *find(struct entry *e, unsigned int h, const void *data, size_t len)
+{
+	for (; e; e = e->next) {
+		if (e->hash == h && e->len == len && !memcmp(e->data, data, len))
+			return e;
+	}
+
+	return NULL;
+}
+
+void *store_get(const void *data, size_t len)
+{
+	unsigned int h = hash(data, len);
+	struct entry *e, *x, **head = &table[h & (STORE_BUCKETS - 1)];
+
+	lock();
+	e = find(*head, h, data, len);
+	if (e)
+		e->refs++;
+	unlock();
+	if (e)
+		return e->data;
+
+	/* Allocate outside of the lock, another thread may race us to it */
+	e = malloc(sizeof(*e) + len);
+	if (!e)
+		return NULL;
+	memcpy(e->data, data, len);
+	e->hash = h;
+	e->refs = 1;
+	e->len  = len;
+
+	lock();
+	x = find(*head, h, data, len);
+	if (x) {
+		x->refs++;
+	} else {
+		e->next = *head;
+		*head = e;
+	}
+	unlock();
+
+	if (x) {
+		free(e);
+		return x->data;
+	}
+
+	return e->data;
+}
+
+void store_put(void *data)
+{
+	struct entry *e, **ep;
+
+	if (!data)
+		return;
+
+	e = entry(data);
+	lock();
+	if (--e->refs) {
+		unlock();
+		return;
+	}
+
+	for (ep = &table[e->hash & (STORE_BUCKETS - 1)]; *ep != e; ep = &(*ep)->next)
+		;
+	*ep = e->next;
+	unlock();
+
+	free(e);
+}
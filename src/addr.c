@@ -37,9 +37,17 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "mdnsd.h"
 
+#if defined(HAVE_LINUX_RTNETLINK_H)
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#elif defined(HAVE_NET_ROUTE_H)
+#include <net/route.h>
+#endif
+
 static TAILQ_HEAD(iflist, iface) iface_list = TAILQ_HEAD_INITIALIZER(iface_list);
 
 struct iface *iface_iterator(int first)
@@ -73,6 +81,38 @@ struct iface *iface_find(const char *ifname)
 	return NULL;
 }
 
+/* Safe to call while iterating, used to demux the shared socket */
+struct iface *iface_find_index(int ifindex)
+{
+	struct iface *iface;
+
+	TAILQ_FOREACH(iface, &iface_list, link) {
+		if (iface->ifindex == ifindex)
+			return iface;
+	}
+
+	return NULL;
+}
+
+/* Name of interface, also for ones that are gone but we still know */
+static char *ifindex_name(int ifindex, char *buf)
+{
+	struct iface *iface;
+
+	if (if_indextoname(ifindex, buf))
+		return buf;
+
+	for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
+		if (iface->ifindex != ifindex)
+			continue;
+
+		strlcpy(buf, iface->ifname, IFNAMSIZ);
+		return buf;
+	}
+
+	return NULL;
+}
+
 void iface_free(struct iface *iface)
 {
 	if (!iface)
@@ -82,11 +122,14 @@ void iface_free(struct iface *iface)
 	free(iface);
 }
 
-static void mark(void)
+static void mark(char *ifname)
 {
 	struct iface *iface;
 
 	for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
+		if (ifname && strcmp(iface->ifname, ifname))
+			continue;
+
 		iface->unused = 1;
 		iface->inaddr_old = iface->inaddr;
 		memset(&iface->inaddr, 0, sizeof(iface->inaddr));
@@ -99,8 +142,12 @@ static int sweep(void)
 	int changed = 0;
 
 	for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
-		if (iface->unused)
+		if (iface->unused) {
+			/* Gone or down since last time, tear it down */
+			if (iface->inaddr_old.s_addr)
+				iface->changed = 1;
 			continue;
+		}
 
 		if (!iface->changed)
 			continue;
@@ -128,7 +175,7 @@ void iface_init(char *ifname)
 		return;
 	}
 
-	mark();
+	mark(ifname);
 
 	if (ifname)
 		iface = iface_find(ifname);
@@ -182,6 +229,8 @@ void iface_init(char *ifname)
 			iface->hostid = 1;
 			iface->sd = -1;
 		} else {
+			/* May have been re-created since we last saw it */
+			iface->ifindex = if_nametoindex(ifa->ifa_name);
 			iface->unused = 0;
 		}
 
@@ -203,6 +252,159 @@ void iface_init(char *ifname)
 	sweep();
 }
 
+#if defined(HAVE_LINUX_RTNETLINK_H)
+int iface_monitor(void)
+{
+	struct sockaddr_nl sa = { 0 };
+	int sd;
+
+	sd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (sd < 0)
+		return -1;
+
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+	if (bind(sd, (struct sockaddr *)&sa, sizeof(sa))) {
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+}
+
+static char *msg_ifname(struct nlmsghdr *nh, char *buf)
+{
+	struct ifinfomsg *ifi;
+	struct ifaddrmsg *ifa;
+	struct rtattr *a;
+	int len;
+
+	switch (nh->nlmsg_type) {
+	case RTM_NEWLINK:
+	case RTM_DELLINK:
+		ifi = NLMSG_DATA(nh);
+		len = IFLA_PAYLOAD(nh);
+		for (a = IFLA_RTA(ifi); RTA_OK(a, len); a = RTA_NEXT(a, len)) {
+			if (a->rta_type != IFLA_IFNAME)
+				continue;
+
+			strlcpy(buf, RTA_DATA(a), IFNAMSIZ);
+			return buf;
+		}
+		return ifindex_name(ifi->ifi_index, buf);
+
+	case RTM_NEWADDR:
+	case RTM_DELADDR:
+		ifa = NLMSG_DATA(nh);
+		if (ifa->ifa_family != AF_INET)
+			break;
+		return ifindex_name(ifa->ifa_index, buf);
+	}
+
+	return NULL;
+}
+
+int iface_event(int sd, char *ifname)
+{
+	char buf[8192] __attribute__((aligned(__alignof__(struct nlmsghdr))));
+	int changed = 0;
+	ssize_t len;
+
+	while ((len = recv(sd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		struct nlmsghdr *nh;
+
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			char name[IFNAMSIZ];
+
+			if (!msg_ifname(nh, name))
+				continue;
+			if (ifname && strcmp(ifname, name))
+				continue;
+
+			DBG("Interface %s changed, rescanning ...", name);
+			iface_init(name);
+			changed++;
+		}
+	}
+
+	/* Lost events, start over */
+	if (len < 0 && errno == ENOBUFS) {
+		iface_init(ifname);
+		changed++;
+	}
+
+	return changed;
+}
+
+#elif defined(HAVE_NET_ROUTE_H) && defined(RTM_IFINFO)
+int iface_monitor(void)
+{
+	return socket(PF_ROUTE, SOCK_RAW, AF_INET);
+}
+
+static char *msg_ifname(struct rt_msghdr *rtm, char *buf)
+{
+	switch (rtm->rtm_type) {
+	case RTM_NEWADDR:
+	case RTM_DELADDR:
+		return ifindex_name(((struct ifa_msghdr *)rtm)->ifam_index, buf);
+
+	case RTM_IFINFO:
+		return ifindex_name(((struct if_msghdr *)rtm)->ifm_index, buf);
+
+#ifdef RTM_IFANNOUNCE
+	case RTM_IFANNOUNCE:
+		strlcpy(buf, ((struct if_announcemsghdr *)rtm)->ifan_name, IFNAMSIZ);
+		return buf;
+#endif
+	}
+
+	return NULL;
+}
+
+int iface_event(int sd, char *ifname)
+{
+	char buf[2048] __attribute__((aligned(__alignof__(struct rt_msghdr))));
+	int changed = 0;
+	ssize_t len;
+
+	while ((len = recv(sd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		struct rt_msghdr *rtm = (struct rt_msghdr *)buf;
+		char name[IFNAMSIZ];
+
+		if (len < (ssize_t)sizeof(*rtm) || rtm->rtm_version != RTM_VERSION)
+			continue;
+		if (!msg_ifname(rtm, name))
+			continue;
+		if (ifname && strcmp(ifname, name))
+			continue;
+
+		DBG("Interface %s changed, rescanning ...", name);
+		iface_init(name);
+		changed++;
+	}
+
+	/* Lost events, start over */
+	if (len < 0 && errno == ENOBUFS) {
+		iface_init(ifname);
+		changed++;
+	}
+
+	return changed;
+}
+
+#else
+int iface_monitor(void)
+{
+	return -1;
+}
+
+int iface_event(int sd, char *ifname)
+{
+	return 0;
+}
+#endif
+
 void iface_exit(void)
 {
 	struct iface *iface, *tmp;
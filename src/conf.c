@@ -28,9 +28,11 @@
 
 #include <errno.h>
 #include <glob.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/param.h>
 #include <sys/stat.h>
@@ -38,6 +40,14 @@
 #include "mdnsd.h"
 
 struct conf_srec {
+	int     refcnt;			/* Shared by confs, file unchanged */
+	char   *path;
+	dev_t   dev;			/* See srec_find() */
+	ino_t   ino;
+	time_t  mtime, ctime;
+	long    mtime_ns;
+	off_t   size;
+
 	char   *type;
 
 	char   *name;
@@ -48,8 +58,32 @@ struct conf_srec {
 
 	char   *txt[42];
 	size_t  txt_num;
+
+	unsigned char *rdata;		/* TXT record, from txt[] */
+	int            rdlen;
+};
+
+/*
+ * Parsed .service files, shared by all interfaces and never modified
+ * once loaded.  Replaced as a whole by conf_load(), any interface still
+ * publishing from the old one holds a reference to it.  Files that are
+ * unchanged since last time, see srec_find(), are not parsed again, their
+ * srec is shared with the old conf.
+ *
+ * Each interface's daemon has its own records, for its own timers and
+ * probing, but the rdata and wire format they are published with are
+ * shared by content in libmdnsd, one copy for all interfaces.
+ */
+struct conf {
+	int                refcnt;
+	int                rc;
+	size_t             num;
+	struct conf_srec **srec;
 };
 
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct conf *current;
+
 
 static char *chomp(char *str)
 {
@@ -130,32 +164,25 @@ static int parse(char *fn, struct conf_srec *srec)
 	return 0;
 }
 
-/* Create a new record, or update an existing one */
+/*
+ * Create a new record, or update an existing one.  Shared records are
+ * told apart by host, the data they point to.
+ */
 mdns_record_t *record(struct iface *iface, int shared, char *host,
 		      const char *name, unsigned short type, unsigned long ttl)
 {
 	mdns_daemon_t *d = iface->mdns;
 	mdns_record_t *r;
 
-	r = mdnsd_find(d, name, type);
-	while (r != NULL) {
-		const mdns_answer_t *a;
+	for (r = mdnsd_find(d, name, type); r; r = mdnsd_record_next(r)) {
+		const mdns_answer_t *a = mdnsd_record_data(r);
 
-		if (!host)
-			break;
-
-		a = mdnsd_record_data(r);
-		if (!a) {
-			r = mdnsd_record_next(r);
-			continue;
-		}
-
-		if (a->rdname && strcmp(a->rdname, host)) {
-			r = mdnsd_record_next(r);
+		if (a->type != type || strcasecmp(a->name, name))
 			continue;
-		}
-
-		return r;
+		if (!a->ttl)
+			continue;	/* Saying goodbye, about to be freed */
+		if (!host || (a->rdname && !strcasecmp(a->rdname, host)))
+			break;
 	}
 
 	if (!r) {
@@ -163,115 +190,250 @@ mdns_record_t *record(struct iface *iface, int shared, char *host,
 			r = mdnsd_shared(d, name, type, ttl);
 		else
 			r = mdnsd_unique(d, name, type, ttl, mdnsd_conflict, iface);
-
-		if (host)
-			mdnsd_set_host(d, r, host);
+	} else if (strcmp(mdnsd_record_data(r)->name, name)) {
+		/* Same name, names are shared, spelled as in the .service file */
+		if (mdnsd_set_case(d, r, name))
+			DBG("Keeping %s spelled as %s: %s", name, mdnsd_record_data(r)->name, strerror(errno));
 	}
 
+	/*
+	 * Setting the data keeps an existing record across mdnsd_sweep(),
+	 * here for shared records, by the caller for the rest
+	 */
+	if (host)
+		mdnsd_set_host(d, r, host);
+
 	return r;
 }
 
-static int load(struct iface *iface, char *path, char *hostname)
+static void srec_put(struct conf_srec *srec)
 {
-	mdns_daemon_t *d = iface->mdns;
-	struct conf_srec srec;
-	unsigned char *packet;
-	mdns_record_t *r;
 	size_t i;
-	xht_t *h;
-	char hlocal[256], nlocal[256], tlocal[256];
+
+	if (--srec->refcnt > 0)
+		return;
+
+	free(srec->path);
+	free(srec->type);
+	free(srec->name);
+	free(srec->target);
+	free(srec->cname);
+	for (i = 0; i < srec->txt_num; i++)
+		free(srec->txt[i]);
+	free(srec->rdata);
+	free(srec);
+}
+
+/* Nanoseconds of the mtime, 0 where the system has only seconds */
+static long mtime_ns(const struct stat *st)
+{
+#if defined(HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC)
+	return st->st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC)
+	return st->st_mtimespec.tv_nsec;
+#else
+	(void)st;
+	return 0;
+#endif
+}
+
+/*
+ * Same file as last time: same inode, so not replaced by a rename, and
+ * neither mtime, ctime nor size has changed.  The ctime catches an mtime
+ * set back with touch -r, the nanoseconds an edit in the same second
+ */
+static struct conf_srec *srec_find(struct conf *old, char *path, struct stat *st)
+{
+	size_t i;
+
+	if (!old)
+		return NULL;
+
+	for (i = 0; i < old->num; i++) {
+		struct conf_srec *srec = old->srec[i];
+
+		if (strcmp(srec->path, path))
+			continue;
+		if (srec->dev != st->st_dev || srec->ino != st->st_ino)
+			return NULL;
+		if (srec->mtime != st->st_mtime || srec->mtime_ns != mtime_ns(st))
+			return NULL;
+		if (srec->ctime != st->st_ctime || srec->size != st->st_size)
+			return NULL;
+
+		return srec;
+	}
+
+	return NULL;
+}
+
+static int load(struct conf *conf, struct conf *old, char *path)
+{
+	struct conf_srec *srec, **tmp;
+	struct stat st;
+	unsigned char rdata[NELEMS(srec->txt) * 256];
+	size_t i;
 	int len = 0;
 
-	memset(&srec, 0, sizeof(srec));
-	if (parse(path, &srec)) {
+	tmp = realloc(conf->srec, (conf->num + 1) * sizeof(*tmp));
+	if (!tmp)
+		return 1;
+	conf->srec = tmp;
+
+	if (stat(path, &st)) {
+		ERR("Failed reading %s: %s", path, strerror(errno));
+		return 1;
+	}
+
+	pthread_mutex_lock(&lock);
+	srec = srec_find(old, path, &st);
+	if (srec)
+		srec->refcnt++;
+	pthread_mutex_unlock(&lock);
+	if (srec) {
+		DBG("Skipping %s, unchanged", path);
+		conf->srec[conf->num++] = srec;
+		return 0;
+	}
+
+	srec = calloc(1, sizeof(*srec));
+	if (!srec)
+		return 1;
+	srec->refcnt = 1;
+
+	if (parse(path, srec)) {
 		ERR("Failed reading %s: %s", path, strerror(errno));
+		srec_put(srec);
 		return 1;
 	}
+	srec->path  = strdup(path);
+	srec->dev      = st.st_dev;
+	srec->ino      = st.st_ino;
+	srec->mtime    = st.st_mtime;
+	srec->mtime_ns = mtime_ns(&st);
+	srec->ctime    = st.st_ctime;
+	srec->size     = st.st_size;
+	conf->srec[conf->num++] = srec;
+
+	if (!srec->type)
+		srec->type = strdup("_http._tcp");
+
+	/* In file order, the first of any duplicate keys wins */
+	for (i = 0; i < srec->txt_num; i++) {
+		const char *val;
+		char *ptr;
+		int vlen;
+
+		ptr = strchr(srec->txt[i], '=');
+		if (!ptr)
+			continue;
+		*ptr++ = 0;
+
+		if (sdtxt_find(rdata, len, srec->txt[i], &val, &vlen))
+			continue;
+		if (sdtxt_add(rdata, sizeof(rdata), &len, srec->txt[i], *ptr ? ptr : NULL))
+			WARN("Skipping txt %s in %s, too long", srec->txt[i], path);
+	}
+	if (!len)
+		rdata[len++] = 0;
+
+	srec->rdata = malloc(len);
+	if (!srec->rdata)
+		return 1;
+	memcpy(srec->rdata, rdata, len);
+	srec->rdlen = len;
 
-	if (!srec.name)
-		srec.name = strdup(hostname);
-	if (!srec.type)
-		srec.type = strdup("_http._tcp");
+	return 0;
+}
+
+static void publish(struct iface *iface, struct conf_srec *srec, char *hostname)
+{
+	mdns_daemon_t *d = iface->mdns;
+	char hlocal[256], nlocal[256], tlocal[256];
+	mdns_record_t *r;
+	char *name;
 
-	snprintf(hlocal, sizeof(hlocal), "%s.%s.local.", srec.name, srec.type);
-	snprintf(nlocal, sizeof(nlocal), "%s.local.", srec.name);
-	snprintf(tlocal, sizeof(tlocal), "%s.local.", srec.type);
-	if (!srec.target)
-		srec.target = strdup(hlocal);
+	name = srec->name ? srec->name : hostname;
+	snprintf(hlocal, sizeof(hlocal), "%s.%s.local.", name, srec->type);
+	snprintf(nlocal, sizeof(nlocal), "%s.local.", name);
+	snprintf(tlocal, sizeof(tlocal), "%s.local.", srec->type);
 
 	/* Announce that we have a $type service */
 	record(iface, 1, tlocal, DISCO_NAME, QTYPE_PTR, 120);
-	record(iface, 1, srec.target, tlocal, QTYPE_PTR, 120);
+	record(iface, 1, srec->target ? srec->target : hlocal, tlocal, QTYPE_PTR, 120);
 
 	r = record(iface, 0, NULL, hlocal, QTYPE_SRV, 120);
-	mdnsd_set_srv(d, r, 0, 0, srec.port, nlocal);
+	mdnsd_set_srv(d, r, 0, 0, srec->port, nlocal);
 
 	r = record(iface, 0, NULL, nlocal, QTYPE_A, 120);
 	mdnsd_set_ip(d, r, mdnsd_get_address(d));
 
-	if (srec.cname)
-		record(iface, 1, srec.cname, nlocal, QTYPE_CNAME, 120);
+	if (srec->cname)
+		record(iface, 1, srec->cname, nlocal, QTYPE_CNAME, 120);
+
 	r = record(iface, 0, NULL, hlocal, QTYPE_TXT, 4500);
+	mdnsd_set_raw(d, r, (char *)srec->rdata, srec->rdlen);
+}
 
-	h = xht_new(11);
-	for (i = 0; i < srec.txt_num; i++) {
-		char *ptr;
+static void conf_put(struct conf *conf)
+{
+	size_t i;
 
-		ptr = strchr(srec.txt[i], '=');
-		if (!ptr)
-			continue;
-		*ptr++ = 0;
+	if (!conf)
+		return;
 
-		xht_set(h, srec.txt[i], ptr);
+	pthread_mutex_lock(&lock);
+	if (--conf->refcnt > 0) {
+		pthread_mutex_unlock(&lock);
+		return;
 	}
-	packet = sd2txt(h, &len);
-	xht_free(h);
-	mdnsd_set_raw(d, r, (char *)packet, len);
-	free(packet);
-
-	free(srec.type);
-	free(srec.name);
-	free(srec.target);
-	free(srec.cname);
-	for (i = 0; i < NELEMS(srec.txt); i++)
-		free(srec.txt[i]);
 
-	return 0;
+	/* Under lock, srecs are shared with the next conf */
+	for (i = 0; i < conf->num; i++)
+		srec_put(conf->srec[i]);
+	pthread_mutex_unlock(&lock);
+
+	free(conf->srec);
+	free(conf);
 }
 
-int conf_init(struct iface *iface, char *path)
+static struct conf *conf_get(void)
 {
-	char hostname[HOST_NAME_MAX];
-	int hostid = iface->hostid;
-	struct stat st;
-	int rc = 0;
+	struct conf *conf;
 
-	/* apparently gethostname() can fail ... */
-	if (gethostname(hostname, sizeof(hostname)) == -1)
-		strlcpy(hostname, "default", sizeof(hostname));
+	pthread_mutex_lock(&lock);
+	conf = current;
+	if (conf)
+		conf->refcnt++;
+	pthread_mutex_unlock(&lock);
 
-	/* uniqify hostname by appending -hostid, e.g., default-2 */
-	if (hostid > 1) {
-		size_t hlen, slen;
-		char suffix[16];
+	return conf;
+}
 
-		slen = snprintf(suffix, sizeof(suffix), "-%d", hostid) + 1;
-		hlen = strlen(hostname);
-		if (hlen + slen >= sizeof(hostname))
-			hlen = sizeof(hostname) - slen;
+/*
+ * Read all .service files in path, or just path if it is a file, and
+ * make them the services published by conf_init() from now on.
+ */
+int conf_load(char *path)
+{
+	struct conf *conf, *old;
+	struct stat st;
 
-		strlcpy(&hostname[hlen], suffix, sizeof(hostname) - hlen);
-	}
+	conf = calloc(1, sizeof(*conf));
+	if (!conf)
+		return 1;
+	conf->refcnt = 1;
+
+	/* Only conf_load() replaces current, safe to use without a ref */
+	old = current;
 
 	if (stat(path, &st)) {
 		if (ENOENT == errno)
 			ERR("Services directory %s, missing or unconfigured.", path);
 		else
 			ERR("Cannot determine path type: %s", strerror(errno));
-		return 1;
-	}
-
-	if (S_ISDIR(st.st_mode)) {
+		conf->rc = 1;
+	} else if (S_ISDIR(st.st_mode)) {
 		glob_t gl;
 		size_t i;
 		char pat[strlen(path) + 64];
@@ -300,16 +462,90 @@ int conf_init(struct iface *iface, char *path)
 
 		if (glob(pat, flags, NULL, &gl)) {
 			ERR("No .service files found in %s", pat);
-			return 1;
+			conf->rc = 1;
+		} else {
+			for (i = 0; i < gl.gl_pathc; i++)
+				conf->rc |= load(conf, old, gl.gl_pathv[i]);
+
+			globfree(&gl);
 		}
+	} else
+		conf->rc |= load(conf, old, path);
 
-		for (i = 0; i < gl.gl_pathc; i++)
-			rc |= load(iface, gl.gl_pathv[i], hostname);
+	pthread_mutex_lock(&lock);
+	current = conf;
+	pthread_mutex_unlock(&lock);
+	conf_put(old);
 
-		globfree(&gl);
-	} else
-		rc |= load(iface, path, hostname);
+	return conf->rc;
+}
 
-	return rc;
+void conf_exit(void)
+{
+	struct conf *conf;
+
+	pthread_mutex_lock(&lock);
+	conf = current;
+	current = NULL;
+	pthread_mutex_unlock(&lock);
+
+	conf_put(conf);
 }
 
+/*
+ * Publish services from last conf_load(), loads path the first time.
+ * Also used to republish after a reload, records no longer in any of
+ * the services are retired.
+ */
+int conf_init(struct iface *iface, char *path)
+{
+	char hostname[HOST_NAME_MAX];
+	int hostid = iface->hostid;
+	struct conf *conf;
+	size_t i;
+	int rc;
+
+	/* Next conflict picks the next hostid, see mdnsd_conflict() */
+	iface->conflict = 0;
+
+	/* apparently gethostname() can fail ... */
+	if (gethostname(hostname, sizeof(hostname)) == -1)
+		strlcpy(hostname, "default", sizeof(hostname));
+
+	/* uniqify hostname by appending -hostid, e.g., default-2 */
+	if (hostid > 1) {
+		size_t hlen, slen;
+		char suffix[16];
+
+		slen = snprintf(suffix, sizeof(suffix), "-%d", hostid) + 1;
+		hlen = strlen(hostname);
+		if (hlen + slen >= sizeof(hostname))
+			hlen = sizeof(hostname) - slen;
+
+		strlcpy(&hostname[hlen], suffix, sizeof(hostname) - hlen);
+	}
+
+	conf = conf_get();
+	if (!conf) {
+		conf_load(path);
+		conf = conf_get();
+		if (!conf)
+			return 1;
+	}
+
+	/*
+	 * Unchanged records are left as-is, only diffs go out on the wire,
+	 * all in one batch of probes and announcements
+	 */
+	mdnsd_begin(iface->mdns);
+	mdnsd_mark(iface->mdns);
+	for (i = 0; i < conf->num; i++)
+		publish(iface, conf->srec[i], hostname);
+	mdnsd_sweep(iface->mdns);
+	mdnsd_commit(iface->mdns);
+
+	rc = conf->rc;
+	conf_put(conf);
+
+	return rc;
+}
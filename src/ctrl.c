@@ -0,0 +1,553 @@
+/*
+ * Copyright (c) 2022  Joachim Wiberg <troglobit@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Control socket, lets local clients like mquery look up records in
+ * the cache of all interfaces, or subscribe to answers, instead of
+ * querying the network themselves.  See ctrl.h for the protocol.
+ *
+ * Clients are served by the main thread.  In worker mode the daemon
+ * of each interface belongs to a worker, so all access to it is done
+ * with the workers locked.  Answers to subscriptions are delivered by
+ * whichever thread steps the interface, hence the lock for clients.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "mdnsd.h"
+#include "ctrl.h"
+
+struct client {
+	TAILQ_ENTRY(client) link;
+	int                 sd;
+	int                 dead;		/* Shut down by reply()      */
+	size_t              len;
+	char                buf[CTRL_LINE_MAX];
+};
+
+struct sub {
+	TAILQ_ENTRY(sub)    link;
+	struct client      *client;
+	int                 type;
+	char                name[256];
+};
+
+static TAILQ_HEAD(, client) clients = TAILQ_HEAD_INITIALIZER(clients);
+static TAILQ_HEAD(, sub)    subs    = TAILQ_HEAD_INITIALIZER(subs);
+static pthread_mutex_t      lock    = PTHREAD_MUTEX_INITIALIZER;
+
+static char *ctrl_path;
+static int   ctrl_sd = -1;
+
+
+/* Escape as in zone files, dst must fit 4 * len + 1 */
+static char *esc(char *dst, const unsigned char *src, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (src[i] > ' ' && src[i] < 127 && src[i] != '\\')
+			*dst++ = src[i];
+		else
+			dst += sprintf(dst, "\\%03u", src[i]);
+	}
+	*dst = 0;
+
+	return dst;
+}
+
+/* One answer line, see ctrl.h, caller frees */
+static char *format(struct iface *iface, mdns_answer_t *a, size_t *len)
+{
+	long ttl = 0;
+	char *line, *p;
+	size_t i, max;
+
+	if (a->ttl)
+		ttl = (long)a->ttl - (long)time(NULL);
+	if (ttl < 0)
+		ttl = 0;
+
+	max = IFNAMSIZ + 32 + 4 * strlen(a->name) + 4 * a->rdlen + 64;
+	if (a->rdname)
+		max += 4 * strlen(a->rdname);
+
+	line = malloc(max);
+	if (!line)
+		return NULL;
+
+	p = line + sprintf(line, "%s %d %ld ", iface->ifname, a->type, ttl);
+	p = esc(p, (unsigned char *)a->name, strlen(a->name));
+	*p++ = ' ';
+
+	switch (a->type) {
+	case QTYPE_A:
+		p += sprintf(p, "%s", inet_ntoa(a->ip));
+		break;
+
+	case QTYPE_SRV:
+		p += sprintf(p, "%d %d %d ", a->srv.priority, a->srv.weight, a->srv.port);
+		/* fallthrough */
+	case QTYPE_NS:
+	case QTYPE_CNAME:
+	case QTYPE_PTR:
+		if (a->rdname)
+			p = esc(p, (unsigned char *)a->rdname, strlen(a->rdname));
+		break;
+
+	case QTYPE_TXT:
+		for (i = 0; i < a->rdlen; i += a->rdata[i] + 1) {
+			size_t n = a->rdata[i];
+
+			if (i + 1 + n > a->rdlen)
+				break;
+			if (i)
+				*p++ = ' ';
+			p = esc(p, &a->rdata[i + 1], n);
+		}
+		break;
+
+	default:
+		p += sprintf(p, "\\# %d ", a->rdlen);
+		for (i = 0; i < a->rdlen; i++)
+			p += sprintf(p, "%02x", a->rdata[i]);
+		break;
+	}
+
+	*p++ = '\n';
+	*len = p - line;
+
+	return line;
+}
+
+/* Never blocks, a client that does not keep up is disconnected */
+static void reply(struct client *c, const char *line, size_t len)
+{
+	if (c->dead)
+		return;
+
+	if (send(c->sd, line, len, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t)len)
+		return;
+
+	/* Wakes up the main thread, which reaps the client */
+	shutdown(c->sd, SHUT_RDWR);
+	c->dead = 1;
+}
+
+static int type_match(int want, int type)
+{
+	return want == QTYPE_ANY || want == type;
+}
+
+/* Answer callback from mdnsd_query(), for all subscribers */
+static int answer(mdns_answer_t *a, void *arg)
+{
+	struct iface *iface = (struct iface *)arg;
+	char *line = NULL;
+	struct sub *s;
+	size_t len;
+
+	pthread_mutex_lock(&lock);
+	TAILQ_FOREACH(s, &subs, link) {
+		if (!type_match(s->type, a->type) || strcasecmp(s->name, a->name))
+			continue;
+
+		if (!line)
+			line = format(iface, a, &len);
+		if (line)
+			reply(s->client, line, len);
+	}
+	pthread_mutex_unlock(&lock);
+	free(line);
+
+	return 0;
+}
+
+/* Start query for s on iface, called with workers locked */
+static void query(struct iface *iface, struct sub *s)
+{
+	if (!iface->mdns || iface->unused)
+		return;
+
+	mdnsd_query(iface->mdns, s->name, s->type, answer, iface);
+
+	/* Send the question right away */
+	if (worker_enabled())
+		worker_post(iface, WORK_STEP);
+	else
+		timer_set(&iface->timer, timer_now());
+}
+
+/* Stop query, unless other subscribers want the same answers */
+static void unsubscribe(struct sub *s)
+{
+	struct iface *iface;
+	struct sub *n;
+
+	TAILQ_REMOVE(&subs, s, link);
+	TAILQ_FOREACH(n, &subs, link) {
+		if (n->type == s->type && !strcasecmp(n->name, s->name))
+			break;
+	}
+
+	if (!n) {
+		for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
+			if (iface->mdns)
+				mdnsd_query(iface->mdns, s->name, s->type, NULL, NULL);
+		}
+	}
+
+	free(s);
+}
+
+static void list(struct client *c, int type, const char *name)
+{
+	struct iface *iface;
+
+	for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
+		mdns_answer_t *a = NULL;
+
+		if (!iface->mdns)
+			continue;
+
+		while ((a = mdnsd_list(iface->mdns, name, type, a))) {
+			char *line;
+			size_t len;
+
+			/* Expired, or flushed, waiting to be reaped */
+			if (a->ttl <= (unsigned long)time(NULL))
+				continue;
+
+			line = format(iface, a, &len);
+			if (!line)
+				continue;
+			reply(c, line, len);
+			free(line);
+		}
+	}
+}
+
+static void counter(struct client *c, struct iface *iface, const char *key, unsigned long long val)
+{
+	char line[IFNAMSIZ + 64];
+	int len;
+
+	len = snprintf(line, sizeof(line), "%s %s %llu\n", iface->ifname, key, val);
+	reply(c, line, len);
+}
+
+static void histogram(struct client *c, struct iface *iface, const char *key, unsigned long long *h)
+{
+	char line[IFNAMSIZ + 32 + MDNSD_HIST * 21];
+	int i, len;
+
+	len = snprintf(line, sizeof(line), "%s %s", iface->ifname, key);
+	for (i = 0; i < MDNSD_HIST; i++)
+		len += snprintf(line + len, sizeof(line) - len, " %llu", h[i]);
+	line[len++] = '\n';
+	reply(c, line, len);
+}
+
+/* Counters of the daemon on each iface, see ctrl.h */
+static void stats(struct client *c)
+{
+	struct iface *iface;
+
+	for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
+		struct mdnsd_cache_stats cs;
+		struct mdnsd_stats st;
+		char line[IFNAMSIZ + 64];
+		int len;
+
+		if (!iface->mdns)
+			continue;
+
+		mdnsd_stats(iface->mdns, &st);
+		mdnsd_cache_stats(iface->mdns, &cs);
+
+		counter(c, iface, "pkts_in",        st.pkts_in);
+		counter(c, iface, "bytes_in",       st.bytes_in);
+		counter(c, iface, "dropped",        st.dropped);
+		counter(c, iface, "parse_err",      st.parse_err);
+		counter(c, iface, "queries_in",     st.queries_in);
+		counter(c, iface, "answers_in",     st.answers_in);
+		counter(c, iface, "pkts_out",       st.pkts_out);
+		counter(c, iface, "bytes_out",      st.bytes_out);
+		counter(c, iface, "multicast_out",  st.multicast_out);
+		counter(c, iface, "unicast_out",    st.unicast_out);
+		counter(c, iface, "send_err",       st.send_err);
+		counter(c, iface, "conflicts",      st.conflicts);
+		counter(c, iface, "rate_limited",   st.rate_limited);
+		counter(c, iface, "suppressed",     st.suppressed);
+		counter(c, iface, "held",           st.held);
+		counter(c, iface, "cache_entries",  cs.entries);
+		counter(c, iface, "cache_bytes",    cs.bytes);
+		counter(c, iface, "cache_names",    cs.names);
+		counter(c, iface, "cache_slots",    cs.slots);
+		counter(c, iface, "cache_probe_max", cs.probe_max);
+		len = snprintf(line, sizeof(line), "%s cache_probe_avg %.2f\n", iface->ifname, cs.probe_avg);
+		reply(c, line, len);
+		counter(c, iface, "cache_inserts",  st.cache_inserts);
+		counter(c, iface, "cache_refresh",  st.cache_refresh);
+		counter(c, iface, "cache_removals", st.cache_removals);
+		counter(c, iface, "cache_evictions", st.cache_evictions);
+		counter(c, iface, "cache_full",     st.cache_full);
+		counter(c, iface, "publish_chain",  st.publish_chain);
+		counter(c, iface, "query_chain",    st.query_chain);
+		histogram(c, iface, "in_usec",      st.in_usec);
+		histogram(c, iface, "out_usec",     st.out_usec);
+		histogram(c, iface, "sleep_msec",   st.sleep_msec);
+	}
+}
+
+static void request(struct client *c, char *line)
+{
+	struct iface *iface;
+	char *cmd, *arg, *end;
+	struct sub *s;
+	long type;
+
+	cmd = strsep(&line, " ");
+	arg = strsep(&line, " ");
+	if (!strcmp(cmd, "STATS") && !arg) {
+		stats(c);
+		reply(c, "\n", 1);
+		return;
+	}
+
+	if (!arg || !line || !line[0])
+		goto error;
+
+	type = strtol(arg, &end, 10);
+	if (*end || type < 1 || type > 65535)
+		goto error;
+
+	if (!strcmp(cmd, "LIST")) {
+		list(c, type, line);
+		reply(c, "\n", 1);
+		return;
+	}
+
+	if (!strcmp(cmd, "QUERY")) {
+		TAILQ_FOREACH(s, &subs, link) {
+			if (s->client == c && s->type == type && !strcasecmp(s->name, line))
+				break;
+		}
+		if (s) {
+			/* Already subscribed, e.g., browsing */
+			reply(c, "\n", 1);
+			return;
+		}
+
+		s = calloc(1, sizeof(*s));
+		if (!s)
+			goto error;
+
+		s->client = c;
+		s->type = type;
+		strlcpy(s->name, line, sizeof(s->name));
+		TAILQ_INSERT_TAIL(&subs, s, link);
+
+		for (iface = iface_iterator(1); iface; iface = iface_iterator(0))
+			query(iface, s);
+
+		list(c, type, s->name);
+		reply(c, "\n", 1);
+		return;
+	}
+
+error:
+	reply(c, "ERR invalid request\n\n", 21);
+}
+
+static void client_close(struct client *c)
+{
+	struct sub *s, *tmp;
+
+	TAILQ_FOREACH_SAFE(s, &subs, link, tmp) {
+		if (s->client == c)
+			unsubscribe(s);
+	}
+
+	TAILQ_REMOVE(&clients, c, link);
+	event_del(c->sd);
+	close(c->sd);
+	free(c);
+}
+
+/* Read and handle requests, returns non-zero when c is gone */
+static int client_read(struct client *c)
+{
+	char *nl;
+	ssize_t len;
+
+	len = read(c->sd, c->buf + c->len, sizeof(c->buf) - c->len - 1);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (len <= 0)
+		return 1;
+
+	c->len += len;
+	c->buf[c->len] = 0;
+	while ((nl = strchr(c->buf, '\n'))) {
+		*nl = 0;
+		if (nl > c->buf && nl[-1] == '\r')
+			nl[-1] = 0;
+		if (c->buf[0])
+			request(c, c->buf);
+
+		c->len -= nl + 1 - c->buf;
+		memmove(c->buf, nl + 1, c->len + 1);
+	}
+
+	/* Request too long */
+	if (c->len >= sizeof(c->buf) - 1)
+		return 1;
+
+	return c->dead;
+}
+
+static void client_accept(void)
+{
+	struct client *c;
+	int sd;
+
+	while ((sd = accept4(ctrl_sd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		c = calloc(1, sizeof(*c));
+		if (!c || event_add(sd, c)) {
+			ERR("Failed adding control client: %s", strerror(errno));
+			free(c);
+			close(sd);
+			continue;
+		}
+
+		c->sd = sd;
+		TAILQ_INSERT_TAIL(&clients, c, link);
+	}
+}
+
+/*
+ * Called by the main loop for each ready socket, returns non-zero if
+ * it belongs to the control socket or one of its clients.
+ */
+int ctrl_event(void *arg)
+{
+	struct client *c;
+
+	if (arg == &ctrl_sd) {
+		pthread_mutex_lock(&lock);
+		client_accept();
+		pthread_mutex_unlock(&lock);
+		return 1;
+	}
+
+	TAILQ_FOREACH(c, &clients, link) {
+		if (c == arg)
+			break;
+	}
+	if (!c)
+		return 0;
+
+	worker_lock();
+	pthread_mutex_lock(&lock);
+	if (c->dead || client_read(c))
+		client_close(c);
+	pthread_mutex_unlock(&lock);
+	worker_unlock();
+
+	return 1;
+}
+
+/* New daemon for iface, start all subscribed queries on it */
+void ctrl_iface(struct iface *iface)
+{
+	struct sub *s;
+
+	pthread_mutex_lock(&lock);
+	TAILQ_FOREACH(s, &subs, link) {
+		if (iface->mdns)
+			mdnsd_query(iface->mdns, s->name, s->type, answer, iface);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+int ctrl_init(char *path)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	int sd;
+
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sd < 0)
+		return -1;
+
+	unlink(path);
+	if (bind(sd, (struct sockaddr *)&sun, sizeof(sun)) || listen(sd, 16)) {
+		close(sd);
+		return -1;
+	}
+
+	if (event_add(sd, &ctrl_sd)) {
+		close(sd);
+		unlink(path);
+		return -1;
+	}
+
+	ctrl_path = path;
+	ctrl_sd = sd;
+
+	return 0;
+}
+
+void ctrl_exit(void)
+{
+	struct client *c, *tmp;
+
+	TAILQ_FOREACH_SAFE(c, &clients, link, tmp)
+		client_close(c);
+
+	if (ctrl_sd < 0)
+		return;
+
+	close(ctrl_sd);
+	unlink(ctrl_path);
+	ctrl_sd = -1;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2022  Joachim Wiberg <troglobit@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Control socket protocol, shared by mdnsd and mquery
+ *
+ * Line based text over a Unix stream socket, one request per line:
+ *
+ *     LIST TYPE NAME       Answers for NAME in the cache of all ifaces
+ *     QUERY TYPE NAME      Same, then query the network and stream any
+ *                          new answers until the client disconnects
+ *     STATS                Counters of all ifaces, see below
+ *
+ * TYPE is numeric, 255 for any, and NAME is the rest of the line.  Each
+ * answer is sent as one line:
+ *
+ *     IFACE TYPE TTL NAME DATA
+ *
+ * TTL is seconds left, 0 is a goodbye.  NAME and all names and strings
+ * in DATA are escaped as in zone files, RFC 1035: space, backslash and
+ * anything not printable as \DDD.  DATA depends on TYPE:
+ *
+ *     A                    192.0.2.1
+ *     PTR, NS, CNAME       name
+ *     SRV                  priority weight port target
+ *     TXT                  string ...
+ *     other                \# rdlen hex, as in RFC 3597
+ *
+ * An empty line ends the cached answers.  Errors are a single line
+ * starting with ERR, followed by an empty line.
+ *
+ * STATS replies with one line per counter and iface, ending with an
+ * empty line, see struct mdnsd_stats for what they count:
+ *
+ *     IFACE KEY VALUE      e.g., eth0 pkts_in 4711
+ *     IFACE KEY N0 N1 ...  Histogram, MDNSD_HIST buckets, powers of 2
+ */
+#ifndef MDNSD_CTRL_H_
+#define MDNSD_CTRL_H_
+
+#define CTRL_SOCKET   _PIDFILEDIR "/mdnsd.sock"
+#define CTRL_LINE_MAX 1024			/* Max length of a request */
+
+#endif /* MDNSD_CTRL_H_ */
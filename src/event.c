@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2022  Joachim Wiberg <troglobit@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Socket event loop and timer queue for mdnsd
+ *
+ * Each interface socket is registered once, with epoll on Linux and
+ * kqueue on the BSDs, and only ready sockets are returned.  Systems
+ * with neither fall back to select(), which rebuilds its fd_set on
+ * every call and is limited to FD_SETSIZE.
+ *
+ * Timers are kept in a min-heap, ordered by deadline, so finding the
+ * next one to run does not depend on the number of interfaces.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mdnsd.h"
+
+#if defined(HAVE_EPOLL_CREATE1)
+#include <sys/epoll.h>
+#elif defined(HAVE_KQUEUE)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#else
+#include <sys/select.h>
+#endif
+
+#define EVENT_MAX 64
+
+static __thread int evfd = -1;
+
+#if !defined(HAVE_EPOLL_CREATE1) && !defined(HAVE_KQUEUE)
+static __thread struct {
+	int   sd;
+	void *arg;
+} evlist[FD_SETSIZE];
+static __thread int evnum;
+#endif
+
+/* Per thread, each worker has its own event loop */
+static __thread struct timer **timers;
+static __thread size_t tlen, tmax;
+
+int event_init(void)
+{
+#if defined(HAVE_EPOLL_CREATE1)
+	evfd = epoll_create1(EPOLL_CLOEXEC);
+#elif defined(HAVE_KQUEUE)
+	evfd = kqueue();
+#else
+	evfd = 0;
+#endif
+
+	return evfd < 0 ? -1 : 0;
+}
+
+void event_exit(void)
+{
+#if defined(HAVE_EPOLL_CREATE1) || defined(HAVE_KQUEUE)
+	if (evfd >= 0)
+		close(evfd);
+#endif
+	evfd = -1;
+
+	free(timers);
+	timers = NULL;
+	tlen = tmax = 0;
+}
+
+int event_add(int sd, void *arg)
+{
+#if defined(HAVE_EPOLL_CREATE1)
+	struct epoll_event ev = { 0 };
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = arg;
+
+	return epoll_ctl(evfd, EPOLL_CTL_ADD, sd, &ev);
+#elif defined(HAVE_KQUEUE)
+	struct kevent ev;
+
+	EV_SET(&ev, sd, EVFILT_READ, EV_ADD, 0, 0, arg);
+
+	return kevent(evfd, &ev, 1, NULL, 0, NULL);
+#else
+	if (sd >= FD_SETSIZE || evnum >= FD_SETSIZE) {
+		errno = EMFILE;
+		return -1;
+	}
+
+	evlist[evnum].sd  = sd;
+	evlist[evnum].arg = arg;
+	evnum++;
+
+	return 0;
+#endif
+}
+
+void event_del(int sd)
+{
+#if defined(HAVE_EPOLL_CREATE1)
+	epoll_ctl(evfd, EPOLL_CTL_DEL, sd, NULL);
+#elif defined(HAVE_KQUEUE)
+	struct kevent ev;
+
+	EV_SET(&ev, sd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	kevent(evfd, &ev, 1, NULL, 0, NULL);
+#else
+	int i;
+
+	for (i = 0; i < evnum; i++) {
+		if (evlist[i].sd != sd)
+			continue;
+
+		evlist[i] = evlist[--evnum];
+		break;
+	}
+#endif
+}
+
+/*
+ * Wait at most msec for any registered socket to become readable, the
+ * arg of each ready socket is stored in ready[].  Returns the number
+ * of ready sockets, or -1 on error (EINTR on signal).
+ */
+int event_wait(void **ready, int max, int msec)
+{
+#if defined(HAVE_EPOLL_CREATE1)
+	struct epoll_event ev[EVENT_MAX];
+	int i, num;
+
+	if (max > EVENT_MAX)
+		max = EVENT_MAX;
+
+	num = epoll_wait(evfd, ev, max, msec);
+	for (i = 0; i < num; i++)
+		ready[i] = ev[i].data.ptr;
+
+	return num;
+#elif defined(HAVE_KQUEUE)
+	struct timespec ts = { msec / 1000, (msec % 1000) * 1000000 };
+	struct kevent ev[EVENT_MAX];
+	int i, num;
+
+	if (max > EVENT_MAX)
+		max = EVENT_MAX;
+
+	num = kevent(evfd, NULL, 0, ev, max, msec < 0 ? NULL : &ts);
+	for (i = 0; i < num; i++)
+		ready[i] = ev[i].udata;
+
+	return num;
+#else
+	struct timeval tv = { msec / 1000, (msec % 1000) * 1000 };
+	int i, rc, nfds = 0, num = 0;
+	fd_set fds;
+
+	FD_ZERO(&fds);
+	for (i = 0; i < evnum; i++) {
+		FD_SET(evlist[i].sd, &fds);
+		if (evlist[i].sd >= nfds)
+			nfds = evlist[i].sd + 1;
+	}
+
+	rc = select(nfds, &fds, NULL, NULL, msec < 0 ? NULL : &tv);
+	if (rc <= 0)
+		return rc;
+
+	for (i = 0; i < evnum && num < max; i++) {
+		if (FD_ISSET(evlist[i].sd, &fds))
+			ready[num++] = evlist[i].arg;
+	}
+
+	return num;
+#endif
+}
+
+/* Monotonic time in msec, used for all timer deadlines */
+unsigned long long timer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void timer_swap(size_t a, size_t b)
+{
+	struct timer *t = timers[a - 1];
+
+	timers[a - 1] = timers[b - 1];
+	timers[b - 1] = t;
+	timers[a - 1]->pos = a;
+	timers[b - 1]->pos = b;
+}
+
+static void timer_up(size_t i)
+{
+	while (i > 1 && timers[i / 2 - 1]->when > timers[i - 1]->when) {
+		timer_swap(i, i / 2);
+		i /= 2;
+	}
+}
+
+static void timer_down(size_t i)
+{
+	while (2 * i <= tlen) {
+		size_t c = 2 * i;
+
+		if (c < tlen && timers[c]->when < timers[c - 1]->when)
+			c++;
+		if (timers[i - 1]->when <= timers[c - 1]->when)
+			break;
+
+		timer_swap(i, c);
+		i = c;
+	}
+}
+
+/* Schedule, or reschedule, timer at absolute deadline in msec */
+int timer_set(struct timer *t, unsigned long long when)
+{
+	if (!t->pos) {
+		if (tlen == tmax) {
+			size_t num = tmax ? tmax * 2 : 16;
+			struct timer **tmp;
+
+			tmp = realloc(timers, num * sizeof(*timers));
+			if (!tmp)
+				return -1;
+
+			timers = tmp;
+			tmax = num;
+		}
+
+		timers[tlen++] = t;
+		t->pos = tlen;
+		t->when = when;
+		timer_up(t->pos);
+
+		return 0;
+	}
+
+	t->when = when;
+	timer_up(t->pos);
+	timer_down(t->pos);
+
+	return 0;
+}
+
+void timer_del(struct timer *t)
+{
+	size_t i = t->pos;
+
+	if (!i)
+		return;
+
+	t->pos = 0;
+	if (i != tlen) {
+		timers[i - 1] = timers[tlen - 1];
+		timers[i - 1]->pos = i;
+		tlen--;
+		timer_up(i);
+		timer_down(i);
+	} else
+		tlen--;
+}
+
+/* Msec until next timer, 0 if one has already expired, -1 if none */
+int timer_next(unsigned long long now)
+{
+	if (!tlen)
+		return -1;
+	if (timers[0]->when <= now)
+		return 0;
+
+	return (int)(timers[0]->when - now);
+}
+
+/* Remove and return the first expired timer, or NULL */
+struct timer *timer_expired(unsigned long long now)
+{
+	struct timer *t;
+
+	if (!tlen || timers[0]->when > now)
+		return NULL;
+
+	t = timers[0];
+	timer_del(t);
+
+	return t;
+}
@@ -34,6 +34,7 @@
 #include <netinet/in.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
@@ -43,19 +44,35 @@
 
 #include "config.h"
 #include "mdnsd.h"
+#include "ctrl.h"
 
 #define SYS_INTERVAL 10		/* System inteface poll interval */
+#define CACHE_INTERVAL 300	/* Cache snapshot interval, with -c */
+#define CACHE_MAX      1024	/* kB of cache per interface, -m KB */
+#define TRACE_EVENTS   4096	/* Kept in trace ring, saved on SIGUSR1 */
+#define TRACE_FILE     _PIDFILEDIR "/mdnsd.trace"
 
 volatile sig_atomic_t running = 1;
 volatile sig_atomic_t reload = 0;
+volatile sig_atomic_t dump = 0;
 char *prognm      = PACKAGE_NAME;
 char *ifname      = NULL;
 char *path        = NULL;
 int   background  = 1;
 int   logging     = 1;
+int   debug       = 0;
 int   ttl         = 255;
+int   workers     = 0;
+int   shared      = 0;
+char *cachedir    = NULL;
+long  cachemax    = CACHE_MAX;
+char *sockpath    = CTRL_SOCKET;
+
+static int monitor = -1;
+static int shared_sd = -1;
 
 static int multicast_socket(struct iface *iface, unsigned char ttl);
+static int multicast_join(int sd, struct iface *iface, int join);
 
 
 void mdnsd_conflict(char *name, int type, void *arg)
@@ -63,64 +80,139 @@ void mdnsd_conflict(char *name, int type, void *arg)
 	struct iface *iface = (struct iface *)arg;
 
 	WARN("%s: conlicting name detected %s for type %d, reloading config ...", iface->ifname, name, type);
-	if (!reload) {
+
+	/*
+	 * Called with iface locked, by its worker or main.  Other records
+	 * of the same name conflict too, one bump until conf_init()
+	 */
+	if (!iface->conflict) {
+		iface->conflict = 1;
 		iface->hostid++;
-		reload = 1;
 	}
+
+	/* Only main touches reload, a worker tells it with a SIGHUP */
+	if (worker_enabled())
+		kill(getpid(), SIGHUP);
+	else
+		reload = 1;
 }
 
-static void record_received(const struct resource *r, void *data)
+static void record_received(const struct resource *rr, int num, void *data)
 {
 	char ipinput[INET_ADDRSTRLEN];
+	const char *key, *val;
+	int klen, vlen, pos;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		const struct resource *r = &rr[i];
+
+		pos = 0;
+		switch(r->type) {
+		case QTYPE_A:
+			inet_ntop(AF_INET, &(r->known.a.ip), ipinput, INET_ADDRSTRLEN);
+			DBG("Got %s: A %s->%s", r->name, r->known.a.name, ipinput);
+			break;
+
+		case QTYPE_NS:
+			DBG("Got %s: NS %s", r->name, r->known.ns.name);
+			break;
+
+		case QTYPE_CNAME:
+			DBG("Got %s: CNAME %s", r->name, r->known.cname.name);
+			break;
+
+		case QTYPE_PTR:
+			DBG("Got %s: PTR %s", r->name, r->known.ptr.name);
+			break;
+
+		case QTYPE_TXT:
+			while (sdtxt_next(r->rdata, r->rdlength, &pos, &key, &klen, &val, &vlen)) {
+				if (val)
+					DBG("Got %s: TXT %.*s=%.*s", r->name, klen, key, vlen, val);
+				else
+					DBG("Got %s: TXT %.*s", r->name, klen, key);
+			}
+			break;
+
+		case QTYPE_SRV:
+			DBG("Got %s: SRV %d %d %d %s", r->name, r->known.srv.priority,
+			    r->known.srv.weight, r->known.srv.port, r->known.srv.name);
+			break;
+
+		default:
+			DBG("Got %s: unknown", r->name);
 
-	switch(r->type) {
-	case QTYPE_A:
-		inet_ntop(AF_INET, &(r->known.a.ip), ipinput, INET_ADDRSTRLEN);
-		DBG("Got %s: A %s->%s", r->name, r->known.a.name, ipinput);
-		break;
+		}
+	}
+}
 
-	case QTYPE_NS:
-		DBG("Got %s: NS %s", r->name, r->known.ns.name);
-		break;
+static int cache_file(struct iface *iface, char *file, size_t len)
+{
+	if (!cachedir)
+		return 1;
 
-	case QTYPE_CNAME:
-		DBG("Got %s: CNAME %s", r->name, r->known.cname.name);
-		break;
+	return snprintf(file, len, "%s/%s.cache", cachedir, iface->ifname) >= (int)len;
+}
 
-	case QTYPE_PTR:
-		DBG("Got %s: PTR %s", r->name, r->known.ptr.name);
-		break;
+/* Snapshot cache of iface, with -c, for warm restarts */
+void save_iface(struct iface *iface)
+{
+	char file[PATH_MAX];
 
-	case QTYPE_TXT:
-		DBG("Got %s: TXT %s", r->name, r->rdata);
-		break;
+	if (!iface->mdns || cache_file(iface, file, sizeof(file)))
+		return;
 
-	case QTYPE_SRV:
-		DBG("Got %s: SRV %d %d %d %s", r->name, r->known.srv.priority,
-		    r->known.srv.weight, r->known.srv.port, r->known.srv.name);
-		break;
+	if (mdnsd_cache_save(iface->mdns, file))
+		WARN("%s: failed saving cache to %s: %s", iface->ifname, file, strerror(errno));
+}
 
-	default:
-		DBG("Got %s: unknown", r->name);
+static void load_iface(struct iface *iface)
+{
+	char file[PATH_MAX];
+	int num;
+
+	if (cache_file(iface, file, sizeof(file)))
+		return;
 
+	num = mdnsd_cache_load(iface->mdns, file);
+	if (num < 0) {
+		if (errno != ENOENT)
+			WARN("%s: failed loading cache from %s: %s", iface->ifname, file, strerror(errno));
+		return;
 	}
+
+	INFO("%s: loaded %d cached records from %s", iface->ifname, num, file);
 }
 
-static void free_iface(struct iface *iface)
+void free_iface(struct iface *iface)
 {
-	mdnsd_shutdown(iface->mdns);
-	mdnsd_free(iface->mdns);
-	if (iface->sd >= 0)
-		close(iface->sd);
+	timer_del(&iface->timer);
+	if (iface->mdns) {
+		save_iface(iface);
+		mdnsd_shutdown(iface->mdns);
+		mdnsd_free(iface->mdns);
+		iface->mdns = NULL;
+	}
+	if (iface->sd >= 0) {
+		if (iface->sd == shared_sd) {
+			multicast_join(shared_sd, iface, 0);
+		} else {
+			event_del(iface->sd);
+			close(iface->sd);
+		}
+		iface->sd = -1;
+	}
 }
 
-static void setup_iface(struct iface *iface)
+void setup_iface(struct iface *iface)
 {
 	if (!iface->changed)
 		return;
 
 	if (iface->unused) {
 		free_iface(iface);
+		iface->changed = 0;
 		return;
 	}
 
@@ -130,9 +222,22 @@ static void setup_iface(struct iface *iface)
 			ERR("Failed creating mDNS context for iface %s: %s", iface->ifname, strerror(errno));
 			exit(1);
 		}
+		mdnsd_set_cache_limit(iface->mdns, (size_t)cachemax * 1024, 0);
 
+		load_iface(iface);
 		conf_init(iface, path);
-		mdnsd_register_receive_callback(iface->mdns, record_received, NULL);
+		ctrl_iface(iface);
+
+		/* Only for logging, lets libmdnsd drop packets not for us */
+		if (debug)
+			mdnsd_subscribe_batch(iface->mdns, NULL, QTYPE_ANY, record_received, NULL);
+	}
+
+	if (iface->sd < 0 && shared) {
+		multicast_join(shared_sd, iface, 1);
+		mdnsd_set_ifindex(iface->mdns, iface->ifindex);
+		iface->sd = shared_sd;
+		iface->timer.arg = iface;
 	}
 
 	if (iface->sd < 0) {
@@ -141,6 +246,12 @@ static void setup_iface(struct iface *iface)
 			ERR("Failed creating socket: %s", strerror(errno));
 			exit(1);
 		}
+
+		if (event_add(iface->sd, iface)) {
+			ERR("Failed adding socket to event loop: %s", strerror(errno));
+			exit(1);
+		}
+		iface->timer.arg = iface;
 	}
 
 	mdnsd_set_address(iface->mdns, iface->inaddr);
@@ -166,15 +277,163 @@ static int sys_timeout(int *timeout)
 	return 0;
 }
 
-static void sys_init(void)
+/* Called with workers locked, in worker mode */
+static void sys_setup(void)
 {
 	struct iface *iface;
 
+	for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
+		int changed = iface->changed;
+
+		if (worker_enabled()) {
+			if (changed)
+				worker_post(iface, WORK_SETUP);
+			continue;
+		}
+
+		setup_iface(iface);
+
+		/* New, changed, or back in use, run as soon as possible */
+		if (!iface->unused && iface->mdns && (changed || !iface->timer.pos))
+			timer_set(&iface->timer, timer_now());
+	}
+}
+
+static void sys_init(void)
+{
 	/* Initialize or check if IP address changed, needed to update A records */
+	worker_lock();
 	iface_init(ifname);
+	sys_setup();
+	worker_unlock();
+}
 
-	for (iface = iface_iterator(1); iface; iface = iface_iterator(0))
-		setup_iface(iface);
+static int sys_cache(int *msec)
+{
+	static unsigned long long next;
+	unsigned long long now;
+
+	if (!cachedir)
+		return 0;
+
+	now = timer_now();
+	if (!next)
+		next = now + CACHE_INTERVAL * 1000;
+	if (now < next) {
+		if (*msec < 0 || (unsigned long long)*msec > next - now)
+			*msec = next - now;
+		return 0;
+	}
+
+	next = now + CACHE_INTERVAL * 1000;
+	return 1;
+}
+
+/* Called with workers locked, in worker mode */
+static void sys_save(void)
+{
+	struct iface *iface;
+
+	for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
+		if (worker_enabled()) {
+			if (iface->worker)
+				worker_post(iface, WORK_SAVE);
+			continue;
+		}
+
+		save_iface(iface);
+	}
+}
+
+/* Trace ring of all ifaces, decoded with mquery -T */
+static void sys_trace(void)
+{
+	char tmp[sizeof(TRACE_FILE) + 4];
+	FILE *fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", TRACE_FILE);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		WARN("Failed saving trace to %s: %s", tmp, strerror(errno));
+		return;
+	}
+
+	if (mdnsd_trace_save(fp)) {
+		WARN("Failed saving trace to %s: %s", tmp, strerror(errno));
+		fclose(fp);
+		remove(tmp);
+		return;
+	}
+
+	if (fclose(fp) || rename(tmp, TRACE_FILE)) {
+		WARN("Failed saving trace to %s: %s", TRACE_FILE, strerror(errno));
+		remove(tmp);
+		return;
+	}
+
+	NOTE("Trace saved to %s", TRACE_FILE);
+}
+
+static void sys_reload(void)
+{
+	struct iface *iface;
+
+	conf_load(path);
+	sys_init();
+
+	worker_lock();
+	for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
+		if (worker_enabled()) {
+			if (iface->worker)
+				worker_post(iface, WORK_RELOAD);
+			continue;
+		}
+
+		if (!iface->mdns)
+			continue;
+
+		conf_init(iface, path);
+		timer_set(&iface->timer, timer_now());
+	}
+	worker_unlock();
+}
+
+void step_iface(struct iface *iface, bool in)
+{
+	struct timeval next;
+	int rc;
+
+	if (!iface->mdns || iface->sd < 0)
+		return;
+
+	DBG("Checking iface %s for activity ...", iface->ifname);
+	rc = mdnsd_step(iface->mdns, iface->sd, in, true, &next);
+	if (!rc) {
+		/* Round up, or we spin until a sub-msec deadline has passed */
+		timer_set(&iface->timer, timer_now() + next.tv_sec * 1000 + (next.tv_usec + 999) / 1000);
+		return;
+	}
+
+	if (rc == 1)
+		ERR("Failed reading from socket %d: %s", errno, strerror(errno));
+	if (rc == 2)
+		ERR("Failed writing to socket: %s", strerror(errno));
+
+	free_iface(iface);
+}
+
+/* Datagram on the shared socket, step receiving iface once all are read */
+static mdns_daemon_t *demux(int ifindex, void *arg)
+{
+	struct iface *iface;
+
+	iface = iface_find_index(ifindex);
+	if (!iface || !iface->mdns || iface->sd < 0)
+		return NULL;
+
+	timer_set(&iface->timer, timer_now());
+
+	return iface->mdns;
 }
 
 static void done(int signo)
@@ -187,25 +446,56 @@ static void reconf(int signo)
 	reload = 1;
 }
 
+static void trace(int signo)
+{
+	dump = 1;
+}
+
 static void sig_init(void)
 {
 	signal(SIGINT, done);
 	signal(SIGHUP, reconf);
+	signal(SIGUSR1, trace);
 	signal(SIGQUIT, done);
 	signal(SIGTERM, done);
 }
 
 /*
- * Create a multicast socket and bind it to the given interface.
- * Conclude by joining 224.0.0.251:5353 to hear others.
+ * Join mDNS link-local group on the given interface, that way we can
+ * receive multicast without a proper net route (default route or a
+ * 224.0.0.0/24 net route).  Or leave it, for the shared socket.
  */
-static int multicast_socket(struct iface *iface, unsigned char ttl)
+static int multicast_join(int sd, struct iface *iface, int join)
 {
 #ifdef HAVE_STRUCT_IP_MREQN_IMR_IFINDEX
 	struct ip_mreqn imr = { .imr_ifindex = iface->ifindex };
 #else
-	struct ip_mreq imr;
+	struct ip_mreq imr = { .imr_interface = iface->inaddr };
 #endif
+	int opt = join ? IP_ADD_MEMBERSHIP : IP_DROP_MEMBERSHIP;
+
+	imr.imr_multiaddr.s_addr = inet_addr("224.0.0.251");
+	if (setsockopt(sd, IPPROTO_IP, opt, &imr, sizeof(imr))) {
+		if (join)
+			WARN("Failed joining mDMS group 224.0.0.251 on %s: %s", iface->ifname, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Create a multicast socket and bind it to the given interface.
+ * Conclude by joining 224.0.0.251:5353 to hear others.  Without an
+ * interface the socket is shared by all of them, interfaces join it
+ * and the mDNS contexts pick egress interface with IP_PKTINFO.
+ */
+static int multicast_socket(struct iface *iface, unsigned char ttl)
+{
+#ifdef HAVE_STRUCT_IP_MREQN_IMR_IFINDEX
+	struct ip_mreqn imr = { .imr_ifindex = iface ? iface->ifindex : 0 };
+#endif
+	char *name = iface ? iface->ifname : "all interfaces";
 	struct sockaddr_in sin;
 	socklen_t len;
 	int unicast_ttl = 255;
@@ -234,24 +524,26 @@ static int multicast_socket(struct iface *iface, unsigned char ttl)
 	}
 
 	if (setsockopt(sd, IPPROTO_IP, IP_PKTINFO, &flag, sizeof(flag)))
-		WARN("Failed setting %s IP_PKTINFO: %s", iface->ifindex, strerror(errno));
+		WARN("Failed setting IP_PKTINFO on %s: %s", name, strerror(errno));
 
 	/* Set interface for outbound multicast */
+	if (iface) {
 #ifdef HAVE_STRUCT_IP_MREQN_IMR_IFINDEX
-	if (setsockopt(sd, IPPROTO_IP, IP_MULTICAST_IF, &imr, sizeof(imr)))
-		WARN("Failed setting IP_MULTICAST_IF %d: %s", iface->ifindex, strerror(errno));
+		if (setsockopt(sd, IPPROTO_IP, IP_MULTICAST_IF, &imr, sizeof(imr)))
+			WARN("Failed setting IP_MULTICAST_IF %d: %s", iface->ifindex, strerror(errno));
 #else
-	if (setsockopt(sd, IPPROTO_IP, IP_MULTICAST_IF, &ina, sizeof(ina)))
-		WARN("Failed setting IP_MULTICAST_IF to %s: %s",
-		     inet_ntoa(ina), strerror(errno));
+		if (setsockopt(sd, IPPROTO_IP, IP_MULTICAST_IF, &iface->inaddr, sizeof(iface->inaddr)))
+			WARN("Failed setting IP_MULTICAST_IF to %s: %s",
+			     inet_ntoa(iface->inaddr), strerror(errno));
 #endif
+	}
 
 	if (setsockopt(sd, IPPROTO_IP, IP_MULTICAST_LOOP, &on, sizeof(on)))
-		WARN("Failed disabling IP_MULTICAST_LOOP on %s: %s", iface->ifname, strerror(errno));
+		WARN("Failed disabling IP_MULTICAST_LOOP on %s: %s", name, strerror(errno));
 
 	flag = 0;
 	if (setsockopt(sd, IPPROTO_IP, IP_MULTICAST_ALL, &flag, sizeof(flag)))
-		WARN("Failed disabling IP_MULTICAST_LOOP on %s: %s", iface->ifname, strerror(errno));
+		WARN("Failed disabling IP_MULTICAST_LOOP on %s: %s", name, strerror(errno));
 
 	/*
 	 * All traffic on 224.0.0.* is link-local only, so the default
@@ -265,7 +557,7 @@ static int multicast_socket(struct iface *iface, unsigned char ttl)
 		WARN("Failed setting IP_TTL to %d: %s", unicast_ttl, strerror(errno));
 
 	/* Filter inbound traffic from anyone (ANY) to port 5353 on ifname */
-	if (setsockopt(sd, SOL_SOCKET, SO_BINDTODEVICE, &iface->ifname, strlen(iface->ifname)))
+	if (iface && setsockopt(sd, SOL_SOCKET, SO_BINDTODEVICE, &iface->ifname, strlen(iface->ifname)))
 		WARN("Failed setting SO_BINDTODEVICE: %s", strerror(errno));
 
 	memset(&sin, 0, sizeof(sin));
@@ -275,42 +567,36 @@ static int multicast_socket(struct iface *iface, unsigned char ttl)
 		close(sd);
 		return -1;
 	}
-	INFO("Bound to *:5353 on iface %s", iface->ifname);
+	INFO("Bound to *:5353 on %s%s", iface ? "iface " : "", name);
 
-	/*
-	 * Join mDNS link-local group on the given interface, that way
-	 * we can receive multicast without a proper net route (default
-	 * route or a 224.0.0.0/24 net route).
-	 */
-	imr.imr_multiaddr.s_addr = inet_addr("224.0.0.251");
-#ifdef HAVE_STRUCT_IP_MREQN_IMR_IFINDEX
-	imr.imr_ifindex   = iface->ifindex;
-#else
-	imr.imr_interface = iface->inaddr;
-#endif
-	if (setsockopt(sd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &imr, sizeof(imr)))
-		WARN("Failed joining mDMS group 224.0.0.251: %s", strerror(errno));
+	if (iface)
+		multicast_join(sd, iface, 1);
 
 	return sd;
 }
 
 static int usage(int code)
 {
-	printf("Usage: %s [-hnsv] [-i IFACE] [-l LEVEL] [-t TTL] [PATH]\n"
+	printf("Usage: %s [-hnsSv] [-c DIR] [-i IFACE] [-l LEVEL] [-m KB] [-t TTL] [-u SOCK] [-w NUM] [PATH]\n"
 	       "\n"
 	       "Options:\n"
+	       "    -c DIR    Save cache in DIR, for warm restarts, default: disabled\n"
 	       "    -h        This help text\n"
 	       "    -i IFACE  Interface to announce services on, and get address from\n"
 	       "    -l LEVEL  Set log level: none, err, notice (default), info, debug\n"
+	       "    -m KB     Max size of cache per interface, 0 for no limit, default: %d\n"
 	       "    -n        Run in foreground, do not detach from controlling terminal\n"
 	       "    -s        Use syslog even if running in foreground\n"
+	       "    -S        Use one shared socket for all interfaces\n"
 	       "    -t TTL    Set TTL of mDNS packets, default: 1 (link-local only)\n"
+	       "    -u SOCK   Control socket for mquery -l, default: %s\n"
 	       "    -v        Show program version\n"
+	       "    -w NUM    Spread interfaces across NUM worker threads, default: 0\n"
 	       "\n"
 	       "Arguments:\n"
 	       "    PATH      Path to mDNS-SD .service files, default: /etc/mdns.d\n"
 	       "\n"
-	       "Bug report address: %-40s\n", prognm, PACKAGE_BUGREPORT);
+	       "Bug report address: %-40s\n", prognm, CACHE_MAX, CTRL_SOCKET, PACKAGE_BUGREPORT);
 
 	return code;
 }
@@ -330,15 +616,17 @@ static char *progname(char *arg0)
 
 int main(int argc, char *argv[])
 {
-	struct timeval tv = { 0 };
 	struct iface *iface;
-	fd_set fds;
 	int timeout = 0;
 	int c, rc;
 
 	prognm = progname(argv[0]);
-	while ((c = getopt(argc, argv, "hi:l:nst:v?")) != EOF) {
+	while ((c = getopt(argc, argv, "c:hi:l:m:nsSt:u:vw:?")) != EOF) {
 		switch (c) {
+		case 'c':
+			cachedir = optarg;
+			break;
+
 		case 'h':
 		case '?':
 			return usage(0);
@@ -348,7 +636,15 @@ int main(int argc, char *argv[])
 			break;
 
 		case 'l':
-			if (-1 == mdnsd_log_level(optarg))
+			rc = mdnsd_log_level(optarg);
+			if (-1 == rc)
+				return usage(1);
+			debug = rc >= LOG_DEBUG;
+			break;
+
+		case 'm':
+			cachemax = atol(optarg);
+			if (cachemax < 0 || cachemax > 1048576)
 				return usage(1);
 			break;
 
@@ -361,6 +657,10 @@ int main(int argc, char *argv[])
 			logging++;
 			break;
 
+		case 'S':
+			shared = 1;
+			break;
+
 		case 't':
 			/* XXX: Use strtonum() instead */
 			ttl = atoi(optarg);
@@ -368,15 +668,31 @@ int main(int argc, char *argv[])
 				return usage(1);
 			break;
 
+		case 'u':
+			sockpath = optarg;
+			break;
+
 		case 'v':
 			puts(PACKAGE_VERSION);
 			return 0;
 
+		case 'w':
+			workers = atoi(optarg);
+			if (workers < 0 || workers > 64)
+				return usage(1);
+			break;
+
 		default:
 			break;
 		}
 	}
 
+	/* Datagrams on the shared socket are read by the main thread */
+	if (shared && workers) {
+		fprintf(stderr, "%s: -S and -w cannot be combined.\n", prognm);
+		return usage(1);
+	}
+
 	if (optind < argc)
 		path = argv[optind];
 	else
@@ -394,75 +710,115 @@ int main(int argc, char *argv[])
 	}
 
 	NOTE("%s starting.", PACKAGE_STRING);
+	if (event_init()) {
+		ERR("Failed creating event loop: %s", strerror(errno));
+		return 1;
+	}
 	sig_init();
+	if (mdnsd_trace_init(TRACE_EVENTS))
+		WARN("Failed creating trace ring: %s", strerror(errno));
+	if (workers > 0 && worker_init(workers))
+		return 1;
+
+	if (shared) {
+		shared_sd = multicast_socket(NULL, (unsigned char)ttl);
+		if (shared_sd < 0 || event_add(shared_sd, &shared_sd)) {
+			ERR("Failed creating shared socket: %s", strerror(errno));
+			return 1;
+		}
+	}
+
+	if (ctrl_init(sockpath))
+		WARN("Failed creating control socket %s: %s", sockpath, strerror(errno));
+
+	conf_load(path);
 	sys_init();
 	pidfile(PACKAGE_NAME);
 
-	while (running) {
-		int nfds = 0;
-
-		FD_ZERO(&fds);
-		for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
-			if (iface->sd < 0 || iface->unused)
-				continue;
+	monitor = iface_monitor();
+	if (monitor >= 0 && event_add(monitor, &monitor)) {
+		close(monitor);
+		monitor = -1;
+	}
+	if (monitor < 0)
+		DBG("No interface change notification, polling every %d sec", SYS_INTERVAL);
 
-			FD_SET(iface->sd, &fds);
-			if (iface->sd > nfds)
-				nfds = iface->sd;
+	while (running) {
+		unsigned long long now;
+		void *ready[32];
+		struct timer *t;
+		int msec, num, i;
+
+		/* Poll for interface changes only if they are not pushed to us */
+		msec = timer_next(timer_now());
+		if (monitor < 0 && (msec < 0 || msec > SYS_INTERVAL * 1000))
+			msec = SYS_INTERVAL * 1000;
+		if (sys_cache(&msec)) {
+			worker_lock();
+			sys_save();
+			worker_unlock();
 		}
 
-		if (nfds > 0)
-			nfds++;
-
-		DBG("Going to sleep for %d sec ...", (int)tv.tv_sec);
-		rc = select(nfds, &fds, NULL, NULL, &tv);
-		if ((rc < 0 && EINTR == errno) || reload) {
+		DBG("Going to sleep for %d msec ...", msec);
+		num = event_wait(ready, NELEMS(ready), msec);
+		if ((num < 0 && EINTR == errno) || reload || dump) {
 			if (!running)
 				break;
 			if (reload) {
-				sys_init();
-				for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
-					records_clear(iface->mdns);
-					conf_init(iface, path);
-				}
-				pidfile(PACKAGE_NAME);
 				reload = 0;
+				sys_reload();
+				pidfile(PACKAGE_NAME);
+			}
+			if (dump) {
+				dump = 0;
+				sys_trace();
 			}
 
 			continue;
 		}
 
-		if (sys_timeout(&timeout))
+		if (monitor < 0 && sys_timeout(&timeout))
 		    sys_init();
 
-		tv.tv_sec = timeout;
-		for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
-			struct timeval next;
-
-			DBG("Checking iface %s for activity ...", iface->ifname);
-			if (iface->unused || iface->sd < 0)
+		/* Only step ifaces with traffic, or a timer that has expired */
+		for (i = 0; i < num; i++) {
+			if (ready[i] == &monitor) {
+				worker_lock();
+				if (iface_event(monitor, ifname))
+					sys_setup();
+				worker_unlock();
 				continue;
+			}
 
-			rc = mdnsd_step(iface->mdns, iface->sd, FD_ISSET(iface->sd, &fds), true, &next);
-			if (!rc) {
-				if (tv.tv_sec > next.tv_sec)
-					tv = next;
+			if (ready[i] == &shared_sd) {
+				if (mdnsd_demux(shared_sd, demux, NULL))
+					ERR("Failed reading from shared socket: %s", strerror(errno));
 				continue;
 			}
 
-			if (rc == 1)
-				ERR("Failed reading from socket %d: %s", errno, strerror(errno));
-			if (rc == 2)
-				ERR("Failed writing to socket: %s", strerror(errno));
+			if (ctrl_event(ready[i]))
+				continue;
 
-			free_iface(iface);
+			step_iface(ready[i], true);
 		}
+
+		now = timer_now();
+		while ((t = timer_expired(now)))
+			step_iface(t->arg, false);
 	}
 
 	NOTE("%s exiting.", PACKAGE_STRING);
+	worker_exit();
 	for (iface = iface_iterator(1); iface; iface = iface_iterator(0))
 		free_iface(iface);
+	ctrl_exit();
 	iface_exit();
+	conf_exit();
+	if (shared_sd >= 0)
+		close(shared_sd);
+	if (monitor >= 0)
+		close(monitor);
+	event_exit();
 
 	return 0;
 }
@@ -56,6 +56,12 @@
 #define IN_LINKLOCAL(addr) ((addr & IN_CLASSB_NET) == IN_LINKLOCALNETNUM)
 #endif
 
+struct timer {
+	unsigned long long when;		/* Deadline, in msec          */
+	size_t             pos;			/* In timer queue, 0 if not   */
+	void              *arg;
+};
+
 struct iface {
 	TAILQ_ENTRY(iface) link;
 	char               unused;
@@ -69,19 +75,68 @@ struct iface {
 
 	mdns_daemon_t     *mdns;
 	int                hostid;              /* init to 1, +1 on conflict  */
+	int                conflict;		/* hostid bumped, until reload */
+
+	struct timer       timer;		/* Next mdnsd_step() for iface */
+
+	struct worker     *worker;		/* Owner, in worker mode      */
+	int                work;		/* Posted by main, WORK_*     */
 };
 
+#define WORK_SETUP  1				/* Run setup_iface()          */
+#define WORK_RELOAD 2				/* Republish services         */
+#define WORK_SAVE   4				/* Snapshot cache, with -c    */
+#define WORK_STEP   8				/* Step now, e.g. new query   */
+
+/* mdnsd.c */
+void setup_iface(struct iface *iface);
+void step_iface (struct iface *iface, bool in);
+void free_iface (struct iface *iface);
+void save_iface (struct iface *iface);
+
 void mdnsd_conflict(char *name, int type, void *arg);
 
 /* addr.c */
 struct iface *iface_iterator(int first);
 struct iface *iface_find(const char *ifname);
+struct iface *iface_find_index(int ifindex);
 void          iface_free(struct iface *iface);
 void          iface_init(char *ifname);
 void          iface_exit(void);
+int           iface_monitor(void);
+int           iface_event(int sd, char *ifname);
+
+/* event.c */
+int                 event_init   (void);
+void                event_exit   (void);
+int                 event_add    (int sd, void *arg);
+void                event_del    (int sd);
+int                 event_wait   (void **ready, int max, int msec);
+
+unsigned long long  timer_now    (void);
+int                 timer_set    (struct timer *t, unsigned long long when);
+void                timer_del    (struct timer *t);
+int                 timer_next   (unsigned long long now);
+struct timer       *timer_expired(unsigned long long now);
+
+/* ctrl.c */
+int  ctrl_init (char *path);
+void ctrl_exit (void);
+int  ctrl_event(void *arg);
+void ctrl_iface(struct iface *iface);
 
 /* conf.c */
-int conf_init(struct iface *iface, char *path);
+int  conf_load(char *path);
+int  conf_init(struct iface *iface, char *path);
+void conf_exit(void);
+
+/* worker.c */
+int  worker_init   (int num);
+void worker_exit   (void);
+int  worker_enabled(void);
+void worker_lock   (void);
+void worker_unlock (void);
+int  worker_post   (struct iface *iface, int work);
 
 /* replacement functions for systems that don't have them  */
 #ifndef HAVE_PIDFILE
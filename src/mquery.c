@@ -34,8 +34,11 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <net/if.h>
+#include <sys/un.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <ctype.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -43,11 +46,19 @@
 #include <unistd.h>
 
 #include <libmdnsd/mdnsd.h>
+#include "ctrl.h"
 
 char *prognm = "mquery";
 mdns_daemon_t *d;
 int simple;
 
+/* With -l, answers come from the cache of mdnsd */
+char *sockpath = CTRL_SOCKET;
+char *query_name;
+char *ifname;
+int local, stream;
+int lsd = -1;
+
 
 #ifndef HAVE_STRLCPY
 size_t strlcpy(char *dst, const char *src, size_t siz);
@@ -173,6 +184,304 @@ static int ans(mdns_answer_t *a, void *arg)
 	return 0;
 }
 
+/* Undo the escaping of a name or string from mdnsd, see ctrl.h */
+static size_t unesc(char *dst, size_t len, const char *src)
+{
+	size_t n = 0;
+
+	while (*src && n + 1 < len) {
+		if (src[0] == '\\' && isdigit(src[1]) && isdigit(src[2]) && isdigit(src[3])) {
+			dst[n++] = (src[1] - '0') * 100 + (src[2] - '0') * 10 + (src[3] - '0');
+			src += 4;
+		} else
+			dst[n++] = *src++;
+	}
+	dst[n] = 0;
+
+	return n;
+}
+
+static int local_send(const char *cmd, int type, const char *name)
+{
+	char buf[CTRL_LINE_MAX];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%s %d %s\n", cmd, type, name);
+	if (len >= (int)sizeof(buf))
+		return -1;
+
+	return write(lsd, buf, len) == len ? 0 : -1;
+}
+
+static void local_list(const char *name, int type);
+
+/* Answer from mdnsd, same output as ans(), also browses the same way */
+static void local_ans(mdns_answer_t *a)
+{
+	if (simple) {
+		ans(a, NULL);
+		return;
+	}
+
+	if (a->type != QTYPE_PTR)
+		return;
+
+	if (!strcmp(a->name, query_name)) {
+		if (stream)
+			local_send("QUERY", a->type, a->rdname);
+		else
+			local_list(a->rdname, a->type);
+		return;
+	}
+
+	printf("+ %s (%s)\n", a->rdname, inet_ntoa(a->ip));
+}
+
+/* Parse answer line from mdnsd, see ctrl.h */
+static void local_line(char *line)
+{
+	char name[256], rdname[256], str[256];
+	unsigned char rdata[4096];
+	char *iface, *type, *ttl, *nm, *tok;
+	mdns_answer_t a = { 0 };
+	long sec;
+
+	iface = strsep(&line, " ");
+	type  = strsep(&line, " ");
+	ttl   = strsep(&line, " ");
+	nm    = strsep(&line, " ");
+	if (!nm || !line)
+		return;
+	if (ifname && strcmp(ifname, iface))
+		return;
+
+	unesc(name, sizeof(name), nm);
+	a.name = name;
+	a.type = atoi(type);
+	sec = atol(ttl);
+	a.ttl = sec > 0 ? time(NULL) + sec : 0;
+
+	switch (a.type) {
+	case QTYPE_A:
+		inet_aton(line, &a.ip);
+		break;
+
+	case QTYPE_SRV:
+		a.srv.priority = atoi(strsep(&line, " "));
+		a.srv.weight   = line ? atoi(strsep(&line, " ")) : 0;
+		a.srv.port     = line ? atoi(strsep(&line, " ")) : 0;
+		if (!line)
+			return;
+		/* fallthrough */
+	case QTYPE_NS:
+	case QTYPE_CNAME:
+	case QTYPE_PTR:
+		unesc(rdname, sizeof(rdname), line);
+		a.rdname = rdname;
+		break;
+
+	case QTYPE_TXT:
+		a.rdata = rdata;
+		while ((tok = strsep(&line, " "))) {
+			size_t n = unesc(str, sizeof(str), tok);
+
+			if (a.rdlen + 1 + n > sizeof(rdata))
+				break;
+			rdata[a.rdlen++] = n;
+			memcpy(&rdata[a.rdlen], str, n);
+			a.rdlen += n;
+		}
+		break;
+
+	default:
+		if (!strncmp(line, "\\# ", 3))
+			a.rdlen = atoi(line + 3);
+		break;
+	}
+
+	local_ans(&a);
+}
+
+/* Read one line, NULL on timeout (msec), error or EOF */
+static char *local_read(int msec)
+{
+	static char buf[65536];
+	static size_t len, skip;
+	char *nl;
+
+	/* Drop line returned last time */
+	if (skip) {
+		len -= skip;
+		memmove(buf, buf + skip, len);
+		skip = 0;
+	}
+
+	while (!(nl = memchr(buf, '\n', len))) {
+		struct pollfd pfd = { .fd = lsd, .events = POLLIN };
+		ssize_t num;
+
+		if (len == sizeof(buf))
+			return NULL;
+		if (poll(&pfd, 1, msec) <= 0)
+			return NULL;
+
+		num = read(lsd, buf + len, sizeof(buf) - len);
+		if (num <= 0)
+			return NULL;
+		len += num;
+	}
+
+	*nl = 0;
+	skip = nl + 1 - buf;
+
+	return buf;
+}
+
+/* Look up in cache of mdnsd, everything up to the empty line */
+static void local_list(const char *name, int type)
+{
+	char **lines = NULL, *line;
+	size_t i, num = 0;
+
+	if (local_send("LIST", type, name))
+		return;
+
+	while ((line = local_read(-1)) && line[0]) {
+		char **tmp;
+
+		tmp = realloc(lines, (num + 1) * sizeof(*lines));
+		if (!tmp)
+			break;
+		lines = tmp;
+		lines[num] = strdup(line);
+		if (lines[num])
+			num++;
+	}
+
+	/* Reply read in full first, browsing sends new requests */
+	for (i = 0; i < num; i++) {
+		if (strncmp(lines[i], "ERR", 3))
+			local_line(lines[i]);
+		free(lines[i]);
+	}
+	free(lines);
+}
+
+static int local_connect(char *path)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	int sd;
+
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sd < 0)
+		return -1;
+
+	if (connect(sd, (struct sockaddr *)&sun, sizeof(sun))) {
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+}
+
+/*
+ * Answers from the cache of a running mdnsd, with -w subscribe to
+ * answers to the same query, sent on to the network, for SEC seconds.
+ */
+static int local_query(char *name, int type, int wait)
+{
+	time_t start;
+	char *line;
+
+	lsd = local_connect(sockpath);
+	if (lsd < 0) {
+		printf("Failed connecting to %s: %s\n", sockpath, strerror(errno));
+		return 1;
+	}
+
+	query_name = name;
+	if (!wait) {
+		local_list(name, type);
+		close(lsd);
+		return 0;
+	}
+
+	stream = 1;
+	printf("Querying for %s type %d ... press Ctrl-C to stop\n", name, type);
+	if (local_send("QUERY", type, name)) {
+		printf("Failed sending query: %s\n", strerror(errno));
+		close(lsd);
+		return 1;
+	}
+
+	start = time(NULL);
+	while (time(NULL) - start < wait) {
+		line = local_read((wait - (time(NULL) - start)) * 1000);
+		if (!line)
+			break;
+		if (line[0] && strncmp(line, "ERR", 3))
+			local_line(line);
+		fflush(stdout);
+	}
+	close(lsd);
+
+	return 0;
+}
+
+/* Decode a trace saved by mdnsd on SIGUSR1 */
+static int trace(const char *file)
+{
+	FILE *fp;
+	int rc;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		printf("Failed opening %s: %s\n", file, strerror(errno));
+		return 1;
+	}
+
+	rc = mdnsd_trace_print(stdout, fp);
+	if (rc)
+		printf("Failed reading %s, not a trace from this mdnsd?\n", file);
+	fclose(fp);
+
+	return rc ? 1 : 0;
+}
+
+/* Counters of a running mdnsd, as is, only those of ifname if given */
+static int local_stats(void)
+{
+	char *line;
+
+	lsd = local_connect(sockpath);
+	if (lsd < 0) {
+		printf("Failed connecting to %s: %s\n", sockpath, strerror(errno));
+		return 1;
+	}
+
+	if (write(lsd, "STATS\n", 6) != 6) {
+		printf("Failed sending request: %s\n", strerror(errno));
+		close(lsd);
+		return 1;
+	}
+
+	while ((line = local_read(-1)) && line[0]) {
+		size_t len = ifname ? strlen(ifname) : 0;
+
+		if (len && (strncmp(line, ifname, len) || line[len] != ' '))
+			continue;
+		puts(line);
+	}
+	close(lsd);
+
+	return 0;
+}
+
 /* Create multicast 224.0.0.251:5353 socket */
 static int msock(char *ifname)
 {
@@ -242,7 +551,7 @@ static int msock(char *ifname)
 static int usage(int code)
 {
 	/* mquery -t 12 _http._tcp.local. */
-	printf("usage: mquery [-hsv] [-i IFNAME] [-t TYPE] [-w SEC] [NAME]\n");
+	printf("usage: mquery [-hlsSv] [-i IFNAME] [-t TYPE] [-T FILE] [-u SOCK] [-w SEC] [NAME]\n");
 	return code;
 }
 
@@ -254,17 +563,18 @@ int main(int argc, char *argv[])
 	ssize_t bsize;
 	socklen_t ssize;
 	unsigned char buf[MAX_PACKET_LEN];
+	unsigned char pkt[MAX_PACKET_LEN];
 	char default_iface[IFNAMSIZ];
 	struct sockaddr_in from, to;
 	char *name = DISCO_NAME;
-	char *ifname = NULL;
 	int type = QTYPE_PTR;	/* 12 */
 	time_t start;
 	int wait = 0;
+	int stats = 0;
 	fd_set fds;
 	int sd, c;
 
-	while ((c = getopt(argc, argv, "h?i:st:vw:")) != EOF) {
+	while ((c = getopt(argc, argv, "h?i:lsSt:T:u:vw:")) != EOF) {
 		switch (c) {
 		case 'h':
 		case '?':
@@ -274,14 +584,29 @@ int main(int argc, char *argv[])
 			ifname = optarg;
 			break;
 
+		case 'l':
+			local = 1;
+			break;
+
 		case 's':
 			simple = 1;
 			break;
 
+		case 'S':
+			stats = 1;
+			break;
+
 		case 't':
 			type = atoi(optarg);
 			break;
 
+		case 'T':
+			return trace(optarg);
+
+		case 'u':
+			sockpath = optarg;
+			break;
+
 		case 'v':
 			puts(PACKAGE_VERSION);
 			return 0;
@@ -298,6 +623,13 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		name = argv[optind];
 
+	if (stats)
+		return local_stats();
+
+	/* Only answers from ifname, if given */
+	if (local)
+		return local_query(name, type, wait);
+
 	if (!ifname)
 		ifname = getifname(default_iface, sizeof(default_iface));
 
@@ -315,6 +647,8 @@ int main(int argc, char *argv[])
 	start = time(NULL);
 	mdnsd_query(d, name, type, ans, NULL);
 
+	/* Received packets are parsed into, and ours built in, pkt */
+	message_init(&m, pkt, sizeof(pkt));
 	while (1) {
 		struct timeval *tv = mdnsd_sleep(d);
 
@@ -325,8 +659,7 @@ int main(int argc, char *argv[])
 		if (FD_ISSET(sd, &fds)) {
 			ssize = sizeof(struct sockaddr_in);
 			while ((bsize = recvfrom(sd, buf, MAX_PACKET_LEN, 0, (struct sockaddr *)&from, &ssize)) > 0) {
-				memset(&m, 0, sizeof(struct message));
-				if (message_parse(&m, buf) == 0)
+				if (message_parse_len(&m, buf, bsize) == 0)
 					mdnsd_in(d, &m, from.sin_addr, from.sin_port);
 			}
 			if (bsize < 0 && errno != EAGAIN) {
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2022  Joachim Wiberg <troglobit@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Optional worker threads, interfaces are spread across them and each
+ * runs its own event loop and timer queue.  Everything to do with an
+ * interface's mDNS context and socket is done by its worker, the main
+ * thread only tracks interfaces and posts work to the worker with the
+ * worker locked.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mdnsd.h"
+
+#define WORKER_STACK (512 * 1024)
+
+struct worker {
+	pthread_t         tid;
+	pthread_mutex_t   lock;
+	int               wake[2];
+	int               stop;
+
+	struct iface    **ifaces;
+	size_t            len, max;
+};
+
+static struct worker *workers;
+static int num_workers;
+
+/*
+ * Run work posted by the main thread, called locked, returns non-zero
+ * when told to stop
+ */
+static int worker_run(struct worker *w)
+{
+	size_t i;
+
+	for (i = 0; i < w->len; i++) {
+		struct iface *iface = w->ifaces[i];
+		int work = iface->work;
+
+		iface->work = 0;
+		if (work & WORK_SETUP)
+			setup_iface(iface);
+		if ((work & WORK_RELOAD) && iface->mdns)
+			conf_init(iface, NULL);
+		if (work & WORK_SAVE)
+			save_iface(iface);
+
+		if (work && !iface->unused && iface->mdns)
+			timer_set(&iface->timer, timer_now());
+	}
+	return w->stop;
+}
+
+static void *worker_loop(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	int stop = 0;
+	size_t i;
+
+	if (event_init() || event_add(w->wake[0], w)) {
+		ERR("Failed starting worker event loop: %s", strerror(errno));
+		return NULL;
+	}
+
+	while (!stop) {
+		unsigned long long now;
+		void *ready[32];
+		struct timer *t;
+		int j, msec, num;
+
+		msec = timer_next(timer_now());
+		num = event_wait(ready, NELEMS(ready), msec);
+		if (num < 0) {
+			if (errno == EINTR)
+				continue;
+			ERR("Worker failed waiting for events: %s", strerror(errno));
+			break;
+		}
+
+		/* Main thread may look at our ifaces, e.g. the control socket */
+		pthread_mutex_lock(&w->lock);
+		for (j = 0; j < num; j++) {
+			if (ready[j] == w) {
+				char buf[64];
+
+				while (read(w->wake[0], buf, sizeof(buf)) > 0)
+					;
+				stop = worker_run(w);
+				continue;
+			}
+
+			step_iface(ready[j], true);
+		}
+
+		now = timer_now();
+		while ((t = timer_expired(now)))
+			step_iface(t->arg, false);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	pthread_mutex_lock(&w->lock);
+	for (i = 0; i < w->len; i++)
+		free_iface(w->ifaces[i]);
+	pthread_mutex_unlock(&w->lock);
+	event_exit();
+
+	return NULL;
+}
+
+static void worker_wake(struct worker *w)
+{
+	char c = 0;
+
+	if (write(w->wake[1], &c, 1) < 0 && errno != EAGAIN)
+		ERR("Failed waking up worker: %s", strerror(errno));
+}
+
+int worker_init(int num)
+{
+	pthread_attr_t attr;
+	sigset_t all, old;
+	int i;
+
+	workers = calloc(num, sizeof(*workers));
+	if (!workers)
+		return -1;
+
+	/* Signals are handled by the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, WORKER_STACK);
+
+	for (i = 0; i < num; i++) {
+		struct worker *w = &workers[i];
+
+		pthread_mutex_init(&w->lock, NULL);
+		if (pipe(w->wake))
+			break;
+		fcntl(w->wake[0], F_SETFL, O_NONBLOCK);
+		fcntl(w->wake[1], F_SETFL, O_NONBLOCK);
+
+		if (pthread_create(&w->tid, &attr, worker_loop, w)) {
+			close(w->wake[0]);
+			close(w->wake[1]);
+			break;
+		}
+		num_workers++;
+	}
+
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (num_workers < num) {
+		ERR("Failed starting worker %d: %s", num_workers + 1, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+void worker_exit(void)
+{
+	int i;
+
+	for (i = 0; i < num_workers; i++) {
+		struct worker *w = &workers[i];
+
+		pthread_mutex_lock(&w->lock);
+		w->stop = 1;
+		pthread_mutex_unlock(&w->lock);
+		worker_wake(w);
+	}
+
+	for (i = 0; i < num_workers; i++) {
+		struct worker *w = &workers[i];
+
+		pthread_join(w->tid, NULL);
+		close(w->wake[0]);
+		close(w->wake[1]);
+		pthread_mutex_destroy(&w->lock);
+		free(w->ifaces);
+	}
+
+	free(workers);
+	workers = NULL;
+	num_workers = 0;
+}
+
+int worker_enabled(void)
+{
+	return num_workers > 0;
+}
+
+void worker_lock(void)
+{
+	int i;
+
+	for (i = 0; i < num_workers; i++)
+		pthread_mutex_lock(&workers[i].lock);
+}
+
+void worker_unlock(void)
+{
+	int i;
+
+	for (i = num_workers - 1; i >= 0; i--)
+		pthread_mutex_unlock(&workers[i].lock);
+}
+
+/* Post work for iface to its worker, called with workers locked */
+int worker_post(struct iface *iface, int work)
+{
+	struct worker *w = iface->worker;
+
+	if (!w) {
+		struct iface **tmp;
+		int i;
+
+		/* Least loaded worker gets new interfaces */
+		w = &workers[0];
+		for (i = 1; i < num_workers; i++) {
+			if (workers[i].len < w->len)
+				w = &workers[i];
+		}
+
+		if (w->len == w->max) {
+			size_t num = w->max ? w->max * 2 : 8;
+
+			tmp = realloc(w->ifaces, num * sizeof(*tmp));
+			if (!tmp)
+				return -1;
+			w->ifaces = tmp;
+			w->max = num;
+		}
+
+		w->ifaces[w->len++] = iface;
+		iface->worker = w;
+	}
+
+	iface->work |= work;
+	worker_wake(w);
+
+	return 0;
+}